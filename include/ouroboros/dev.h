@@ -28,6 +28,7 @@
 
 #include <unistd.h>
 #include <time.h>
+#include <sys/uio.h>
 
 __BEGIN_DECLS
 
@@ -50,6 +51,31 @@ ssize_t flow_read(int    fd,
                   void * buf,
                   size_t count);
 
+/* One SDU per iovec, returns the number of SDUs written. */
+ssize_t flow_writev(int                  fd,
+                    const struct iovec * iov,
+                    int                  iovcnt);
+
+/* One SDU per iovec, returns the number of SDUs read. */
+ssize_t flow_readv(int            fd,
+                   struct iovec * iov,
+                   int            iovcnt);
+
+/* Zero-copy I/O, returns an SDU that is filled or read in place. */
+ssize_t flow_sdu_reserve(int     fd,
+                         void ** buf,
+                         size_t  count);
+
+int     flow_sdu_commit(int     fd,
+                        ssize_t sdu,
+                        size_t  count);
+
+ssize_t flow_sdu_read(int           fd,
+                      const void ** buf,
+                      size_t *      count);
+
+int     flow_sdu_release(ssize_t sdu);
+
 __END_DECLS
 
 #endif /* OUROBOROS_DEV_H */
@@ -48,6 +48,11 @@
 #define FRCTFRESCNTRL 00000001 /* Feedback from receiver */
 #define FRCTFRTX      00000002 /* Reliable flow          */
 
+/* FRCT congestion control */
+#define FRCTCCNONE    0        /* No congestion control  */
+#define FRCTCCAIMD    1        /* AIMD, NewReno-like     */
+#define FRCTCCDELAY   2        /* Delay-based, Vegas-like */
+
 /* Flow operations */
 #define FLOWSRCVTIMEO 00000001 /* Set read timeout       */
 #define FLOWGRCVTIMEO 00000002 /* Get read timeout       */
@@ -58,9 +63,16 @@
 #define FLOWGFLAGS    00000007 /* Get flags for flow     */
 #define FLOWGRXQLEN   00000010 /* Get queue length on rx */
 #define FLOWGTXQLEN   00000011 /* Get queue length on tx */
+#define FLOWSRCVSPIN  00000012 /* Set read spin budget   */
+#define FLOWGRCVSPIN  00000013 /* Get read spin budget   */
 
 /* FRCT operations */
 #define FRCTGFLAGS    00001000 /* Get flags for FRCT     */
+#define FRCTGSRTT     00001001 /* Get smoothed rtt       */
+#define FRCTGRTTVAR   00001002 /* Get rtt variation      */
+#define FRCTGRTO      00001003 /* Get retransmit timeout */
+#define FRCTSCC       00001004 /* Set congestion control */
+#define FRCTGCC       00001005 /* Get congestion control */
 
 __BEGIN_DECLS
 
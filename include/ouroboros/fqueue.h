@@ -72,6 +72,9 @@ int         fevent(fset_t *                set,
                    fqueue_t *              fq,
                    const struct timespec * timeo);
 
+int         fset_spin(fset_t *                set,
+                      const struct timespec * spin);
+
 __END_DECLS
 
 #endif /* OUROBOROS_FQUEUE_H */
@@ -29,26 +29,43 @@
 
 struct htable;
 
-/* Buckets is rounded up to the nearest power of 2 */
+/*
+ * Buckets is rounded up to the nearest power of 2, the table grows
+ * when needed. Set hash_key unless the keys are uniformly spread.
+ */
 struct htable * htable_create(uint64_t buckets,
                               bool     hash_key);
 
+/* Copies the table, dup copies the blocks of memory if there are any */
+struct htable * htable_copy(struct htable * table,
+                            void *          (* dup)(const void * val,
+                                                    size_t       len));
+
 void            htable_destroy(struct htable * table);
 
 void            htable_flush(struct htable * table);
 
-/* Passes ownership of the block of memory */
+/* Passes ownership of the block of memory, len > 0 */
 int             htable_insert(struct htable * table,
                               uint64_t        key,
                               void *          val,
                               size_t          len);
 
+/* Stores the value in the table itself */
+int             htable_insert_num(struct htable * table,
+                                  uint64_t        key,
+                                  int64_t         val);
+
 /* The block of memory returned is no copy */
 int             htable_lookup(struct htable * table,
                               uint64_t        key,
                               void **         val,
                               size_t *        len);
 
+int             htable_lookup_num(struct htable * table,
+                                  uint64_t        key,
+                                  int64_t *       val);
+
 int             htable_delete(struct htable * table,
                               uint64_t        key);
 
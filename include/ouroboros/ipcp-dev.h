@@ -43,6 +43,16 @@ int  ipcp_flow_read(int                   fd,
 int  ipcp_flow_write(int                  fd,
                      struct shm_du_buff * sdb);
 
+/* Returns the number of SDUs read, at most n. */
+int  ipcp_flow_read_batch(int                   fd,
+                          struct shm_du_buff ** sdb,
+                          size_t                n);
+
+/* Returns the number of SDUs written, the rest remain with the caller. */
+int  ipcp_flow_write_batch(int                   fd,
+                           struct shm_du_buff ** sdb,
+                           size_t                n);
+
 void ipcp_flow_fini(int fd);
 
 int  ipcp_flow_get_qoscube(int         fd,
@@ -50,12 +50,14 @@ enum pol_addr_auth {
 
 enum pol_routing {
         ROUTING_LINK_STATE = 0,
-        ROUTING_LINK_STATE_LFA
+        ROUTING_LINK_STATE_LFA,
+        ROUTING_LINK_STATE_ECMP
 };
 
 enum pol_pff {
         PFF_SIMPLE = 0,
-        PFF_ALTERNATE
+        PFF_ALTERNATE,
+        PFF_MULTIPATH
 };
 
 enum pol_dir_hash {
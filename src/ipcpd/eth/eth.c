@@ -271,6 +271,9 @@ static int eth_data_init(void)
         eth_data.np1_flows = fset_create();
         if (eth_data.np1_flows == NULL)
                 goto fail_np1_flows;
+#ifdef IPCP_BUSY_POLL
+        fset_spin(eth_data.np1_flows, NULL);
+#endif
 
         for (i = 0; i < SYS_MAX_FLOWS; ++i) {
 #if defined(BUILD_ETH_DIX)
@@ -1306,7 +1309,7 @@ static int eth_ipcp_bootstrap(const struct ipcp_config * conf)
         eth_data.mtu = MIN((int) ETH_MTU_MAX, ifr.ifr_mtu);
 
 #ifndef SHM_RDRB_MULTI_BLOCK
-        maxsz = SHM_RDRB_BLOCK_SIZE - 5 * sizeof(size_t) -
+        maxsz = SHM_RDRB_LARGE_BLOCK - 5 * sizeof(size_t) -
                 (DU_BUFF_HEADSPACE + DU_BUFF_TAILSPACE);
         if ((size_t) eth_data.mtu > maxsz ) {
                 log_dbg("Layer MTU truncated to shm block size.");
@@ -114,7 +114,7 @@ static void * ipcp_local_packet_loop(void * o)
                         if (idx < 0)
                                 continue;
 
-                        assert(idx < (SHM_BUFFER_SIZE));
+                        assert(idx < (SHM_RDRB_BLOCKS));
 
                         pthread_rwlock_rdlock(&local_data.lock);
 
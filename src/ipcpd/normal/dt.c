@@ -473,7 +473,7 @@ static void packet_handler(int                  fd,
                 }
 
                 /* FIXME: Use qoscube from PCI instead of incoming flow. */
-                ofd = pff_nhop(dt.pff[qc], dt_pci.dst_addr);
+                ofd = pff_nhop(dt.pff[qc], dt_pci.dst_addr, dt_pci.eid, qc);
                 if (ofd < 0) {
                         log_dbg("No next hop for %" PRIu64, dt_pci.dst_addr);
                         ipcp_sdb_release(sdb);
@@ -678,7 +678,7 @@ int dt_init(enum pol_routing pr,
         }
 
         for (i = 0; i < QOS_CUBE_MAX; ++i) {
-                dt.routing[i] = routing_i_create(dt.pff[i]);
+                dt.routing[i] = routing_i_create(dt.pff[i], i);
                 if (dt.routing[i] == NULL) {
                         for (j = 0; j < i; ++j)
                                 routing_i_destroy(dt.routing[j]);
@@ -833,7 +833,7 @@ int dt_write_packet(uint64_t             dst_addr,
         assert(sdb);
         assert(dst_addr != ipcpi.dt_addr);
 
-        fd = pff_nhop(dt.pff[qc], dst_addr);
+        fd = pff_nhop(dt.pff[qc], dst_addr, np1_fd, qc);
         if (fd < 0) {
                 log_dbg("Could not get nhop for addr %" PRIu64 ".", dst_addr);
 #ifdef IPCP_FLOW_STATS
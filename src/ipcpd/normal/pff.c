@@ -28,6 +28,7 @@
 #include "pff.h"
 #include "pol-pff-ops.h"
 #include "pol/alternate_pff.h"
+#include "pol/multipath_pff.h"
 #include "pol/simple_pff.h"
 
 struct pff {
@@ -52,6 +53,10 @@ struct pff * pff_create(enum pol_pff pol)
                 log_dbg("Using simple PFF policy.");
                 pff->ops = &simple_pff_ops;
                 break;
+        case PFF_MULTIPATH:
+                log_dbg("Using multipath PFF policy.");
+                pff->ops = &multipath_pff_ops;
+                break;
         default:
                 goto err;
         }
@@ -110,10 +115,30 @@ void pff_flush(struct pff * pff)
         return pff->ops->flush(pff->pff_i);
 }
 
+/* Mix the fields so flows to one destination spread over the hops. */
+static uint64_t flow_hash(uint64_t  addr,
+                          uint32_t  eid,
+                          qoscube_t qc)
+{
+        uint64_t h;
+
+        h = addr ^ ((uint64_t) eid << 32 | (uint64_t) qc);
+
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+
+        return h;
+}
+
 int pff_nhop(struct pff * pff,
-             uint64_t     addr)
+             uint64_t     addr,
+             uint32_t     eid,
+             qoscube_t    qc)
 {
-        return pff->ops->nhop(pff->pff_i, addr);
+        return pff->ops->nhop(pff->pff_i, addr, flow_hash(addr, eid, qc));
 }
 
 int pff_flow_state_change(struct pff * pff,
@@ -24,6 +24,7 @@
 #define OUROBOROS_IPCPD_NORMAL_PFF_H
 
 #include <ouroboros/ipcp.h>
+#include <ouroboros/qoscube.h>
 
 #include <stdint.h>
 #include <stdlib.h>
@@ -52,9 +53,11 @@ int          pff_del(struct pff * pff,
 
 void         pff_flush(struct pff * pff);
 
-/* Returns fd towards next hop */
+/* Returns fd towards next hop, the same for all PDUs of a flow */
 int          pff_nhop(struct pff * pff,
-                      uint64_t     addr);
+                      uint64_t     addr,
+                      uint32_t     eid,
+                      qoscube_t    qc);
 
 int          pff_flow_state_change(struct pff * pff,
                                    int          fd,
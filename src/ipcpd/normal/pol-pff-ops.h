@@ -51,8 +51,10 @@ struct pol_pff_ops {
 
         void           (* flush)(struct pff_i * pff_i);
 
+        /* The hash identifies the flow, for policies that spread. */
         int            (* nhop)(struct pff_i * pff_i,
-                                uint64_t       addr);
+                                uint64_t       addr,
+                                uint64_t       hash);
 
         /* Optional operation. */
         int            (* flow_state_change)(struct pff_i * pff_i,
@@ -23,6 +23,8 @@
 #ifndef OUROBOROS_IPCPD_NORMAL_POL_ROUTING_OPS_H
 #define OUROBOROS_IPCPD_NORMAL_POL_ROUTING_OPS_H
 
+#include <ouroboros/qoscube.h>
+
 #include "pff.h"
 
 struct pol_routing_ops {
@@ -30,7 +32,8 @@ struct pol_routing_ops {
 
         void               (* fini)(void);
 
-        struct routing_i * (* routing_i_create)(struct pff * pff);
+        struct routing_i * (* routing_i_create)(struct pff * pff,
+                                                qoscube_t    qc);
 
         void               (* routing_i_destroy)(struct routing_i * instance);
 };
@@ -32,6 +32,7 @@
 #include <assert.h>
 #include <pthread.h>
 
+#include "rcu.h"
 #include "alternate_pff.h"
 
 struct nhop {
@@ -45,13 +46,13 @@ struct addr {
 };
 
 struct pff_i {
-        struct htable *  table;
+        struct rcu_table table;
 
         struct list_head addrs;
 
         struct list_head nhops_down;
 
-        pthread_rwlock_t lock;
+        pthread_mutex_t  lock;
 };
 
 struct pol_pff_ops alternate_pff_ops = {
@@ -171,16 +172,36 @@ static bool nhops_down_has(struct pff_i * pff_i,
         return false;
 }
 
+static void * dup_nhops(const void * val,
+                        size_t       len)
+{
+        int * fds;
+
+        /* Primary hop is kept at the end */
+        fds = malloc(sizeof(*fds) * (len + 1));
+        if (fds == NULL)
+                return NULL;
+
+        memcpy(fds, val, sizeof(*fds) * (len + 1));
+
+        return fds;
+}
+
 static int add_to_htable(struct pff_i * pff_i,
                          uint64_t       addr,
                          int *          fd,
                          size_t         len)
 {
-        int * val;
+        struct htable * table;
+        int *           val;
 
         assert(pff_i);
         assert(len > 0);
 
+        table = rcu_table_wr(&pff_i->table);
+        if (table == NULL)
+                goto fail_malloc;
+
         val = malloc(sizeof(*val) * (len + 1));
         if (val == NULL)
                 goto fail_malloc;
@@ -189,7 +210,7 @@ static int add_to_htable(struct pff_i * pff_i,
         /* Put primary hop again at the end */
         val[len] = val[0];
 
-        if (htable_insert(pff_i->table, addr, val, len))
+        if (htable_insert(table, addr, val, len))
                 goto fail_insert;
 
         return 0;
@@ -208,11 +229,10 @@ struct pff_i * alternate_pff_create(void)
         if (tmp == NULL)
                 goto fail_malloc;
 
-        if (pthread_rwlock_init(&tmp->lock, NULL))
+        if (pthread_mutex_init(&tmp->lock, NULL))
                 goto fail_lock;
 
-        tmp->table = htable_create(PFT_SIZE, false);
-        if (tmp->table == NULL)
+        if (rcu_table_init(&tmp->table, PFT_SIZE, dup_nhops))
                 goto fail_table;
 
         list_head_init(&tmp->nhops_down);
@@ -221,7 +241,7 @@ struct pff_i * alternate_pff_create(void)
         return tmp;
 
  fail_table:
-        pthread_rwlock_destroy(&tmp->lock);
+        pthread_mutex_destroy(&tmp->lock);
  fail_lock:
         free(tmp);
  fail_malloc:
@@ -232,21 +252,23 @@ void alternate_pff_destroy(struct pff_i * pff_i)
 {
         assert(pff_i);
 
-        htable_destroy(pff_i->table);
+        rcu_table_fini(&pff_i->table);
         del_nhops_down(pff_i);
         del_addrs(pff_i);
-        pthread_rwlock_destroy(&pff_i->lock);
+        pthread_mutex_destroy(&pff_i->lock);
         free(pff_i);
 }
 
 void alternate_pff_lock(struct pff_i * pff_i)
 {
-        pthread_rwlock_wrlock(&pff_i->lock);
+        pthread_mutex_lock(&pff_i->lock);
 }
 
 void alternate_pff_unlock(struct pff_i * pff_i)
 {
-        pthread_rwlock_unlock(&pff_i->lock);
+        rcu_table_publish(&pff_i->table);
+
+        pthread_mutex_unlock(&pff_i->lock);
 }
 
 int alternate_pff_add(struct pff_i * pff_i,
@@ -261,7 +283,7 @@ int alternate_pff_add(struct pff_i * pff_i,
                 return -1;
 
         if (add_addr(pff_i, addr)) {
-                htable_delete(pff_i->table, addr);
+                htable_delete(rcu_table_wr(&pff_i->table), addr);
                 return -1;
         }
 
@@ -273,10 +295,16 @@ int alternate_pff_update(struct pff_i * pff_i,
                          int *          fd,
                          size_t         len)
 {
+        struct htable * table;
+
         assert(pff_i);
         assert(len > 0);
 
-        if (htable_delete(pff_i->table, addr))
+        table = rcu_table_wr(&pff_i->table);
+        if (table == NULL)
+                return -ENOMEM;
+
+        if (htable_delete(table, addr))
                 return -1;
 
         if (add_to_htable(pff_i, addr, fd, len))
@@ -288,11 +316,17 @@ int alternate_pff_update(struct pff_i * pff_i,
 int alternate_pff_del(struct pff_i * pff_i,
                       uint64_t       addr)
 {
+        struct htable * table;
+
         assert(pff_i);
 
         del_addr(pff_i, addr);
 
-        if (htable_delete(pff_i->table, addr))
+        table = rcu_table_wr(&pff_i->table);
+        if (table == NULL)
+                return -ENOMEM;
+
+        if (htable_delete(table, addr))
                 return -1;
 
         return 0;
@@ -302,7 +336,7 @@ void alternate_pff_flush(struct pff_i * pff_i)
 {
         assert(pff_i);
 
-        htable_flush(pff_i->table);
+        rcu_table_flush(&pff_i->table);
 
         del_nhops_down(pff_i);
 
@@ -310,24 +344,24 @@ void alternate_pff_flush(struct pff_i * pff_i)
 }
 
 int alternate_pff_nhop(struct pff_i * pff_i,
-                       uint64_t       addr)
+                       uint64_t       addr,
+                       uint64_t       hash)
 {
         int    fd = -1;
         size_t len;
         void * el;
+        int    tok;
 
-        assert(pff_i);
+        (void) hash;
 
-        pthread_rwlock_rdlock(&pff_i->lock);
+        assert(pff_i);
 
-        if (htable_lookup(pff_i->table, addr, &el, &len)) {
-                pthread_rwlock_unlock(&pff_i->lock);
-                return -1;
-        }
+        tok = rcu_read_lock(pff_i->table.rcu);
 
-        fd = *((int *) el);
+        if (!htable_lookup(rcu_table_rd(&pff_i->table), addr, &el, &len))
+                fd = *((int *) el);
 
-        pthread_rwlock_unlock(&pff_i->lock);
+        rcu_read_unlock(pff_i->table.rcu, tok);
 
         return fd;
 }
@@ -337,6 +371,7 @@ int alternate_flow_state_change(struct pff_i * pff_i,
                                 bool           up)
 {
         struct list_head * pos = NULL;
+        struct htable *    table;
         size_t             len;
         void *             el;
         int *              fds;
@@ -345,26 +380,25 @@ int alternate_flow_state_change(struct pff_i * pff_i,
 
         assert(pff_i);
 
-        pthread_rwlock_wrlock(&pff_i->lock);
+        alternate_pff_lock(pff_i);
 
         if (up) {
-                if (del_nhop_down(pff_i, fd)) {
-                        pthread_rwlock_unlock(&pff_i->lock);
-                        return -1;
-                }
+                if (del_nhop_down(pff_i, fd))
+                        goto fail;
         } else {
-                if (add_nhop_down(pff_i, fd)) {
-                        pthread_rwlock_unlock(&pff_i->lock);
-                        return -1;
-                }
+                if (add_nhop_down(pff_i, fd))
+                        goto fail;
         }
 
+        /* Switch hops in a copy, lookups see all changes at once. */
+        table = rcu_table_wr(&pff_i->table);
+        if (table == NULL)
+                goto fail;
+
         list_for_each(pos, &pff_i->addrs) {
                 struct addr * e = list_entry(pos, struct addr, next);
-                if (htable_lookup(pff_i->table, e->addr, &el, &len)) {
-                        pthread_rwlock_unlock(&pff_i->lock);
-                        return -1;
-                }
+                if (htable_lookup(table, e->addr, &el, &len))
+                        goto fail_lookup;
 
                 fds = (int *) el;
 
@@ -397,7 +431,13 @@ int alternate_flow_state_change(struct pff_i * pff_i,
                 }
         }
 
-        pthread_rwlock_unlock(&pff_i->lock);
+        alternate_pff_unlock(pff_i);
 
         return 0;
+
+ fail_lookup:
+        rcu_table_abort(&pff_i->table);
+ fail:
+        alternate_pff_unlock(pff_i);
+        return -1;
 }
@@ -50,7 +50,8 @@ void           alternate_pff_flush(struct pff_i * pff_i);
 
 /* Returns fd towards next hop */
 int            alternate_pff_nhop(struct pff_i * pff_i,
-                                  uint64_t       addr);
+                                  uint64_t       addr,
+                                  uint64_t       hash);
 
 int            alternate_flow_state_change(struct pff_i * pff_i,
                                            int            fd,
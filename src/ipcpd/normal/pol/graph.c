@@ -30,7 +30,10 @@
 
 #include <ouroboros/logs.h>
 #include <ouroboros/errno.h>
+#include <ouroboros/hashtable.h>
 #include <ouroboros/list.h>
+#include <ouroboros/qoscube.h>
+#include <ouroboros/utils.h>
 
 #include "graph.h"
 #include "ipcp.h"
@@ -38,13 +41,23 @@
 #include <assert.h>
 #include <pthread.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <limits.h>
 #include <string.h>
+#include <unistd.h>
+
+#define VERTEX_BUCKETS 256
+#define HEAP_INIT      64
+#define DIST_INF       INT_MAX
+#define SPF_WORKERS    31 /* besides the calling thread */
+#define WEIGHT_MAX     0xFFFF
+#define REF_BW         100000000000ULL /* bits/s, capacity of weight 1 */
 
 struct edge {
         struct list_head next;
         struct vertex *  nb;
-        qosspec_t        qs;
+        qosspec_t        qs;     /* metrics announced by this side */
+        int              weight[QOS_CUBE_MAX];
         int              announced;
 };
 
@@ -52,15 +65,143 @@ struct vertex {
         struct list_head next;
         uint64_t         addr;
         struct list_head edges;
-        int              index;
+        int              index; /* stable while in the graph */
+};
+
+/*
+ * Compressed sparse row snapshot of the edges that both sides
+ * announced, rebuilt for the first full SPF after a change. The
+ * neighbours of vertex i are nbs[off[i]] up to nbs[off[i + 1]], the
+ * weights of those edges for a cube are at the same offsets in w.
+ */
+struct csr {
+        size_t     n;
+        size_t *   off;
+        int *      nbs;
+        int *      w[QOS_CUBE_MAX];
+};
+
+/*
+ * Shortest path tree from a root, kept up to date on link changes.
+ * Arrays are indexed on vertex index and sized to the graph capacity.
+ */
+struct spt {
+        struct list_head next;
+        int              root;
+        qoscube_t        qc;     /* the weights it is calculated with */
+        int *            dist;
+        int *            nhop;   /* index of the first hop, -1 if none */
+        int *            parent; /* -1 if none */
+        bool             valid;
+        bool             used;
+};
+
+struct heap_ent {
+        int dist;
+        int v;
+};
+
+struct heap {
+        struct heap_ent * ents;
+        size_t            len;
+        size_t            cap;
+};
+
+/*
+ * Workers that calculate trees in full, next to the calling thread.
+ * Each tree is written by one thread only, the CSR is read-only while
+ * they run.
+ */
+struct spf_pool {
+        pthread_t *      workers;
+        size_t           n_workers;
+
+        struct spt **    tasks;
+        size_t           n_tasks;
+        size_t           next;
+        size_t           done;
+        int              err;
+        size_t           round;
+        bool             started;
+        bool             stop;
+
+        pthread_mutex_t  mtx;
+        pthread_cond_t   cond;
 };
 
 struct graph {
         size_t           nr_vertices;
+        size_t           nr_edges;
         struct list_head vertices;
+        struct htable *  index;    /* addr -> vertex */
+
+        struct vertex ** vtx;      /* index -> vertex */
+        size_t           cap;
+        size_t           n_idx;    /* indices handed out */
+        int *            free_idx;
+        size_t           n_free;
+
+        struct csr       csr;
+        bool             dirty;
+
+        struct list_head spts;
+        struct spf_pool  pool;
+
         pthread_mutex_t  lock;
 };
 
+static int heap_push(struct heap * h,
+                     int           dist,
+                     int           v)
+{
+        size_t i;
+
+        if (h->len == h->cap) {
+                size_t            cap = h->cap == 0 ? HEAP_INIT : h->cap << 1;
+                struct heap_ent * ents;
+
+                ents = realloc(h->ents, cap * sizeof(*ents));
+                if (ents == NULL)
+                        return -ENOMEM;
+
+                h->ents = ents;
+                h->cap  = cap;
+        }
+
+        i = h->len++;
+
+        while (i > 0 && h->ents[(i - 1) >> 1].dist > dist) {
+                h->ents[i] = h->ents[(i - 1) >> 1];
+                i = (i - 1) >> 1;
+        }
+
+        h->ents[i].dist = dist;
+        h->ents[i].v    = v;
+
+        return 0;
+}
+
+static struct heap_ent heap_pop(struct heap * h)
+{
+        struct heap_ent top  = h->ents[0];
+        struct heap_ent last = h->ents[--h->len];
+        size_t          i    = 0;
+        size_t          c;
+
+        while ((c = 2 * i + 1) < h->len) {
+                if (c + 1 < h->len && h->ents[c + 1].dist < h->ents[c].dist)
+                        ++c;
+                if (last.dist <= h->ents[c].dist)
+                        break;
+                h->ents[i] = h->ents[c];
+                i = c;
+        }
+
+        h->ents[i] = last;
+
+        return top;
+}
+
 static struct edge * find_edge_by_addr(struct vertex * vertex,
                                        uint64_t        dst_addr)
 {
@@ -78,18 +219,168 @@ static struct edge * find_edge_by_addr(struct vertex * vertex,
 static struct vertex * find_vertex_by_addr(struct graph * graph,
                                            uint64_t       addr)
 {
-        struct list_head * p = NULL;
+        int64_t v;
 
-        list_for_each(p, &graph->vertices) {
-                struct vertex * e = list_entry(p, struct vertex, next);
-                if (e->addr == addr)
-                        return e;
+        if (htable_lookup_num(graph->index, addr, &v))
+                return NULL;
+
+        return (struct vertex *) (uintptr_t) v;
+}
+
+static void spt_clear(struct spt * spt,
+                      size_t       from,
+                      size_t       to)
+{
+        size_t i;
+
+        for (i = from; i < to; ++i) {
+                spt->dist[i]   = DIST_INF;
+                spt->nhop[i]   = -1;
+                spt->parent[i] = -1;
         }
+}
+
+static void spt_destroy(struct spt * spt)
+{
+        list_del(&spt->next);
+
+        free(spt->dist);
+        free(spt->nhop);
+        free(spt->parent);
+        free(spt);
+}
+
+static struct spt * spt_create(struct graph * graph,
+                               int            root,
+                               qoscube_t      qc)
+{
+        struct spt * spt;
+
+        spt = malloc(sizeof(*spt));
+        if (spt == NULL)
+                goto fail_malloc;
+
+        spt->dist   = malloc(sizeof(*spt->dist) * graph->cap);
+        spt->nhop   = malloc(sizeof(*spt->nhop) * graph->cap);
+        spt->parent = malloc(sizeof(*spt->parent) * graph->cap);
+        if (spt->dist == NULL || spt->nhop == NULL || spt->parent == NULL)
+                goto fail_arr;
+
+        spt->root  = root;
+        spt->qc    = qc;
+        spt->valid = false;
+        spt->used  = false;
+
+        list_add(&spt->next, &graph->spts);
+
+        return spt;
 
+ fail_arr:
+        free(spt->dist);
+        free(spt->nhop);
+        free(spt->parent);
+        free(spt);
+ fail_malloc:
         return NULL;
 }
 
-static struct edge * add_edge(struct vertex * vertex,
+static int grow(struct graph * graph)
+{
+        struct list_head * p;
+        struct list_head * h;
+        size_t             cap = graph->cap << 1;
+        void *             tmp;
+
+        tmp = realloc(graph->vtx, sizeof(*graph->vtx) * cap);
+        if (tmp == NULL)
+                return -ENOMEM;
+        graph->vtx = tmp;
+
+        tmp = realloc(graph->free_idx, sizeof(*graph->free_idx) * cap);
+        if (tmp == NULL)
+                return -ENOMEM;
+        graph->free_idx = tmp;
+
+        /* Trees that cannot grow are recalculated when needed. */
+        list_for_each_safe(p, h, &graph->spts) {
+                struct spt * spt = list_entry(p, struct spt, next);
+                int *        arr[3];
+                int          i;
+
+                arr[0] = realloc(spt->dist, sizeof(int) * cap);
+                if (arr[0] != NULL)
+                        spt->dist = arr[0];
+                arr[1] = realloc(spt->nhop, sizeof(int) * cap);
+                if (arr[1] != NULL)
+                        spt->nhop = arr[1];
+                arr[2] = realloc(spt->parent, sizeof(int) * cap);
+                if (arr[2] != NULL)
+                        spt->parent = arr[2];
+
+                for (i = 0; i < 3; ++i)
+                        if (arr[i] == NULL)
+                                break;
+
+                if (i < 3)
+                        spt_destroy(spt);
+                else
+                        spt_clear(spt, graph->cap, cap);
+        }
+
+        graph->cap = cap;
+
+        return 0;
+}
+
+/* Cubes with a delay bound route on the link delay. */
+static bool delay_bound(qoscube_t qc)
+{
+        return qos_cube_to_spec(qc).delay != UINT32_MAX;
+}
+
+bool graph_same_weights(qoscube_t a,
+                        qoscube_t b)
+{
+        return delay_bound(a) == delay_bound(b);
+}
+
+/*
+ * Cubes with a delay bound route on the link delay, the others on the
+ * link capacity. Metrics that are not known count as a single hop.
+ */
+static int link_weight(const qosspec_t * qs,
+                       qoscube_t         qc)
+{
+        uint64_t w;
+
+        if (delay_bound(qc)) {
+                w = qs->delay == UINT32_MAX ? 0 : qs->delay;
+                return 1 + MIN(w, WEIGHT_MAX - 1);
+        }
+
+        if (qs->bandwidth == 0)
+                return 1;
+
+        w = REF_BW / qs->bandwidth;
+
+        return MAX(MIN(w, WEIGHT_MAX), 1);
+}
+
+/* Both directions get the weight of the worst side. */
+static void set_weights(struct edge * e,
+                        struct edge * nb_e)
+{
+        int qc;
+
+        for (qc = 0; qc < QOS_CUBE_MAX; ++qc) {
+                e->weight[qc] = MAX(link_weight(&e->qs, qc),
+                                    link_weight(&nb_e->qs, qc));
+                nb_e->weight[qc] = e->weight[qc];
+        }
+}
+
+static struct edge * add_edge(struct graph *  graph,
+                              struct vertex * vertex,
                               struct vertex * nb)
 {
         struct edge * edge;
@@ -101,24 +392,31 @@ static struct edge * add_edge(struct vertex * vertex,
         list_head_init(&edge->next);
         edge->nb = nb;
         edge->announced = 0;
+        memset(&edge->qs, 0, sizeof(edge->qs));
 
         list_add(&edge->next, &vertex->edges);
 
+        graph->nr_edges++;
+
         return edge;
 }
 
-static void del_edge(struct edge * edge)
+static void del_edge(struct graph * graph,
+                     struct edge *  edge)
 {
        list_del(&edge->next);
        free(edge);
+
+       graph->nr_edges--;
 }
 
 static struct vertex * add_vertex(struct graph * graph,
                                   uint64_t       addr)
 {
-        struct vertex *    vertex;
-        struct list_head * p;
-        int                i = 0;
+        struct vertex * vertex;
+
+        if (graph->n_free == 0 && graph->n_idx == graph->cap && grow(graph))
+                return NULL;
 
         vertex = malloc(sizeof(*vertex));
         if (vertex == NULL)
@@ -128,31 +426,27 @@ static struct vertex * add_vertex(struct graph * graph,
         list_head_init(&vertex->edges);
         vertex->addr = addr;
 
-        /* Keep them ordered on address. */
-        list_for_each(p, &graph->vertices) {
-                struct vertex * v = list_entry(p, struct vertex, next);
-                if (v->addr > addr)
-                        break;
-                i++;
+        if (htable_insert_num(graph->index, addr,
+                              (int64_t) (uintptr_t) vertex)) {
+                free(vertex);
+                return NULL;
         }
 
-        vertex->index = i;
+        if (graph->n_free > 0)
+                vertex->index = graph->free_idx[--graph->n_free];
+        else
+                vertex->index = graph->n_idx++;
 
-        list_add_tail(&vertex->next, p);
+        graph->vtx[vertex->index] = vertex;
 
-        /* Increase the index of the vertices to the right. */
-        list_for_each(p, &graph->vertices) {
-                struct vertex * v = list_entry(p, struct vertex, next);
-                if (v->addr > addr)
-                        v->index++;
-        }
+        list_add_tail(&vertex->next, &graph->vertices);
 
         graph->nr_vertices++;
 
         return vertex;
 }
 
-static void del_vertex(struct graph * graph,
+static void del_vertex(struct graph *  graph,
                        struct vertex * vertex)
 {
         struct list_head * p = NULL;
@@ -160,40 +454,578 @@ static void del_vertex(struct graph * graph,
 
         list_del(&vertex->next);
 
-        /* Decrease the index of the vertices to the right. */
-        list_for_each(p, &graph->vertices) {
-                struct vertex * v = list_entry(p, struct vertex, next);
-                if (v->addr > vertex->addr)
-                        v->index--;
-        }
+        htable_delete(graph->index, vertex->addr);
 
         list_for_each_safe(p, n, &vertex->edges) {
                 struct edge * e = list_entry(p, struct edge, next);
-                del_edge(e);
+                del_edge(graph, e);
+        }
+
+        list_for_each_safe(p, n, &graph->spts) {
+                struct spt * spt = list_entry(p, struct spt, next);
+                if (spt->root == vertex->index)
+                        spt_destroy(spt);
+                else
+                        spt_clear(spt, vertex->index, vertex->index + 1);
         }
 
+        graph->vtx[vertex->index] = NULL;
+        graph->free_idx[graph->n_free++] = vertex->index;
+
         free(vertex);
 
         graph->nr_vertices--;
 }
 
+static void csr_free(struct csr * csr)
+{
+        int qc;
+
+        for (qc = 0; qc < QOS_CUBE_MAX; ++qc)
+                free(csr->w[qc]);
+
+        free(csr->off);
+        free(csr->nbs);
+
+        memset(csr, 0, sizeof(*csr));
+}
+
+static int csr_build(struct graph * graph)
+{
+        struct csr *       csr = &graph->csr;
+        struct list_head * p;
+        size_t             i;
+        size_t             k = 0;
+        int                qc;
+
+        if (!graph->dirty)
+                return 0;
+
+        csr_free(csr);
+
+        csr->off = malloc(sizeof(*csr->off) * (graph->n_idx + 1));
+        if (csr->off == NULL)
+                return -ENOMEM;
+
+        csr->nbs = malloc(sizeof(*csr->nbs) * (graph->nr_edges + 1));
+        if (csr->nbs == NULL)
+                goto fail;
+
+        for (qc = 0; qc < QOS_CUBE_MAX; ++qc) {
+                csr->w[qc] = malloc(sizeof(int) * (graph->nr_edges + 1));
+                if (csr->w[qc] == NULL)
+                        goto fail;
+        }
+
+        for (i = 0; i < graph->n_idx; ++i) {
+                struct vertex * v = graph->vtx[i];
+                csr->off[i] = k;
+                if (v == NULL)
+                        continue;
+                list_for_each(p, &v->edges) {
+                        struct edge * e = list_entry(p, struct edge, next);
+                        /* Only include it if both sides announced it. */
+                        if (e->announced != 2)
+                                continue;
+                        for (qc = 0; qc < QOS_CUBE_MAX; ++qc)
+                                csr->w[qc][k] = e->weight[qc];
+                        csr->nbs[k++] = e->nb->index;
+                }
+        }
+
+        csr->off[i] = k;
+        csr->n      = i;
+
+        graph->dirty = false;
+
+        return 0;
+ fail:
+        csr_free(csr);
+        return -ENOMEM;
+}
+
+/* Dijkstra on the CSR, lazy deletion instead of decreasing keys. */
+static int spt_full(struct graph * graph,
+                    struct spt *   spt)
+{
+        struct csr * csr = &graph->csr;
+        struct heap  heap;
+        size_t       i;
+        int *        w;
+        int          alt;
+
+        spt->valid = false;
+
+        if (csr_build(graph))
+                return -ENOMEM;
+
+        memset(&heap, 0, sizeof(heap));
+
+        w = csr->w[spt->qc];
+
+        spt_clear(spt, 0, graph->cap);
+
+        spt->dist[spt->root] = 0;
+        if (heap_push(&heap, 0, spt->root))
+                return -ENOMEM;
+
+        while (heap.len > 0) {
+                struct heap_ent h = heap_pop(&heap);
+                int             v = h.v;
+
+                if (h.dist > spt->dist[v])
+                        continue;
+
+                for (i = csr->off[v]; i < csr->off[v + 1]; ++i) {
+                        int nb = csr->nbs[i];
+
+                        alt = spt->dist[v] + w[i];
+                        if (alt >= spt->dist[nb])
+                                continue;
+
+                        spt->dist[nb]   = alt;
+                        spt->parent[nb] = v;
+                        spt->nhop[nb]   = v == spt->root ? nb : spt->nhop[v];
+                        if (heap_push(&heap, alt, nb)) {
+                                free(heap.ents);
+                                return -ENOMEM;
+                        }
+                }
+        }
+
+        free(heap.ents);
+
+        spt->valid = true;
+
+        return 0;
+}
+
+/* Propagate decreased distances from the vertices in the heap. */
+static int spt_relax(struct graph * graph,
+                     struct spt *   spt,
+                     struct heap *  heap)
+{
+        struct list_head * p;
+        int                alt;
+
+        while (heap->len > 0) {
+                struct heap_ent h = heap_pop(heap);
+                int             v = h.v;
+
+                if (h.dist > spt->dist[v])
+                        continue;
+
+                list_for_each(p, &graph->vtx[v]->edges) {
+                        struct edge * e  = list_entry(p, struct edge, next);
+                        int           nb = e->nb->index;
+
+                        if (e->announced != 2)
+                                continue;
+
+                        alt = spt->dist[v] + e->weight[spt->qc];
+                        if (alt >= spt->dist[nb])
+                                continue;
+
+                        spt->dist[nb]   = alt;
+                        spt->parent[nb] = v;
+                        spt->nhop[nb]   = v == spt->root ? nb : spt->nhop[v];
+                        if (heap_push(heap, alt, nb))
+                                return -ENOMEM;
+                }
+        }
+
+        return 0;
+}
+
+/* Only the vertices that get closer through the new link change. */
+static int spt_link_up(struct graph * graph,
+                       struct spt *   spt,
+                       int            u,
+                       int            v,
+                       int            w)
+{
+        struct heap heap;
+        int         ends[2];
+        int         i;
+        int         ret = 0;
+
+        memset(&heap, 0, sizeof(heap));
+
+        ends[0] = u;
+        ends[1] = v;
+
+        for (i = 0; i < 2 && ret == 0; ++i) {
+                int a = ends[i];
+                int b = ends[1 - i];
+
+                if (spt->dist[a] == DIST_INF ||
+                    spt->dist[a] + w >= spt->dist[b])
+                        continue;
+
+                spt->dist[b]   = spt->dist[a] + w;
+                spt->parent[b] = a;
+                spt->nhop[b]   = a == spt->root ? b : spt->nhop[a];
+                ret = heap_push(&heap, spt->dist[b], b);
+        }
+
+        if (ret == 0)
+                ret = spt_relax(graph, spt, &heap);
+
+        free(heap.ents);
+
+        return ret;
+}
+
+/*
+ * Only the subtree hanging off a lost tree link changes. Its vertices
+ * are reset, seeded from their neighbours outside the subtree and
+ * relaxed from there.
+ */
+static int spt_link_down(struct graph * graph,
+                         struct spt *   spt,
+                         int            u,
+                         int            v)
+{
+        struct list_head * p;
+        struct heap        heap;
+        int *              sub;
+        size_t             n = 0;
+        size_t             i;
+        int                r;
+        int                alt;
+        int                ret = -ENOMEM;
+
+        if (spt->parent[v] == u)
+                r = v;
+        else if (spt->parent[u] == v)
+                r = u;
+        else
+                return 0;
+
+        sub = malloc(sizeof(*sub) * graph->n_idx);
+        if (sub == NULL)
+                return -ENOMEM;
+
+        memset(&heap, 0, sizeof(heap));
+
+        sub[n++] = r;
+        spt_clear(spt, r, r + 1);
+
+        for (i = 0; i < n; ++i) {
+                list_for_each(p, &graph->vtx[sub[i]]->edges) {
+                        struct edge * e  = list_entry(p, struct edge, next);
+                        int           nb = e->nb->index;
+                        if (spt->parent[nb] != sub[i])
+                                continue;
+                        sub[n++] = nb;
+                        spt_clear(spt, nb, nb + 1);
+                }
+        }
+
+        for (i = 0; i < n; ++i) {
+                int x = sub[i];
+
+                list_for_each(p, &graph->vtx[x]->edges) {
+                        struct edge * e  = list_entry(p, struct edge, next);
+                        int           nb = e->nb->index;
+
+                        if (e->announced != 2 || spt->dist[nb] == DIST_INF)
+                                continue;
+
+                        alt = spt->dist[nb] + e->weight[spt->qc];
+                        if (alt >= spt->dist[x])
+                                continue;
+
+                        spt->dist[x]   = alt;
+                        spt->parent[x] = nb;
+                        spt->nhop[x]   = nb == spt->root ? x : spt->nhop[nb];
+                }
+
+                if (spt->dist[x] != DIST_INF &&
+                    heap_push(&heap, spt->dist[x], x))
+                        goto fail;
+        }
+
+        ret = spt_relax(graph, spt, &heap);
+ fail:
+        free(heap.ents);
+        free(sub);
+
+        return ret;
+}
+
+/*
+ * The weights of the link before and after the change, NULL if it
+ * was or is down. A lower weight is repaired as a new link, a higher
+ * one as a lost link.
+ */
+static void spt_link_change(struct graph *  graph,
+                            struct vertex * u,
+                            struct vertex * v,
+                            const int *     w_old,
+                            const int *     w_new)
+{
+        struct list_head * p;
+
+        list_for_each(p, &graph->spts) {
+                struct spt * spt = list_entry(p, struct spt, next);
+                int          o;
+                int          n;
+                int          ret;
+
+                if (!spt->valid)
+                        continue;
+
+                o = w_old == NULL ? DIST_INF : w_old[spt->qc];
+                n = w_new == NULL ? DIST_INF : w_new[spt->qc];
+
+                if (n < o)
+                        ret = spt_link_up(graph, spt, u->index, v->index, n);
+                else if (n > o)
+                        ret = spt_link_down(graph, spt, u->index, v->index);
+                else
+                        continue;
+
+                /* Recalculate it from scratch when needed. */
+                if (ret < 0)
+                        spt->valid = false;
+        }
+
+        graph->dirty = true;
+}
+
+/* Called with the pool mutex held. */
+static void spf_work(struct graph * graph)
+{
+        struct spf_pool * pool = &graph->pool;
+
+        while (pool->next < pool->n_tasks) {
+                struct spt * spt = pool->tasks[pool->next++];
+                int          ret;
+
+                pthread_mutex_unlock(&pool->mtx);
+                ret = spt_full(graph, spt);
+                pthread_mutex_lock(&pool->mtx);
+
+                if (ret < 0)
+                        pool->err = ret;
+
+                if (++pool->done == pool->n_tasks)
+                        pthread_cond_broadcast(&pool->cond);
+        }
+}
+
+static void * spf_worker(void * o)
+{
+        struct graph *    graph = (struct graph *) o;
+        struct spf_pool * pool  = &graph->pool;
+        size_t            round = 0;
+
+        pthread_mutex_lock(&pool->mtx);
+        pthread_cleanup_push((void (*)(void *)) pthread_mutex_unlock,
+                             (void *) &pool->mtx);
+
+        while (true) {
+                while (!pool->stop && pool->round == round)
+                        pthread_cond_wait(&pool->cond, &pool->mtx);
+
+                if (pool->stop)
+                        break;
+
+                round = pool->round;
+
+                spf_work(graph);
+        }
+
+        pthread_cleanup_pop(true);
+
+        return (void *) 0;
+}
+
+static int spf_pool_init(struct graph * graph)
+{
+        struct spf_pool * pool = &graph->pool;
+
+        memset(pool, 0, sizeof(*pool));
+
+        if (pthread_mutex_init(&pool->mtx, NULL))
+                goto fail_mtx;
+
+        if (pthread_cond_init(&pool->cond, NULL))
+                goto fail_cond;
+
+        return 0;
+
+ fail_cond:
+        pthread_mutex_destroy(&pool->mtx);
+ fail_mtx:
+        return -1;
+}
+
+/*
+ * The workers are only started when more than one tree is calculated
+ * at once, for LFA and ECMP routing. Without them, the calling thread
+ * calculates all trees.
+ */
+static void spf_pool_start(struct graph * graph)
+{
+        struct spf_pool * pool = &graph->pool;
+        long              nproc;
+        size_t            max;
+
+        pool->started = true;
+
+        nproc = sysconf(_SC_NPROCESSORS_ONLN);
+        if (nproc < 2)
+                return;
+
+        max = MIN((size_t) nproc - 1, SPF_WORKERS);
+
+        pool->workers = malloc(sizeof(*pool->workers) * max);
+        if (pool->workers == NULL)
+                return;
+
+        /* Run with fewer workers if we cannot start them all. */
+        while (pool->n_workers < max) {
+                if (pthread_create(pool->workers + pool->n_workers, NULL,
+                                   spf_worker, graph))
+                        break;
+                ++pool->n_workers;
+        }
+}
+
+static void spf_pool_fini(struct graph * graph)
+{
+        struct spf_pool * pool = &graph->pool;
+        size_t            i;
+
+        pthread_mutex_lock(&pool->mtx);
+        pool->stop = true;
+        pthread_cond_broadcast(&pool->cond);
+        pthread_mutex_unlock(&pool->mtx);
+
+        for (i = 0; i < pool->n_workers; ++i)
+                pthread_join(pool->workers[i], NULL);
+
+        free(pool->workers);
+
+        pthread_cond_destroy(&pool->cond);
+        pthread_mutex_destroy(&pool->mtx);
+}
+
+/* Calculate the trees that are not valid, in parallel. */
+static int spt_calc(struct graph * graph,
+                    struct spt **  spts,
+                    size_t         n)
+{
+        struct spf_pool * pool = &graph->pool;
+        size_t            i;
+        size_t            k = 0;
+        int               ret;
+
+        /* Move the trees to calculate to the front. */
+        for (i = 0; i < n; ++i) {
+                if (!spts[i]->valid) {
+                        struct spt * tmp = spts[k];
+                        spts[k++] = spts[i];
+                        spts[i] = tmp;
+                }
+        }
+
+        if (k == 0)
+                return 0;
+
+        if (csr_build(graph))
+                return -ENOMEM;
+
+        if (k > 1 && !pool->started)
+                spf_pool_start(graph);
+
+        if (pool->n_workers == 0 || k == 1) {
+                for (i = 0; i < k; ++i)
+                        if (spt_full(graph, spts[i]))
+                                return -ENOMEM;
+                return 0;
+        }
+
+        pthread_mutex_lock(&pool->mtx);
+        pthread_cleanup_push((void (*)(void *)) pthread_mutex_unlock,
+                             (void *) &pool->mtx);
+
+        pool->tasks   = spts;
+        pool->n_tasks = k;
+        pool->next    = 0;
+        pool->done    = 0;
+        pool->err     = 0;
+        ++pool->round;
+
+        pthread_cond_broadcast(&pool->cond);
+
+        spf_work(graph);
+
+        while (pool->done < pool->n_tasks)
+                pthread_cond_wait(&pool->cond, &pool->mtx);
+
+        ret = pool->err;
+
+        pool->tasks   = NULL;
+        pool->n_tasks = 0;
+
+        pthread_cleanup_pop(true);
+
+        return ret;
+}
+
 struct graph * graph_create(void)
 {
         struct graph * graph;
 
         graph = malloc(sizeof(*graph));
         if (graph == NULL)
-                return NULL;
+                goto fail_malloc;
 
-        if (pthread_mutex_init(&graph->lock, NULL)) {
-                free(graph);
-                return NULL;
-        }
+        if (pthread_mutex_init(&graph->lock, NULL))
+                goto fail_lock;
+
+        graph->index = htable_create(VERTEX_BUCKETS, true);
+        if (graph->index == NULL)
+                goto fail_index;
 
+        graph->vtx = malloc(sizeof(*graph->vtx) * VERTEX_BUCKETS);
+        if (graph->vtx == NULL)
+                goto fail_vtx;
+
+        graph->free_idx = malloc(sizeof(*graph->free_idx) * VERTEX_BUCKETS);
+        if (graph->free_idx == NULL)
+                goto fail_free_idx;
+
+        if (spf_pool_init(graph))
+                goto fail_pool;
+
+        graph->cap         = VERTEX_BUCKETS;
+        graph->n_idx       = 0;
+        graph->n_free      = 0;
         graph->nr_vertices = 0;
+        graph->nr_edges    = 0;
+        graph->dirty       = true;
+        memset(&graph->csr, 0, sizeof(graph->csr));
         list_head_init(&graph->vertices);
+        list_head_init(&graph->spts);
 
         return graph;
+
+ fail_pool:
+        free(graph->free_idx);
+ fail_free_idx:
+        free(graph->vtx);
+ fail_vtx:
+        htable_destroy(graph->index);
+ fail_index:
+        pthread_mutex_destroy(&graph->lock);
+ fail_lock:
+        free(graph);
+ fail_malloc:
+        return NULL;
 }
 
 void graph_destroy(struct graph * graph)
@@ -203,13 +1035,27 @@ void graph_destroy(struct graph * graph)
 
         assert(graph);
 
+        spf_pool_fini(graph);
+
         pthread_mutex_lock(&graph->lock);
 
+        list_for_each_safe(p, n, &graph->spts) {
+                struct spt * spt = list_entry(p, struct spt, next);
+                spt_destroy(spt);
+        }
+
         list_for_each_safe(p, n, &graph->vertices) {
                 struct vertex * e = list_entry(p, struct vertex, next);
                 del_vertex(graph, e);
         }
 
+        csr_free(&graph->csr);
+
+        htable_destroy(graph->index);
+
+        free(graph->vtx);
+        free(graph->free_idx);
+
         pthread_mutex_unlock(&graph->lock);
 
         pthread_mutex_destroy(&graph->lock);
@@ -226,6 +1072,8 @@ int graph_update_edge(struct graph * graph,
         struct edge *   e;
         struct vertex * nb;
         struct edge *   nb_e;
+        bool            up;
+        int             w_old[QOS_CUBE_MAX];
 
         assert(graph);
 
@@ -255,7 +1103,7 @@ int graph_update_edge(struct graph * graph,
 
         e = find_edge_by_addr(v, d_addr);
         if (e == NULL) {
-                e = add_edge(v, nb);
+                e = add_edge(graph, v, nb);
                 if (e == NULL) {
                         if (list_is_empty(&v->edges))
                                 del_vertex(graph, v);
@@ -267,15 +1115,18 @@ int graph_update_edge(struct graph * graph,
                 }
         }
 
+        up = e->announced == 2;
+        memcpy(w_old, e->weight, sizeof(w_old));
+
         e->announced++;
         e->qs = qs;
 
         nb_e = find_edge_by_addr(nb, s_addr);
         if (nb_e == NULL) {
-                nb_e = add_edge(nb, v);
+                nb_e = add_edge(graph, nb, v);
                 if (nb_e == NULL) {
                         if (--e->announced == 0)
-                                del_edge(e);
+                                del_edge(graph, e);
                         if (list_is_empty(&v->edges))
                                 del_vertex(graph, v);
                         if (list_is_empty(&nb->edges))
@@ -287,7 +1138,57 @@ int graph_update_edge(struct graph * graph,
         }
 
         nb_e->announced++;
-        nb_e->qs = qs;
+
+        set_weights(e, nb_e);
+
+        if (up != (e->announced == 2) ||
+            (up && memcmp(w_old, e->weight, sizeof(w_old))))
+                spt_link_change(graph, v, nb, up ? w_old : NULL,
+                                e->announced == 2 ? e->weight : NULL);
+
+        pthread_mutex_unlock(&graph->lock);
+
+        return 0;
+}
+
+int graph_update_edge_qos(struct graph * graph,
+                          uint64_t       s_addr,
+                          uint64_t       d_addr,
+                          qosspec_t      qs)
+{
+        struct vertex * v;
+        struct edge *   e;
+        struct vertex * nb;
+        struct edge *   nb_e;
+        int             w_old[QOS_CUBE_MAX];
+
+        assert(graph);
+
+        pthread_mutex_lock(&graph->lock);
+
+        v = find_vertex_by_addr(graph, s_addr);
+        nb = find_vertex_by_addr(graph, d_addr);
+        if (v == NULL || nb == NULL) {
+                pthread_mutex_unlock(&graph->lock);
+                log_err("No such vertex.");
+                return -1;
+        }
+
+        e = find_edge_by_addr(v, d_addr);
+        nb_e = find_edge_by_addr(nb, s_addr);
+        if (e == NULL || nb_e == NULL) {
+                pthread_mutex_unlock(&graph->lock);
+                log_err("No such edge.");
+                return -1;
+        }
+
+        memcpy(w_old, e->weight, sizeof(w_old));
+
+        e->qs = qs;
+        set_weights(e, nb_e);
+
+        if (e->announced == 2 && memcmp(w_old, e->weight, sizeof(w_old)))
+                spt_link_change(graph, v, nb, w_old, e->weight);
 
         pthread_mutex_unlock(&graph->lock);
 
@@ -302,6 +1203,7 @@ int graph_del_edge(struct graph * graph,
         struct edge *   e;
         struct vertex * nb;
         struct edge *   nb_e;
+        bool            up;
 
         assert(graph);
 
@@ -335,10 +1237,23 @@ int graph_del_edge(struct graph * graph,
                 return -1;
         }
 
-        if (--e->announced == 0)
-                del_edge(e);
-        if (--nb_e->announced == 0)
-                del_edge(nb_e);
+        up = e->announced == 2;
+
+        --e->announced;
+        --nb_e->announced;
+
+        /* The metrics of this side are withdrawn. */
+        memset(&e->qs, 0, sizeof(e->qs));
+        set_weights(e, nb_e);
+
+        if (up != (e->announced == 2))
+                spt_link_change(graph, v, nb, up ? e->weight : NULL,
+                                up ? NULL : e->weight);
+
+        if (e->announced == 0)
+                del_edge(graph, e);
+        if (nb_e->announced == 0)
+                del_edge(graph, nb_e);
 
         /* Removing vertex if it was the last edge */
         if (list_is_empty(&v->edges))
@@ -351,108 +1266,6 @@ int graph_del_edge(struct graph * graph,
         return 0;
 }
 
-static int get_min_vertex(struct graph *   graph,
-                          int *            dist,
-                          bool *           used,
-                          struct vertex ** v)
-{
-        int                min = INT_MAX;
-        int                index = -1;
-        int                i = 0;
-        struct list_head * p = NULL;
-
-        *v = NULL;
-
-        list_for_each(p, &graph->vertices) {
-                if (!used[i] && dist[i] < min) {
-                        min = dist[i];
-                        index = i;
-                        *v = list_entry(p, struct vertex, next);
-                }
-
-                i++;
-        }
-
-        if (index != -1)
-                used[index] = true;
-
-        return index;
-}
-
-static int dijkstra(struct graph *    graph,
-                    uint64_t          src,
-                    struct vertex *** nhops,
-                    int **            dist)
-{
-        bool *             used;
-        struct list_head * p = NULL;
-        int                i = 0;
-        struct vertex *    v = NULL;
-        struct edge *      e = NULL;
-        int                alt;
-
-        *nhops = malloc(sizeof(**nhops) * graph->nr_vertices);
-        if (*nhops == NULL)
-                goto fail_pnhops;
-
-        *dist = malloc(sizeof(**dist) * graph->nr_vertices);
-        if (*dist == NULL)
-                goto fail_pdist;
-
-        used = malloc(sizeof(*used) * graph->nr_vertices);
-        if (used == NULL)
-                goto fail_used;
-
-        /* Init the data structures */
-        memset(used, 0, sizeof(*used) * graph->nr_vertices);
-        memset(*nhops, 0, sizeof(**nhops) * graph->nr_vertices);
-        memset(*dist, 0, sizeof(**dist) * graph->nr_vertices);
-
-        list_for_each(p, &graph->vertices) {
-                v = list_entry(p, struct vertex, next);
-                (*dist)[i++]  = (v->addr == src) ? 0 : INT_MAX;
-        }
-
-        /* Perform actual Dijkstra */
-        i = get_min_vertex(graph, *dist, used, &v);
-        while (v != NULL) {
-                list_for_each(p, &v->edges) {
-                        e = list_entry(p, struct edge, next);
-
-                        /* Only include it if both sides announced it. */
-                        if (e->announced != 2)
-                                continue;
-
-                        /*
-                         * NOTE: Current weight is just hop count.
-                         * Method could be extended to use a different
-                         * weight for a different QoS cube.
-                         */
-                        alt = (*dist)[i] + 1;
-                        if (alt < (*dist)[e->nb->index]) {
-                                (*dist)[e->nb->index] = alt;
-                                if (v->addr == src)
-                                        (*nhops)[e->nb->index] = e->nb;
-                                else
-                                        (*nhops)[e->nb->index] = (*nhops)[i];
-                        }
-                }
-                i = get_min_vertex(graph, *dist, used, &v);
-        }
-
-        free(used);
-
-        return 0;
-
- fail_used:
-        free(*dist);
- fail_pdist:
-        free(*nhops);
- fail_pnhops:
-        return -1;
-
-}
-
 static void free_routing_table(struct list_head * table)
 {
         struct list_head * h;
@@ -486,36 +1299,85 @@ void graph_free_routing_table(struct graph *     graph,
         pthread_mutex_unlock(&graph->lock);
 }
 
-static int graph_routing_table_simple(struct graph *     graph,
-                                      uint64_t           s_addr,
-                                      struct list_head * table,
-                                      int **             dist)
+static int add_nhop(struct routing_table * t,
+                    uint64_t               addr)
 {
-        struct vertex **       nhops;
-        struct list_head *     p;
-        int                    i = 0;
-        struct vertex *        v;
-        struct routing_table * t;
-        struct nhop *          n;
+        struct nhop * n;
 
-        /* We need at least 2 vertices for a table */
-        if (graph->nr_vertices < 2)
-                goto fail_vertices;
+        n = malloc(sizeof(*n));
+        if (n == NULL)
+                return -1;
 
-        if (dijkstra(graph, s_addr, &nhops, dist))
-                goto fail_vertices;
+        n->nhop = addr;
+
+        list_add_tail(&n->next, &t->nhops);
+
+        return 0;
+}
+
+/* Cached tree from a root for a cube, shared by cubes that weigh alike. */
+static struct spt * spt_get(struct graph * graph,
+                            int            root,
+                            qoscube_t      qc)
+{
+        struct list_head * p;
+        struct spt *       spt = NULL;
+
+        list_for_each(p, &graph->spts) {
+                struct spt * s = list_entry(p, struct spt, next);
+                if (s->root == root && graph_same_weights(s->qc, qc)) {
+                        spt = s;
+                        break;
+                }
+        }
+
+        if (spt == NULL) {
+                spt = spt_create(graph, root, qc);
+                if (spt == NULL)
+                        return NULL;
+        }
+
+        spt->used = true;
+
+        return spt;
+}
+
+/* Drop the trees of a cube for vertices that are no longer neighbours. */
+static void spt_evict(struct graph * graph,
+                      qoscube_t      qc)
+{
+        struct list_head * p;
+        struct list_head * h;
+
+        list_for_each_safe(p, h, &graph->spts) {
+                struct spt * spt = list_entry(p, struct spt, next);
+                if (!graph_same_weights(spt->qc, qc))
+                        continue;
+                if (!spt->used)
+                        spt_destroy(spt);
+                else
+                        spt->used = false;
+        }
+}
+
+/* Fills rt with the entry for each vertex index, NULL if unreachable. */
+static int graph_routing_table_simple(struct graph *          graph,
+                                      struct spt *            spt,
+                                      struct list_head *      table,
+                                      struct routing_table ** rt)
+{
+        size_t                 i;
+        struct routing_table * t;
 
         list_head_init(table);
 
         /* Now construct the routing table from the nhops. */
-        list_for_each(p, &graph->vertices) {
-                v = list_entry(p, struct vertex, next);
+        for (i = 0; i < graph->n_idx; ++i) {
+                rt[i] = NULL;
 
-                /* This is the src */
-                if (nhops[i] == NULL) {
-                        i++;
+                /* This is the src or it is unreachable */
+                if (spt->nhop[i] == -1)
                         continue;
-                }
 
                 t = malloc(sizeof(*t));
                 if (t == NULL)
@@ -523,173 +1385,248 @@ static int graph_routing_table_simple(struct graph *     graph,
 
                 list_head_init(&t->nhops);
 
-                n = malloc(sizeof(*n));
-                if (n == NULL)
-                        goto fail_n;
+                t->dst = graph->vtx[i]->addr;
 
-                t->dst = v->addr;
-                n->nhop = nhops[i]->addr;
-
-                list_add(&n->next, &t->nhops);
                 list_add(&t->next, table);
 
-                i++;
-        }
+                if (add_nhop(t, graph->vtx[spt->nhop[i]]->addr))
+                        goto fail_t;
 
-        free(nhops);
+                rt[i] = t;
+        }
 
         return 0;
 
- fail_n:
-        free(t);
  fail_t:
         free_routing_table(table);
-        free(nhops);
-        free(*dist);
- fail_vertices:
-        *dist = NULL;
         return -1;
 }
 
-static int add_lfa_to_table(struct list_head * table,
-                            uint64_t           addr,
-                            uint64_t           lfa)
+static int graph_routing_table_lfa(struct graph *          graph,
+                                   struct spt **           spts,
+                                   size_t                  n,
+                                   struct routing_table ** rt)
 {
-        struct list_head * p = NULL;
-        struct nhop *      n;
+        size_t i;
+        size_t v;
+        int *  s_dist = spts[0]->dist;
+
+        /* Merge in the order of the neighbours of the source. */
+        for (i = 1; i < n; ++i) {
+                struct spt * spt = spts[i];
+                int          nb  = spt->root;
+
+                /*
+                 * Check for every destination if
+                 * dist(neighbor, destination) <
+                 * dist(neighbor, source) + dist(source, destination).
+                 */
+                for (v = 0; v < graph->n_idx; ++v) {
+                        /* Exclude ourselves. */
+                        if (rt[v] == NULL || (int) v == nb)
+                                continue;
 
-        n = malloc(sizeof(*n));
-        if (n == NULL)
-                return -1;
+                        if (spt->dist[v] < s_dist[nb] + s_dist[v])
+                                if (add_nhop(rt[v], graph->vtx[nb]->addr))
+                                        return -1;
+                }
+        }
 
-        n->nhop = lfa;
+        return 0;
+}
 
-        list_for_each(p, table) {
-                struct routing_table * t =
-                        list_entry(p, struct routing_table, next);
-                if (t->dst == addr) {
-                        list_add_tail(&n->next, &t->nhops);
-                        return 0;
+static int graph_routing_table_ecmp(struct graph *          graph,
+                                    struct spt **           spts,
+                                    size_t                  n,
+                                    struct routing_table ** rt)
+{
+        size_t          i;
+        size_t          v;
+        int *           s_dist = spts[0]->dist;
+        int *           s_nhop = spts[0]->nhop;
+        struct vertex * src    = graph->vtx[spts[0]->root];
+
+        /* Merge in the order of the neighbours of the source. */
+        for (i = 1; i < n; ++i) {
+                struct spt *  spt = spts[i];
+                int           nb  = spt->root;
+                struct edge * e;
+
+                e = find_edge_by_addr(src, graph->vtx[nb]->addr);
+                assert(e != NULL);
+
+                /* The direct link is not a shortest path to nb. */
+                if (s_dist[nb] != e->weight[spts[0]->qc])
+                        continue;
+
+                /*
+                 * nb is an equal-cost next hop for a destination if
+                 * dist(source, nb) + dist(nb, destination) equals
+                 * dist(source, destination).
+                 */
+                for (v = 0; v < graph->n_idx; ++v) {
+                        /* Exclude the primary next hop. */
+                        if (rt[v] == NULL || s_nhop[v] == nb)
+                                continue;
+
+                        if (spt->dist[v] == DIST_INF)
+                                continue;
+
+                        if (s_dist[nb] + spt->dist[v] == s_dist[v])
+                                if (add_nhop(rt[v], graph->vtx[nb]->addr))
+                                        return -1;
                 }
         }
 
-        free(n);
+        return 0;
+}
 
-        return -1;
+/* The tree of the source, followed by those of its neighbours. */
+static ssize_t get_spts(struct graph *    graph,
+                        enum routing_algo algo,
+                        qoscube_t         qc,
+                        struct vertex *   src,
+                        struct spt ***    spts)
+{
+        struct list_head * p;
+        size_t             n = 1;
+
+        if (algo != ROUTING_SIMPLE)
+                list_for_each(p, &src->edges)
+                        ++n;
+
+        *spts = malloc(sizeof(**spts) * n);
+        if (*spts == NULL)
+                return -ENOMEM;
+
+        n = 0;
+
+        (*spts)[n] = spt_get(graph, src->index, qc);
+        if ((*spts)[n++] == NULL)
+                goto fail;
+
+        if (algo == ROUTING_SIMPLE)
+                return n;
+
+        list_for_each(p, &src->edges) {
+                struct edge * e = list_entry(p, struct edge, next);
+
+                if (e->announced != 2)
+                        continue;
+
+                (*spts)[n] = spt_get(graph, e->nb->index, qc);
+                if ((*spts)[n++] == NULL)
+                        goto fail;
+        }
+
+        return n;
+ fail:
+        free(*spts);
+        return -ENOMEM;
 }
 
 int graph_routing_table(struct graph *     graph,
                         enum routing_algo  algo,
+                        qoscube_t          qc,
                         uint64_t           s_addr,
                         struct list_head * table)
 {
-        int *              s_dist;
-        int *              n_dist[PROG_MAX_FLOWS];
-        uint64_t           addrs[PROG_MAX_FLOWS];
-        int                n_index[PROG_MAX_FLOWS];
-        struct list_head * p;
-        struct list_head * q;
-        struct vertex *    v;
-        struct edge *      e;
-        struct vertex **   nhops;
-        int                i = 0;
-        int                j = 0;
-        int                k;
+        struct routing_table ** rt;
+        struct vertex *         v;
+        struct spt **           spts;
+        struct spt **           order;
+        ssize_t                 n;
+        int                     state;
 
         assert(graph);
         assert(table);
+        assert(qc < QOS_CUBE_MAX);
 
-        pthread_mutex_lock(&graph->lock);
-
-        /* Get the normal next hops routing table. */
-        if (graph_routing_table_simple(graph, s_addr, table, &s_dist))
-                goto fail_table_simple;
+        /* Waits for the SPF workers, don't leave the graph locked. */
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
 
-        /* Possibly augment the routing table. */
-        switch (algo) {
-        case ROUTING_SIMPLE:
-                break;
-        case ROUTING_LFA:
-                for (j = 0; j < PROG_MAX_FLOWS; j++) {
-                        n_dist[j] = NULL;
-                        n_index[j] = -1;
-                        addrs[j] = -1;
-                }
+        pthread_mutex_lock(&graph->lock);
 
-                list_for_each(p, &graph->vertices) {
-                        v = list_entry(p, struct vertex, next);
+        /* We need at least 2 vertices for a table */
+        if (graph->nr_vertices < 2)
+                goto fail_vertices;
 
-                        if (v->addr != s_addr)
-                                continue;
+        /* Not connected, no routes. */
+        v = find_vertex_by_addr(graph, s_addr);
+        if (v == NULL) {
+                list_head_init(table);
+                pthread_mutex_unlock(&graph->lock);
+                pthread_setcancelstate(state, NULL);
+                return 0;
+        }
 
-                        /*
-                         * Get the distances for every neighbor
-                         * of the source.
-                         */
-                        list_for_each(q, &v->edges) {
-                                e = list_entry(q, struct edge, next);
+        if (algo != ROUTING_SIMPLE && algo != ROUTING_LFA &&
+            algo != ROUTING_ECMP) {
+                log_err("Unsupported algorithm.");
+                goto fail_vertices;
+        }
 
-                                addrs[i] = e->nb->addr;
-                                n_index[i] = e->nb->index;
-                                if (dijkstra(graph, e->nb->addr,
-                                             &nhops, &(n_dist[i++])))
-                                        goto fail_dijkstra;
+        rt = malloc(sizeof(*rt) * graph->n_idx);
+        if (rt == NULL)
+                goto fail_vertices;
 
-                                free(nhops);
-                        }
+        n = get_spts(graph, algo, qc, v, &spts);
+        if (n < 0)
+                goto fail_spts;
 
-                        break;
-                }
+        /* spt_calc reorders, keep the order for the merge. */
+        order = malloc(sizeof(*order) * n);
+        if (order == NULL)
+                goto fail_order;
 
-                /* Loop though all nodes to see if we have a LFA for them. */
-                list_for_each(p, &graph->vertices) {
-                        v = list_entry(p, struct vertex, next);
+        memcpy(order, spts, sizeof(*order) * n);
 
-                        if (v->addr == s_addr)
-                                continue;
-
-                        /*
-                         * Check for every neighbor if
-                         * dist(neighbor, destination) <
-                         * dist(neighbor, source) + dist(source, destination).
-                         */
-                        for (j = 0; j < i; j++) {
-                                /* Exclude ourselves. */
-                                if (addrs[j] == v->addr)
-                                        continue;
-
-                                if (n_dist[j][v->index] <
-                                    s_dist[n_index[j]] + s_dist[v->index])
-                                        if (add_lfa_to_table(table, v->addr,
-                                                             addrs[j]))
-                                                goto fail_add_lfa;
-                        }
-                }
+        if (spt_calc(graph, order, n))
+                goto fail_calc;
 
-                for (j = 0; j < i; j++)
-                        free(n_dist[j]);
+        /* Get the normal next hops routing table. */
+        if (graph_routing_table_simple(graph, spts[0], table, rt))
+                goto fail_calc;
 
+        /* Possibly augment the routing table. */
+        switch (algo) {
+        case ROUTING_LFA:
+                if (graph_routing_table_lfa(graph, spts, n, rt))
+                        goto fail_alt;
+                break;
+        case ROUTING_ECMP:
+                if (graph_routing_table_ecmp(graph, spts, n, rt))
+                        goto fail_alt;
                 break;
         default:
-                log_err("Unsupported algorithm.");
-                goto fail_algo;
+                break;
         }
 
+        spt_evict(graph, qc);
+
         pthread_mutex_unlock(&graph->lock);
 
-        free(s_dist);
+        free(order);
+        free(spts);
+        free(rt);
+
+        pthread_setcancelstate(state, NULL);
 
         return 0;
 
- fail_add_lfa:
-        for (k = j; k < i; k++)
-                free(n_dist[k]);
- fail_dijkstra:
+ fail_alt:
         free_routing_table(table);
- fail_algo:
-        free(s_dist);
- fail_table_simple:
+ fail_calc:
+        free(order);
+ fail_order:
+        free(spts);
+ fail_spts:
+        spt_evict(graph, qc);
+        free(rt);
+ fail_vertices:
         pthread_mutex_unlock(&graph->lock);
 
+        pthread_setcancelstate(state, NULL);
+
         return -1;
 }
@@ -25,12 +25,14 @@
 
 #include <ouroboros/list.h>
 #include <ouroboros/qos.h>
+#include <ouroboros/qoscube.h>
 
 #include <inttypes.h>
 
 enum routing_algo {
          ROUTING_SIMPLE = 0,
-         ROUTING_LFA
+         ROUTING_LFA,
+         ROUTING_ECMP
 };
 
 struct nhop {
@@ -53,12 +55,24 @@ int            graph_update_edge(struct graph * graph,
                                  uint64_t       d_addr,
                                  qosspec_t      qs);
 
+/* Changes the metrics announced for an existing edge */
+int            graph_update_edge_qos(struct graph * graph,
+                                     uint64_t       s_addr,
+                                     uint64_t       d_addr,
+                                     qosspec_t      qs);
+
 int            graph_del_edge(struct graph * graph,
                               uint64_t       s_addr,
                               uint64_t       d_addr);
 
+/* Cubes with the same link weights get the same routing table */
+bool           graph_same_weights(qoscube_t a,
+                                  qoscube_t b);
+
+/* Shortest paths with the link weights for the cube */
 int            graph_routing_table(struct graph *     graph,
                                    enum routing_algo  algo,
+                                   qoscube_t          qc,
                                    uint64_t           s_addr,
                                    struct list_head * table);
 
@@ -39,6 +39,7 @@
 #include <ouroboros/logs.h>
 #include <ouroboros/notifier.h>
 #include <ouroboros/rib.h>
+#include <ouroboros/time_utils.h>
 #include <ouroboros/utils.h>
 
 #include "comp.h"
@@ -49,46 +50,66 @@
 #include "pff.h"
 
 #include <assert.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <inttypes.h>
 #include <string.h>
 #include <pthread.h>
 
-#define RECALC_TIME    4
+#define SPF_INIT       50   /* ms from a first change to the calculation */
+#define SPF_HOLD       200  /* ms, initial hold down between calculations */
+#define SPF_MAX        5000 /* ms, maximum hold down */
 #define LS_UPDATE_TIME 15
 #define LS_TIMEO       60
-#define LS_ENTRY_SIZE  104
+#define LS_ENTRY_SIZE  156
+#define LS_BATCH       32   /* LSAs per message */
+#define LS_VERSION     2    /* LSAs carry link metrics, sent in batches */
+#define LS_DELAY_MIN   2    /* ms, smallest delay change announced */
+#define LS_DELAY_FRAC  8    /* or 1/8th of the delay, if that is more */
+#define LSDB_BUCKETS   64   /* initial index size, doubles as it fills */
 #define LSDB           "lsdb"
 
 #ifndef CLOCK_REALTIME_COARSE
 #define CLOCK_REALTIME_COARSE CLOCK_REALTIME
 #endif
 
+/* Links carry their delay (ms) and bandwidth (bits/s), 0 if unknown. */
 struct lsa {
         uint64_t d_addr;
         uint64_t s_addr;
         uint64_t seqno;
+        uint64_t bandwidth;
+        uint32_t delay;
 } __attribute__((packed));
 
+/* A destination as it was last put in the pff. */
+struct pff_ent {
+        uint64_t         dst;
+        int *            fds;
+        size_t           len;
+};
+
 struct routing_i {
         struct list_head next;
 
         struct pff *     pff;
-        pthread_t        calculator;
-
-        bool             modified;
-        pthread_mutex_t  lock;
+        qoscube_t        qc;
+        struct pff_ent * ents; /* sorted on dst */
+        size_t           n_ents;
 };
 
-/* TODO: link weight support. */
 struct adjacency {
         struct list_head next;
+        struct list_head bucket;
 
         uint64_t         dst;
         uint64_t         src;
 
         uint64_t         seqno;
 
+        uint32_t         delay;
+        uint64_t         bandwidth;
+
         time_t           stamp;
 };
 
@@ -106,25 +127,30 @@ struct nb {
 };
 
 struct {
-        struct list_head  nbs;
-        size_t            nbs_len;
-        fset_t *          mgmt_set;
+        struct list_head   nbs;
+        size_t             nbs_len;
+        fset_t *           mgmt_set;
 
-        struct list_head  db;
-        size_t            db_len;
+        struct list_head   db;
+        size_t             db_len;
+        struct list_head * db_idx; /* hashed on (src, dst) */
+        size_t             db_idx_len;
 
-        pthread_rwlock_t  db_lock;
+        pthread_rwlock_t   db_lock;
 
-        struct graph *    graph;
+        struct graph *     graph;
 
-        pthread_t         lsupdate;
-        pthread_t         lsreader;
-        pthread_t         listener;
+        pthread_t          lsupdate;
+        pthread_t          lsreader;
+        pthread_t          listener;
+        pthread_t          calculator;
 
-        struct list_head  routing_instances;
-        pthread_mutex_t   routing_i_lock;
+        struct list_head   routing_instances;
+        bool               modified;
+        pthread_mutex_t    routing_i_lock;
+        pthread_cond_t     routing_i_cond;
 
-        enum routing_algo routing_algo;
+        enum routing_algo  routing_algo;
 } ls;
 
 struct pol_routing_ops link_state_ops = {
@@ -142,6 +168,8 @@ static int str_adj(struct adjacency * adj,
         char        srcbuf[64];
         char        dstbuf[64];
         char        seqnobuf[64];
+        char        delaybuf[64];
+        char        bwbuf[64];
         struct tm * tm;
 
         if (len < LS_ENTRY_SIZE)
@@ -153,28 +181,97 @@ static int str_adj(struct adjacency * adj,
         sprintf(srcbuf, "%" PRIu64, adj->src);
         sprintf(dstbuf, "%" PRIu64, adj->dst);
         sprintf(seqnobuf, "%" PRIu64, adj->seqno);
+        sprintf(delaybuf, "%" PRIu32, adj->delay);
+        sprintf(bwbuf, "%" PRIu64, adj->bandwidth);
 
-        sprintf(buf, "src: %20s\ndst: %20s\nseqno: %18s\nupd: %20s\n",
-                srcbuf, dstbuf, seqnobuf, tmbuf);
+        sprintf(buf, "src: %20s\ndst: %20s\nseqno: %18s\nupd: %20s\n"
+                "delay: %18s\nbw: %21s\n",
+                srcbuf, dstbuf, seqnobuf, tmbuf, delaybuf, bwbuf);
 
         return LS_ENTRY_SIZE;
 }
 
-static struct adjacency * get_adj(const char * path)
+static size_t adj_bucket(uint64_t src,
+                         uint64_t dst)
+{
+        uint64_t h;
+
+        h  = src * 0x9E3779B97F4A7C15ULL ^ dst;
+        h ^= h >> 33;
+        h *= 0xFF51AFD7ED558CCDULL;
+        h ^= h >> 33;
+
+        return (size_t) (h & (ls.db_idx_len - 1));
+}
+
+static struct adjacency * lsdb_find(uint64_t src,
+                                    uint64_t dst)
 {
         struct list_head * p;
-        char               entry[RIB_PATH_LEN + 1];
 
-        assert(path);
+        list_for_each(p, &ls.db_idx[adj_bucket(src, dst)]) {
+                struct adjacency * a;
+                a = list_entry(p, struct adjacency, bucket);
+                if (a->src == src && a->dst == dst)
+                        return a;
+        }
+
+        return NULL;
+}
+
+/* Keeps the old index if a larger one can't be allocated. */
+static void lsdb_grow(void)
+{
+        struct list_head * idx;
+        struct list_head * p;
+        size_t             i;
+
+        idx = malloc(sizeof(*idx) * (ls.db_idx_len << 1));
+        if (idx == NULL)
+                return;
+
+        for (i = 0; i < ls.db_idx_len << 1; ++i)
+                list_head_init(&idx[i]);
+
+        free(ls.db_idx);
+
+        ls.db_idx      = idx;
+        ls.db_idx_len <<= 1;
 
         list_for_each(p, &ls.db) {
                 struct adjacency * a = list_entry(p, struct adjacency, next);
-                sprintf(entry, "%" PRIu64 ".%" PRIu64, a->src, a->dst);
-                if (strcmp(entry, path) == 0)
-                        return a;
+                list_add(&a->bucket, &idx[adj_bucket(a->src, a->dst)]);
         }
+}
 
-        return NULL;
+static void lsdb_insert(struct adjacency * adj)
+{
+        list_add_tail(&adj->next, &ls.db);
+        list_add(&adj->bucket, &ls.db_idx[adj_bucket(adj->src, adj->dst)]);
+
+        if (++ls.db_len > ls.db_idx_len)
+                lsdb_grow();
+}
+
+static void lsdb_remove(struct adjacency * adj)
+{
+        list_del(&adj->next);
+        list_del(&adj->bucket);
+
+        --ls.db_len;
+}
+
+static struct adjacency * get_adj(const char * path)
+{
+        uint64_t src;
+        uint64_t dst;
+
+        assert(path);
+
+        if (sscanf(path, "%" SCNu64 ".%" SCNu64, &src, &dst) != 2)
+                return NULL;
+
+        return lsdb_find(src, dst);
 }
 
 static int lsdb_getattr(const char *  path,
@@ -393,69 +490,298 @@ static int nbr_to_fd(uint64_t addr)
         return -1;
 }
 
-static void calculate_pff(struct routing_i * instance)
+static int pff_ent_cmp(const void * o1,
+                       const void * o2)
+{
+        const struct pff_ent * e1 = o1;
+        const struct pff_ent * e2 = o2;
+
+        if (e1->dst == e2->dst)
+                return 0;
+
+        return e1->dst < e2->dst ? -1 : 1;
+}
+
+static void free_ents(struct pff_ent * ents,
+                      size_t           n)
+{
+        size_t i;
+
+        for (i = 0; i < n; ++i)
+                free(ents[i].fds);
+
+        free(ents);
+}
+
+/* Calculate forwarding entries from the routing table. */
+static ssize_t build_ents(struct list_head * table,
+                          struct pff_ent **  ents)
 {
-        int                fd;
-        struct list_head   table;
         struct list_head * p;
         struct list_head * q;
+        size_t             n = 0;
         int                fds[PROG_MAX_FLOWS];
 
-        if (graph_routing_table(ls.graph, ls.routing_algo,
-                                ipcpi.dt_addr, &table))
-                return;
+        list_for_each(p, table)
+                ++n;
 
-        pff_lock(instance->pff);
+        *ents = malloc(sizeof(**ents) * (n > 0 ? n : 1));
+        if (*ents == NULL)
+                return -ENOMEM;
 
-        pff_flush(instance->pff);
+        n = 0;
 
-        /* Calculate forwarding table from routing table. */
-        list_for_each(p, &table) {
-                int                    i = 0;
+        list_for_each(p, table) {
+                size_t                 i = 0;
                 struct routing_table * t =
                         list_entry(p, struct routing_table, next);
 
                 list_for_each(q, &t->nhops) {
-                        struct nhop * n = list_entry(q, struct nhop, next);
+                        struct nhop * nh = list_entry(q, struct nhop, next);
+                        int           fd;
 
-                        fd = nbr_to_fd(n->nhop);
+                        fd = nbr_to_fd(nh->nhop);
                         if (fd == -1)
                                 continue;
 
                         fds[i++] = fd;
                 }
-                if (i > 0)
-                        pff_add(instance->pff, t->dst, fds, i);
+
+                if (i == 0)
+                        continue;
+
+                (*ents)[n].fds = malloc(sizeof(*fds) * i);
+                if ((*ents)[n].fds == NULL) {
+                        free_ents(*ents, n);
+                        return -ENOMEM;
+                }
+
+                memcpy((*ents)[n].fds, fds, sizeof(*fds) * i);
+                (*ents)[n].dst = t->dst;
+                (*ents)[n++].len = i;
         }
 
-        pff_unlock(instance->pff);
+        qsort(*ents, n, sizeof(**ents), pff_ent_cmp);
+
+        return n;
+}
+
+static bool pff_ent_eq(const struct pff_ent * e1,
+                       const struct pff_ent * e2)
+{
+        return e1->len == e2->len &&
+                memcmp(e1->fds, e2->fds, sizeof(*e1->fds) * e1->len) == 0;
+}
+
+/* Only touches the destinations that changed, both lists are sorted. */
+static int update_pff(struct routing_i * instance,
+                      struct pff_ent *   ents,
+                      size_t             n)
+{
+        struct pff_ent * old = instance->ents;
+        size_t           i   = 0;
+        size_t           j   = 0;
+
+        while (i < n || j < instance->n_ents) {
+                if (j == instance->n_ents ||
+                    (i < n && ents[i].dst < old[j].dst)) {
+                        if (pff_add(instance->pff, ents[i].dst,
+                                    ents[i].fds, ents[i].len))
+                                return -1;
+                        ++i;
+                } else if (i == n || old[j].dst < ents[i].dst) {
+                        if (pff_del(instance->pff, old[j].dst))
+                                return -1;
+                        ++j;
+                } else {
+                        if (!pff_ent_eq(&ents[i], &old[j]) &&
+                            pff_update(instance->pff, ents[i].dst,
+                                       ents[i].fds, ents[i].len))
+                                return -1;
+                        ++i;
+                        ++j;
+                }
+        }
+
+        return 0;
+}
+
+static int rebuild_pff(struct routing_i * instance,
+                       struct pff_ent *   ents,
+                       size_t             n)
+{
+        size_t i;
+
+        pff_flush(instance->pff);
+
+        for (i = 0; i < n; ++i)
+                if (pff_add(instance->pff, ents[i].dst,
+                            ents[i].fds, ents[i].len))
+                        return -1;
+
+        return 0;
+}
+
+static ssize_t dup_ents(const struct pff_ent * ents,
+                        size_t                 n,
+                        struct pff_ent **      dup)
+{
+        size_t i;
+
+        *dup = malloc(sizeof(**dup) * (n > 0 ? n : 1));
+        if (*dup == NULL)
+                return -ENOMEM;
+
+        for (i = 0; i < n; ++i) {
+                (*dup)[i] = ents[i];
+                (*dup)[i].fds = malloc(sizeof(*ents[i].fds) * ents[i].len);
+                if ((*dup)[i].fds == NULL) {
+                        free_ents(*dup, i);
+                        return -ENOMEM;
+                }
+
+                memcpy((*dup)[i].fds, ents[i].fds,
+                       sizeof(*ents[i].fds) * ents[i].len);
+        }
+
+        return n;
+}
+
+static ssize_t calculate_ents(qoscube_t         qc,
+                              struct pff_ent ** ents)
+{
+        struct list_head table;
+        ssize_t          n;
+
+        if (graph_routing_table(ls.graph, ls.routing_algo, qc,
+                                ipcpi.dt_addr, &table))
+                return -1;
+
+        n = build_ents(&table, ents);
 
         graph_free_routing_table(ls.graph, &table);
+
+        return n;
+}
+
+/*
+ * The pff publishes its changes on unlock, lookups are never blocked
+ * and never see a partially updated table. Takes ownership of ents.
+ * Without ents, the contents of the pff are not known and it is
+ * rebuilt from scratch.
+ */
+static void apply_pff(struct routing_i * instance,
+                      struct pff_ent *   ents,
+                      size_t             n)
+{
+        int ret = 0;
+
+        pff_lock(instance->pff);
+
+        if (instance->ents == NULL) {
+                ret = rebuild_pff(instance, ents, n);
+        } else if (update_pff(instance, ents, n)) {
+                log_warn("Failed to update forwarding table, rebuilding.");
+                ret = rebuild_pff(instance, ents, n);
+        }
+
+        if (ret < 0) {
+                log_err("Failed to rebuild forwarding table.");
+                free_ents(ents, n);
+                ents = NULL;
+                n    = 0;
+        }
+
+        free_ents(instance->ents, instance->n_ents);
+        instance->ents   = ents;
+        instance->n_ents = n;
+
+        pff_unlock(instance->pff);
 }
 
-static void set_pff_modified(bool calc)
+/*
+ * Calculate the table once for the cubes that have the same link
+ * weights and give each pff its own copy. Called with the routing
+ * instances locked.
+ */
+static void calculate_pffs(void)
 {
         struct list_head * p;
+        struct pff_ent *   ents[QOS_CUBE_MAX];
+        ssize_t            n[QOS_CUBE_MAX];
+        struct pff_ent *   cpy;
+        ssize_t            len;
+        int                i;
+        int                c;
+
+        for (i = 0; i < QOS_CUBE_MAX; ++i)
+                n[i] = -1;
 
-        pthread_mutex_lock(&ls.routing_i_lock);
         list_for_each(p, &ls.routing_instances) {
                 struct routing_i * inst =
                         list_entry(p, struct routing_i, next);
-                pthread_mutex_lock(&inst->lock);
-                inst->modified = true;
-                pthread_mutex_unlock(&inst->lock);
-                if (calc)
-                        calculate_pff(inst);
+
+                for (c = 0; !graph_same_weights(c, inst->qc); ++c)
+                        ;
+
+                if (n[c] < 0)
+                        n[c] = calculate_ents(c, &ents[c]);
+
+                if (n[c] < 0)
+                        continue;
+
+                len = dup_ents(ents[c], n[c], &cpy);
+                if (len < 0)
+                        continue;
+
+                apply_pff(inst, cpy, len);
         }
+
+        for (i = 0; i < QOS_CUBE_MAX; ++i)
+                if (n[i] >= 0)
+                        free_ents(ents[i], n[i]);
+}
+
+static void set_pff_modified(void)
+{
+        pthread_mutex_lock(&ls.routing_i_lock);
+
+        ls.modified = true;
+        pthread_cond_signal(&ls.routing_i_cond);
+
         pthread_mutex_unlock(&ls.routing_i_lock);
 }
 
+/* Ignore small changes in a measured delay, routes would flap on them. */
+static bool delay_changed(uint32_t cur,
+                          uint32_t new)
+{
+        uint32_t d = cur > new ? cur - new : new - cur;
+
+        return d >= MAX(LS_DELAY_MIN, cur / LS_DELAY_FRAC);
+}
+
+/* Update the metrics of a known link, true if they changed. */
+static bool adj_metrics_set(struct adjacency * adj,
+                            qosspec_t *        qs)
+{
+        if (adj->delay == qs->delay && adj->bandwidth == qs->bandwidth)
+                return false;
+
+        adj->delay     = qs->delay;
+        adj->bandwidth = qs->bandwidth;
+
+        if (graph_update_edge_qos(ls.graph, adj->src, adj->dst, *qs))
+                log_warn("Failed to update edge in graph.");
+
+        return true;
+}
+
 static int lsdb_add_link(uint64_t    src,
                          uint64_t    dst,
                          uint64_t    seqno,
                          qosspec_t * qs)
 {
-        struct list_head * p;
         struct adjacency * adj;
         struct timespec    now;
         int                ret = -1;
@@ -464,20 +790,19 @@ static int lsdb_add_link(uint64_t    src,
 
         pthread_rwlock_wrlock(&ls.db_lock);
 
-        list_for_each(p, &ls.db) {
-                struct adjacency * a = list_entry(p, struct adjacency, next);
-                if (a->dst == dst && a->src == src) {
-                        if (a->seqno < seqno) {
-                                a->stamp = now.tv_sec;
-                                a->seqno = seqno;
-                                ret = 0;
-                        }
-                        pthread_rwlock_unlock(&ls.db_lock);
-                        return ret;
+        adj = lsdb_find(src, dst);
+        if (adj != NULL) {
+                if (adj->seqno < seqno) {
+                        adj->stamp = now.tv_sec;
+                        adj->seqno = seqno;
+                        ret = 0;
+                        if (adj_metrics_set(adj, qs))
+                                ret = 1;
                 }
-
-                if (a->dst > dst || (a->dst == dst && a->src > src))
-                        break;
+                pthread_rwlock_unlock(&ls.db_lock);
+                if (ret > 0)
+                        set_pff_modified();
+                return ret < 0 ? ret : 0;
         }
 
         adj = malloc(sizeof(*adj));
@@ -486,21 +811,21 @@ static int lsdb_add_link(uint64_t    src,
                 return -ENOMEM;
         }
 
-        adj->dst   = dst;
-        adj->src   = src;
-        adj->seqno = seqno;
-        adj->stamp = now.tv_sec;
+        adj->dst       = dst;
+        adj->src       = src;
+        adj->seqno     = seqno;
+        adj->stamp     = now.tv_sec;
+        adj->delay     = qs->delay;
+        adj->bandwidth = qs->bandwidth;
 
-        list_add_tail(&adj->next, p);
-
-        ls.db_len++;
+        lsdb_insert(adj);
 
         if (graph_update_edge(ls.graph, src, dst, *qs))
                 log_warn("Failed to add edge to graph.");
 
         pthread_rwlock_unlock(&ls.db_lock);
 
-        set_pff_modified(true);
+        set_pff_modified();
 
         return 0;
 }
@@ -508,25 +833,20 @@ static int lsdb_add_link(uint64_t    src,
 static int lsdb_del_link(uint64_t src,
                          uint64_t dst)
 {
-        struct list_head * p;
-        struct list_head * h;
+        struct adjacency * a;
 
         pthread_rwlock_wrlock(&ls.db_lock);
 
-        list_for_each_safe(p, h, &ls.db) {
-                struct adjacency * a = list_entry(p, struct adjacency, next);
-                if (a->dst == dst && a->src == src) {
-                        list_del(&a->next);
-                        if (graph_del_edge(ls.graph, src, dst))
-                                log_warn("Failed to delete edge from graph.");
-
-                        ls.db_len--;
+        a = lsdb_find(src, dst);
+        if (a != NULL) {
+                lsdb_remove(a);
+                if (graph_del_edge(ls.graph, src, dst))
+                        log_warn("Failed to delete edge from graph.");
 
-                        pthread_rwlock_unlock(&ls.db_lock);
-                        set_pff_modified(false);
-                        free(a);
-                        return 0;
-                }
+                pthread_rwlock_unlock(&ls.db_lock);
+                set_pff_modified();
+                free(a);
+                return 0;
         }
 
         pthread_rwlock_unlock(&ls.db_lock);
@@ -534,85 +854,245 @@ static int lsdb_del_link(uint64_t src,
         return -EPERM;
 }
 
-static void * periodic_recalc_pff(void * o)
+/*
+ * SPF throttling: calculate SPF_INIT ms after a change. While changes
+ * keep coming, wait a hold down after the last calculation that
+ * doubles up to SPF_MAX. It resets after twice the hold down without
+ * changes. Changes during a wait are handled by the same calculation.
+ */
+static void * recalc_pff(void * o)
 {
-        bool               modified;
-        struct routing_i * inst = (struct routing_i *) o;
+        struct timespec last = {0, 0};
+        struct timespec now;
+        struct timespec next;
+        struct timespec intv;
+        long            hold = SPF_HOLD;
+
+        (void) o;
+
+        pthread_mutex_lock(&ls.routing_i_lock);
+        pthread_cleanup_push((void (*) (void *)) pthread_mutex_unlock,
+                             (void *) &ls.routing_i_lock);
 
         while (true) {
-                pthread_mutex_lock(&inst->lock);
-                modified = inst->modified;
-                inst->modified = false;
-                pthread_mutex_unlock(&inst->lock);
+                while (!ls.modified)
+                        pthread_cond_wait(&ls.routing_i_cond,
+                                          &ls.routing_i_lock);
+
+                clock_gettime(PTHREAD_COND_CLOCK, &now);
+
+                if (last.tv_sec == 0 || ts_diff_ms(&last, &now) > 2 * hold) {
+                        hold = SPF_HOLD;
+                        intv.tv_sec  = SPF_INIT / 1000;
+                        intv.tv_nsec = (SPF_INIT % 1000) * MILLION;
+                        ts_add(&now, &intv, &next);
+                } else {
+                        intv.tv_sec  = hold / 1000;
+                        intv.tv_nsec = (hold % 1000) * MILLION;
+                        ts_add(&last, &intv, &next);
+                        hold = MIN(hold << 1, SPF_MAX);
+                }
 
-                if (modified)
-                        calculate_pff(inst);
-                sleep(RECALC_TIME);
+                while (pthread_cond_timedwait(&ls.routing_i_cond,
+                                              &ls.routing_i_lock,
+                                              &next) != ETIMEDOUT)
+                        ;
+
+                ls.modified = false;
+
+                calculate_pffs();
+
+                clock_gettime(PTHREAD_COND_CLOCK, &last);
         }
 
+        pthread_cleanup_pop(true);
+
         return (void *) 0;
 }
 
-static void send_lsm(uint64_t src,
-                     uint64_t dst,
-                     uint64_t seqno)
+static void lsm_fill(struct lsa *             lsm,
+                     const struct adjacency * adj)
 {
-        struct lsa         lsm;
-        struct list_head * p;
+        lsm->d_addr    = hton64(adj->dst);
+        lsm->s_addr    = hton64(adj->src);
+        lsm->seqno     = hton64(adj->seqno);
+        lsm->bandwidth = hton64(adj->bandwidth);
+        lsm->delay     = hton32(adj->delay);
+}
 
-        lsm.d_addr = hton64(dst);
-        lsm.s_addr = hton64(src);
-        lsm.seqno  = hton64(seqno);
+/* Send n LSAs in one message to all mgmt neighbors but in_fd. */
+static void flood_lsm(const struct lsa * lsm,
+                      size_t             n,
+                      int                in_fd)
+{
+        struct list_head * p;
 
         list_for_each(p, &ls.nbs) {
                 struct nb * nb = list_entry(p, struct nb, next);
-                if (nb->type == NB_MGMT)
-                        flow_write(nb->fd, &lsm, sizeof(lsm));
+                if (nb->type == NB_MGMT && nb->fd != in_fd)
+                        flow_write(nb->fd, lsm, n * sizeof(*lsm));
         }
 }
 
+static void send_lsm(const struct adjacency * adj)
+{
+        struct lsa lsm;
+
+        lsm_fill(&lsm, adj);
+
+        flood_lsm(&lsm, 1, -1);
+}
+
 /* replicate the lsdb to a mgmt neighbor */
 static void lsdb_replicate(int fd)
 {
         struct list_head * p;
-        struct list_head * h;
-        struct list_head   copy;
-
-        list_head_init(&copy);
+        struct lsa *       lsm;
+        size_t             len;
+        size_t             i;
+        size_t             n;
 
         /* Lock the lsdb, copy the lsms and send outside of lock. */
         pthread_rwlock_rdlock(&ls.db_lock);
 
+        len = ls.db_len;
+        if (len == 0) {
+                pthread_rwlock_unlock(&ls.db_lock);
+                return;
+        }
+
+        lsm = malloc(sizeof(*lsm) * len);
+        if (lsm == NULL) {
+                pthread_rwlock_unlock(&ls.db_lock);
+                log_warn("Failed to replicate full lsdb.");
+                return;
+        }
+
+        i = 0;
         list_for_each(p, &ls.db) {
                 struct adjacency * adj;
-                struct adjacency * cpy;
                 adj = list_entry(p, struct adjacency, next);
-                cpy = malloc(sizeof(*cpy));
-                if (cpy == NULL) {
-                        log_warn("Failed to replicate full lsdb.");
-                        break;
-                }
+                lsm_fill(&lsm[i++], adj);
+        }
 
-                cpy->dst   = adj->dst;
-                cpy->src   = adj->src;
-                cpy->seqno = adj->seqno;
+        pthread_rwlock_unlock(&ls.db_lock);
 
-                list_add_tail(&cpy->next, &copy);
+        for (i = 0; i < len; i += n) {
+                n = MIN(len - i, LS_BATCH);
+                flow_write(fd, lsm + i, n * sizeof(*lsm));
         }
 
-        pthread_rwlock_unlock(&ls.db_lock);
+        free(lsm);
+}
+
+/* Half the smoothed rtt over the N-1 flow, if it measures one. */
+static void link_measure(int         fd,
+                         qosspec_t * qs)
+{
+        struct timespec srtt;
+        uint64_t        ms;
+
+        if (fd < 0 || fccntl(fd, FRCTGSRTT, &srtt))
+                return;
 
-        list_for_each_safe(p, h, &copy) {
-                struct lsa         lsm;
+        if (srtt.tv_sec == 0 && srtt.tv_nsec == 0)
+                return;
+
+        ms = srtt.tv_sec * 1000 + srtt.tv_nsec / MILLION;
+
+        qs->delay = MIN((ms + 1) / 2, UINT32_MAX - 1);
+}
+
+/* The metrics of a new link are those of its N-1 flow. */
+static void link_qos(const struct conn * c,
+                     qosspec_t *         qs)
+{
+        memset(qs, 0, sizeof(*qs));
+
+        if (c->flow_info.qs.delay != UINT32_MAX)
+                qs->delay = c->flow_info.qs.delay;
+
+        qs->bandwidth = c->flow_info.qs.bandwidth;
+
+        link_measure(c->flow_info.fd, qs);
+}
+
+static int nb_dt_fd(uint64_t addr)
+{
+        struct list_head * p;
+
+        list_for_each(p, &ls.nbs) {
+                struct nb * nb = list_entry(p, struct nb, next);
+                if (nb->addr == addr && nb->type == NB_DT)
+                        return nb->fd;
+        }
+
+        return -1;
+}
+
+struct own_link {
+        uint64_t dst;
+        int      fd;
+        uint32_t delay; /* UINT32_MAX if not measured */
+};
+
+/* Measure our own links, fccntl is called outside of the lsdb lock. */
+static ssize_t own_links_measure(struct own_link ** links)
+{
+        struct list_head * p;
+        struct own_link *  l;
+        size_t             n = 0;
+        size_t             i;
+
+        pthread_rwlock_rdlock(&ls.db_lock);
+
+        l = malloc(sizeof(*l) * (ls.db_len + 1));
+        if (l == NULL) {
+                pthread_rwlock_unlock(&ls.db_lock);
+                return -ENOMEM;
+        }
+
+        list_for_each(p, &ls.db) {
                 struct adjacency * adj;
                 adj = list_entry(p, struct adjacency, next);
-                lsm.d_addr = hton64(adj->dst);
-                lsm.s_addr = hton64(adj->src);
-                lsm.seqno  = hton64(adj->seqno);
-                list_del(&adj->next);
-                free(adj);
-                flow_write(fd, &lsm, sizeof(lsm));
+                if (adj->src != ipcpi.dt_addr)
+                        continue;
+                l[n].dst = adj->dst;
+                l[n].fd  = nb_dt_fd(adj->dst);
+                ++n;
         }
+
+        pthread_rwlock_unlock(&ls.db_lock);
+
+        for (i = 0; i < n; ++i) {
+                qosspec_t qs;
+
+                qs.delay = UINT32_MAX;
+                link_measure(l[i].fd, &qs);
+                l[i].delay = qs.delay;
+        }
+
+        *links = l;
+
+        return (ssize_t) n;
+}
+
+static uint32_t own_link_delay(const struct own_link *  links,
+                               size_t                   n,
+                               const struct adjacency * adj)
+{
+        size_t i;
+
+        for (i = 0; i < n; ++i) {
+                if (links[i].dst != adj->dst)
+                        continue;
+                if (links[i].delay == UINT32_MAX ||
+                    !delay_changed(adj->delay, links[i].delay))
+                        break;
+                return links[i].delay;
+        }
+
+        return adj->delay;
 }
 
 static void * lsupdate(void * o)
@@ -620,13 +1100,47 @@ static void * lsupdate(void * o)
         struct list_head * p;
         struct list_head * h;
         struct timespec    now;
+        bool               changed;
+        struct own_link *  links;
+        ssize_t            n_links;
+        struct lsa *       lsm;
+        int *              fds;
+        size_t             n;
+        size_t             n_fds;
+        size_t             i;
+        size_t             j;
+        size_t             k;
 
         (void) o;
 
         while (true) {
+                n_links = own_links_measure(&links);
+                if (n_links < 0) {
+                        log_warn("Failed to measure links.");
+                        links   = NULL;
+                        n_links = 0;
+                }
+
                 clock_gettime(CLOCK_REALTIME_COARSE, &now);
 
-                pthread_rwlock_rdlock(&ls.db_lock);
+                changed = false;
+                n       = 0;
+                n_fds   = 0;
+
+                /* Build the batch under the lock and send outside it. */
+                pthread_rwlock_wrlock(&ls.db_lock);
+
+                lsm = malloc(sizeof(*lsm) * (ls.db_len + 1));
+                fds = malloc(sizeof(*fds) * (ls.nbs_len + 1));
+                if (lsm == NULL || fds == NULL) {
+                        pthread_rwlock_unlock(&ls.db_lock);
+                        log_warn("Failed to allocate LSA batch.");
+                        free(fds);
+                        free(lsm);
+                        free(links);
+                        sleep(LS_UPDATE_TIME);
+                        continue;
+                }
 
                 pthread_cleanup_push((void (*) (void *)) pthread_rwlock_unlock,
                                      (void *) &ls.db_lock);
@@ -635,23 +1149,56 @@ static void * lsupdate(void * o)
                         struct adjacency * adj;
                         adj = list_entry(p, struct adjacency, next);
                         if (now.tv_sec - adj->stamp > LS_TIMEO) {
-                                list_del(&adj->next);
+                                lsdb_remove(adj);
                                 log_dbg("%" PRIu64 " - %" PRIu64" timed out.",
                                         adj->src, adj->dst);
                                 if (graph_del_edge(ls.graph, adj->src,
                                                    adj->dst))
                                         log_err("Failed to del edge.");
                                 free(adj);
+                                changed = true;
                                 continue;
                         }
 
                         if (adj->src == ipcpi.dt_addr) {
+                                qosspec_t qs;
+
+                                memset(&qs, 0, sizeof(qs));
+                                qs.delay     = own_link_delay(links,
+                                                              n_links,
+                                                              adj);
+                                qs.bandwidth = adj->bandwidth;
+                                changed |= adj_metrics_set(adj, &qs);
+
                                 adj->seqno++;
-                                send_lsm(adj->src, adj->dst, adj->seqno);
                                 adj->stamp = now.tv_sec;
+                                lsm_fill(&lsm[n++], adj);
                         }
                 }
 
+                list_for_each(p, &ls.nbs) {
+                        struct nb * nb = list_entry(p, struct nb, next);
+                        if (nb->type == NB_MGMT)
+                                fds[n_fds++] = nb->fd;
+                }
+
+                pthread_cleanup_pop(true);
+
+                free(links);
+
+                if (changed)
+                        set_pff_modified();
+
+                pthread_cleanup_push(free, lsm);
+                pthread_cleanup_push(free, fds);
+
+                for (i = 0; i < n; i += k) {
+                        k = MIN(n - i, LS_BATCH);
+                        for (j = 0; j < n_fds; ++j)
+                                flow_write(fds[j], lsm + i, k * sizeof(*lsm));
+                }
+
+                pthread_cleanup_pop(true);
                 pthread_cleanup_pop(true);
 
                 sleep(LS_UPDATE_TIME);
@@ -681,22 +1228,16 @@ static void * ls_conn_handle(void * o)
 }
 
 
-static void forward_lsm(uint8_t * buf,
-                        size_t    len,
-                        int       in_fd)
+static void forward_lsm(const struct lsa * lsm,
+                        size_t             n,
+                        int                in_fd)
 {
-        struct list_head * p;
-
         pthread_rwlock_rdlock(&ls.db_lock);
 
         pthread_cleanup_push((void (*))(void *) pthread_rwlock_unlock,
                              &ls.db_lock);
 
-        list_for_each(p, &ls.nbs) {
-                struct nb * nb = list_entry(p, struct nb, next);
-                if (nb->type == NB_MGMT && nb->fd != in_fd)
-                        flow_write(nb->fd, buf, len);
-        }
+        flood_lsm(lsm, n, in_fd);
 
         pthread_cleanup_pop(true);
 }
@@ -705,11 +1246,14 @@ static void * lsreader(void * o)
 {
         fqueue_t *   fq;
         int          ret;
-        uint8_t      buf[sizeof(struct lsa)];
+        struct lsa   buf[LS_BATCH];
+        struct lsa   fwd[LS_BATCH];
         int          fd;
         qosspec_t    qs;
         struct lsa * msg;
-        size_t       len;
+        ssize_t      len;
+        size_t       i;
+        size_t       n;
 
         (void) o;
 
@@ -733,19 +1277,35 @@ static void * lsreader(void * o)
                         if (fqueue_type(fq) != FLOW_PKT)
                                 continue;
 
-                        len = flow_read(fd, buf, sizeof(*msg));
-                        if (len <= 0 || len != sizeof(*msg))
+                        len = flow_read(fd, buf, sizeof(buf));
+                        if (len <= 0)
                                 continue;
 
-                        msg = (struct lsa *) buf;
-
-                        if (lsdb_add_link(ntoh64(msg->s_addr),
-                                          ntoh64(msg->d_addr),
-                                          ntoh64(msg->seqno),
-                                          &qs))
+                        if (len % sizeof(*msg) != 0) {
+                                log_warn("Dropped malformed LSA message.");
                                 continue;
+                        }
+
+                        n = 0;
+
+                        for (i = 0; i < len / sizeof(*msg); ++i) {
+                                msg = buf + i;
+
+                                qs.delay     = ntoh32(msg->delay);
+                                qs.bandwidth = ntoh64(msg->bandwidth);
 
-                        forward_lsm(buf, len, fd);
+                                /* Only forward what was new to us. */
+                                if (lsdb_add_link(ntoh64(msg->s_addr),
+                                                  ntoh64(msg->d_addr),
+                                                  ntoh64(msg->seqno),
+                                                  &qs))
+                                        continue;
+
+                                fwd[n++] = *msg;
+                        }
+
+                        if (n > 0)
+                                forward_lsm(fwd, n, fd);
                 }
         }
 
@@ -776,8 +1336,8 @@ static void handle_event(void *       self,
                          int          event,
                          const void * o)
 {
-        /* FIXME: Apply correct QoS on graph */
         struct conn *      c;
+        struct adjacency   adj;
         qosspec_t          qs;
         int                flags;
 
@@ -785,12 +1345,18 @@ static void handle_event(void *       self,
 
         c = (struct conn *) o;
 
-        memset(&qs, 0, sizeof(qs));
-
         switch (event) {
         case NOTIFY_DT_CONN_ADD:
+                link_qos(c, &qs);
+
+                adj.src       = ipcpi.dt_addr;
+                adj.dst       = c->conn_info.addr;
+                adj.seqno     = 0;
+                adj.delay     = qs.delay;
+                adj.bandwidth = qs.bandwidth;
+
                 pthread_rwlock_rdlock(&ls.db_lock);
-                send_lsm(ipcpi.dt_addr, c->conn_info.addr, 0);
+                send_lsm(&adj);
                 pthread_rwlock_unlock(&ls.db_lock);
 
                 if (lsdb_add_nb(c->conn_info.addr, c->flow_info.fd, NB_DT))
@@ -818,6 +1384,12 @@ static void handle_event(void *       self,
                 flow_event(c->flow_info.fd, false);
                 break;
         case NOTIFY_MGMT_CONN_ADD:
+                if (c->conn_info.pref_version != LS_VERSION) {
+                        log_warn("Unsupported LSA version %u from %" PRIu64
+                                 ".", c->conn_info.pref_version,
+                                 c->conn_info.addr);
+                        break;
+                }
                 fccntl(c->flow_info.fd, FLOWGFLAGS, &flags);
                 fccntl(c->flow_info.fd, FLOWSFLAGS, flags | FLOWFRNOPART);
                 fset_add(ls.mgmt_set, c->flow_info.fd);
@@ -827,6 +1399,8 @@ static void handle_event(void *       self,
                 lsdb_replicate(c->flow_info.fd);
                 break;
         case NOTIFY_MGMT_CONN_DEL:
+                if (c->conn_info.pref_version != LS_VERSION)
+                        break; /* never added */
                 fset_del(ls.mgmt_set, c->flow_info.fd);
                 if (lsdb_del_nb(c->conn_info.addr, c->flow_info.fd))
                         log_warn("Failed to delete mgmt neighbor from LSDB.");
@@ -836,7 +1410,8 @@ static void handle_event(void *       self,
         }
 }
 
-struct routing_i * link_state_routing_i_create(struct pff * pff)
+struct routing_i * link_state_routing_i_create(struct pff * pff,
+                                               qoscube_t    qc)
 {
         struct routing_i * tmp;
 
@@ -846,28 +1421,23 @@ struct routing_i * link_state_routing_i_create(struct pff * pff)
         if (tmp == NULL)
                 goto fail_tmp;
 
-        tmp->pff      = pff;
-        tmp->modified = false;
-
-        if (pthread_mutex_init(&tmp->lock, NULL))
-                goto fail_instance_lock_init;
-
-        if (pthread_create(&tmp->calculator, NULL,
-                           periodic_recalc_pff, tmp))
-                goto fail_pthread_create_lsupdate;
+        tmp->pff    = pff;
+        tmp->qc     = qc;
+        tmp->ents   = NULL;
+        tmp->n_ents = 0;
 
         pthread_mutex_lock(&ls.routing_i_lock);
 
         list_add(&tmp->next, &ls.routing_instances);
 
+        /* Fill it on the next calculation. */
+        ls.modified = true;
+        pthread_cond_signal(&ls.routing_i_cond);
+
         pthread_mutex_unlock(&ls.routing_i_lock);
 
         return tmp;
 
- fail_pthread_create_lsupdate:
-        pthread_mutex_destroy(&tmp->lock);
- fail_instance_lock_init:
-        free(tmp);
  fail_tmp:
         return NULL;
 }
@@ -882,24 +1452,22 @@ void link_state_routing_i_destroy(struct routing_i * instance)
 
         pthread_mutex_unlock(&ls.routing_i_lock);
 
-        pthread_cancel(instance->calculator);
-
-        pthread_join(instance->calculator, NULL);
-
-        pthread_mutex_destroy(&instance->lock);
+        free_ents(instance->ents, instance->n_ents);
 
         free(instance);
 }
 
 int link_state_init(enum pol_routing pr)
 {
-        struct conn_info info;
+        struct conn_info   info;
+        pthread_condattr_t cattr;
+        size_t             i;
 
         memset(&info, 0, sizeof(info));
 
         strcpy(info.comp_name, LS_COMP);
         strcpy(info.protocol, LS_PROTO);
-        info.pref_version = 1;
+        info.pref_version = LS_VERSION;
         info.pref_syntax  = PROTO_GPB;
         info.addr         = ipcpi.dt_addr;
 
@@ -912,6 +1480,10 @@ int link_state_init(enum pol_routing pr)
                 log_dbg("Using Loop-Free Alternates policy.");
                 ls.routing_algo = ROUTING_LFA;
                 break;
+        case ROUTING_LINK_STATE_ECMP:
+                log_dbg("Using Equal-Cost Multipath policy.");
+                ls.routing_algo = ROUTING_ECMP;
+                break;
         default:
                 goto fail_graph;
         }
@@ -929,6 +1501,19 @@ int link_state_init(enum pol_routing pr)
         if (pthread_mutex_init(&ls.routing_i_lock, NULL))
                 goto fail_routing_i_lock_init;
 
+        if (pthread_condattr_init(&cattr))
+                goto fail_routing_i_cond_init;
+
+#ifndef __APPLE__
+        pthread_condattr_setclock(&cattr, PTHREAD_COND_CLOCK);
+#endif
+        if (pthread_cond_init(&ls.routing_i_cond, &cattr)) {
+                pthread_condattr_destroy(&cattr);
+                goto fail_routing_i_cond_init;
+        }
+
+        pthread_condattr_destroy(&cattr);
+
         if (connmgr_comp_init(COMPID_MGMT, &info))
                 goto fail_connmgr_comp_init;
 
@@ -936,10 +1521,25 @@ int link_state_init(enum pol_routing pr)
         if (ls.mgmt_set == NULL)
                 goto fail_fset_create;
 
+        ls.db_idx_len = LSDB_BUCKETS;
+        ls.db_idx     = malloc(sizeof(*ls.db_idx) * ls.db_idx_len);
+        if (ls.db_idx == NULL)
+                goto fail_db_idx;
+
+        for (i = 0; i < ls.db_idx_len; ++i)
+                list_head_init(&ls.db_idx[i]);
+
         list_head_init(&ls.db);
         list_head_init(&ls.nbs);
         list_head_init(&ls.routing_instances);
 
+        ls.db_len   = 0;
+        ls.nbs_len  = 0;
+        ls.modified = false;
+
+        if (pthread_create(&ls.calculator, NULL, recalc_pff, NULL))
+                goto fail_pthread_create_calculator;
+
         if (pthread_create(&ls.lsupdate, NULL, lsupdate, NULL))
                 goto fail_pthread_create_lsupdate;
 
@@ -952,9 +1552,6 @@ int link_state_init(enum pol_routing pr)
         if (rib_reg(LSDB, &r_ops))
                 goto fail_rib_reg;
 
-        ls.db_len      = 0;
-        ls.nbs_len     = 0;
-
         return 0;
 
  fail_rib_reg:
@@ -967,10 +1564,17 @@ int link_state_init(enum pol_routing pr)
         pthread_cancel(ls.lsupdate);
         pthread_join(ls.lsupdate, NULL);
  fail_pthread_create_lsupdate:
+        pthread_cancel(ls.calculator);
+        pthread_join(ls.calculator, NULL);
+ fail_pthread_create_calculator:
+        free(ls.db_idx);
+ fail_db_idx:
         fset_destroy(ls.mgmt_set);
  fail_fset_create:
         connmgr_comp_fini(COMPID_MGMT);
  fail_connmgr_comp_init:
+        pthread_cond_destroy(&ls.routing_i_cond);
+ fail_routing_i_cond_init:
         pthread_mutex_destroy(&ls.routing_i_lock);
  fail_routing_i_lock_init:
         pthread_rwlock_destroy(&ls.db_lock);
@@ -998,6 +1602,9 @@ void link_state_fini(void)
         pthread_cancel(ls.lsupdate);
         pthread_join(ls.lsupdate, NULL);
 
+        pthread_cancel(ls.calculator);
+        pthread_join(ls.calculator, NULL);
+
         fset_destroy(ls.mgmt_set);
 
         connmgr_comp_fini(COMPID_MGMT);
@@ -1008,14 +1615,18 @@ void link_state_fini(void)
 
         list_for_each_safe(p, h, &ls.db) {
                 struct adjacency * a = list_entry(p, struct adjacency, next);
-                list_del(&a->next);
+                lsdb_remove(a);
                 free(a);
         }
 
+        free(ls.db_idx);
+
         pthread_rwlock_unlock(&ls.db_lock);
 
         pthread_rwlock_destroy(&ls.db_lock);
 
+        pthread_cond_destroy(&ls.routing_i_cond);
+
         pthread_mutex_destroy(&ls.routing_i_lock);
 
         notifier_unreg(handle_event);
@@ -32,7 +32,8 @@ int                link_state_init(enum pol_routing pr);
 
 void               link_state_fini(void);
 
-struct routing_i * link_state_routing_i_create(struct pff * pff);
+struct routing_i * link_state_routing_i_create(struct pff * pff,
+                                               qoscube_t    qc);
 
 void               link_state_routing_i_destroy(struct routing_i * instance);
 
@@ -0,0 +1,444 @@
+/*
+ * Ouroboros - Copyright (C) 2016 - 2018
+ *
+ * Policy for PFF with equal-cost multipath next hops
+ *
+ *    Dimitri Staessens <dimitri.staessens@ugent.be>
+ *    Sander Vrijders   <sander.vrijders@ugent.be>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., http://www.fsf.org/about/contact/.
+ */
+
+#define _POSIX_C_SOURCE 200112L
+
+#include "config.h"
+
+#include <ouroboros/hashtable.h>
+#include <ouroboros/errno.h>
+#include <ouroboros/list.h>
+
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "rcu.h"
+#include "multipath_pff.h"
+
+struct nhop {
+        struct list_head next;
+        int              fd;
+};
+
+struct addr {
+        struct list_head next;
+        uint64_t         addr;
+};
+
+struct pff_i {
+        struct rcu_table table;
+
+        struct list_head addrs;
+
+        struct list_head nhops_down;
+
+        pthread_mutex_t  lock;
+};
+
+struct pol_pff_ops multipath_pff_ops = {
+        .create            = multipath_pff_create,
+        .destroy           = multipath_pff_destroy,
+        .lock              = multipath_pff_lock,
+        .unlock            = multipath_pff_unlock,
+        .add               = multipath_pff_add,
+        .update            = multipath_pff_update,
+        .del               = multipath_pff_del,
+        .flush             = multipath_pff_flush,
+        .nhop              = multipath_pff_nhop,
+        .flow_state_change = multipath_flow_state_change
+};
+
+static int add_addr(struct pff_i * pff_i,
+                    uint64_t       addr)
+{
+        struct addr * a;
+
+        a = malloc(sizeof(*a));
+        if (a == NULL)
+                return -1;
+
+        a->addr = addr;
+
+        list_add(&a->next, &(pff_i->addrs));
+
+        return 0;
+}
+
+static void del_addr(struct pff_i * pff_i,
+                     uint64_t       addr)
+{
+        struct list_head * pos = NULL;
+        struct list_head * n   = NULL;
+
+        list_for_each_safe(pos, n, &(pff_i->addrs)) {
+                struct addr * e = list_entry(pos, struct addr, next);
+                if (e->addr == addr) {
+                        list_del(&e->next);
+                        free(e);
+                        return;
+                }
+        }
+}
+
+static void del_addrs(struct pff_i * pff_i)
+{
+        struct list_head * pos = NULL;
+        struct list_head * n   = NULL;
+
+        list_for_each_safe(pos, n, &(pff_i->addrs)) {
+                struct addr * e = list_entry(pos, struct addr, next);
+                list_del(&e->next);
+                free(e);
+        }
+}
+
+static void del_nhops_down(struct pff_i * pff_i)
+{
+        struct list_head * pos = NULL;
+        struct list_head * n   = NULL;
+
+        list_for_each_safe(pos, n, &(pff_i->nhops_down)) {
+                struct nhop * e = list_entry(pos, struct nhop, next);
+                list_del(&e->next);
+                free(e);
+        }
+}
+
+static int del_nhop_down(struct pff_i * pff_i,
+                         int            fd)
+{
+        struct list_head * pos = NULL;
+        struct list_head * n   = NULL;
+
+        list_for_each_safe(pos, n, &(pff_i->nhops_down)) {
+                struct nhop * e = list_entry(pos, struct nhop, next);
+                if (e->fd == fd) {
+                        list_del(&e->next);
+                        free(e);
+                        return 0;
+                }
+        }
+
+        return -1;
+}
+
+static int add_nhop_down(struct pff_i * pff_i,
+                         int            fd)
+{
+        struct nhop * nhop;
+
+        nhop = malloc(sizeof(*nhop));
+        if (nhop == NULL)
+                return -1;
+
+        nhop->fd = fd;
+
+        list_add(&nhop->next, &(pff_i->nhops_down));
+
+        return 0;
+}
+
+static bool nhops_down_has(struct pff_i * pff_i,
+                           int            fd)
+{
+        struct list_head * pos = NULL;
+
+        list_for_each(pos, &pff_i->nhops_down) {
+                struct nhop * e = list_entry(pos, struct nhop, next);
+                if (e->fd == fd)
+                        return true;
+        }
+
+        return false;
+}
+
+/* The number of next hops is kept in front, len counts those up */
+static void * dup_nhops(const void * val,
+                        size_t       len)
+{
+        const int * src = (const int *) val;
+        int *       fds;
+
+        (void) len;
+
+        fds = malloc(sizeof(*fds) * (src[0] + 1));
+        if (fds == NULL)
+                return NULL;
+
+        memcpy(fds, src, sizeof(*fds) * (src[0] + 1));
+
+        return fds;
+}
+
+static int add_to_htable(struct pff_i * pff_i,
+                         uint64_t       addr,
+                         const int *    fd,
+                         size_t         len)
+{
+        struct htable * table;
+        int *           val;
+        size_t          up   = 0;
+        size_t          down = len;
+        size_t          i;
+
+        assert(pff_i);
+        assert(len > 0);
+
+        table = rcu_table_wr(&pff_i->table);
+        if (table == NULL)
+                goto fail_malloc;
+
+        val = malloc(sizeof(*val) * (len + 1));
+        if (val == NULL)
+                goto fail_malloc;
+
+        /* Hops that are up go first, PDUs are only hashed over those */
+        val[0] = len;
+        for (i = 0; i < len; ++i) {
+                if (nhops_down_has(pff_i, fd[i]))
+                        val[down--] = fd[i];
+                else
+                        val[++up] = fd[i];
+        }
+
+        /* With all of them down, keep using all of them */
+        if (htable_insert(table, addr, val, up > 0 ? up : len))
+                goto fail_insert;
+
+        return 0;
+
+ fail_insert:
+        free(val);
+ fail_malloc:
+        return -1;
+}
+
+struct pff_i * multipath_pff_create(void)
+{
+        struct pff_i * tmp;
+
+        tmp = malloc(sizeof(*tmp));
+        if (tmp == NULL)
+                goto fail_malloc;
+
+        if (pthread_mutex_init(&tmp->lock, NULL))
+                goto fail_lock;
+
+        if (rcu_table_init(&tmp->table, PFT_SIZE, dup_nhops))
+                goto fail_table;
+
+        list_head_init(&tmp->nhops_down);
+        list_head_init(&tmp->addrs);
+
+        return tmp;
+
+ fail_table:
+        pthread_mutex_destroy(&tmp->lock);
+ fail_lock:
+        free(tmp);
+ fail_malloc:
+        return NULL;
+}
+
+void multipath_pff_destroy(struct pff_i * pff_i)
+{
+        assert(pff_i);
+
+        rcu_table_fini(&pff_i->table);
+        del_nhops_down(pff_i);
+        del_addrs(pff_i);
+        pthread_mutex_destroy(&pff_i->lock);
+        free(pff_i);
+}
+
+void multipath_pff_lock(struct pff_i * pff_i)
+{
+        pthread_mutex_lock(&pff_i->lock);
+}
+
+void multipath_pff_unlock(struct pff_i * pff_i)
+{
+        rcu_table_publish(&pff_i->table);
+
+        pthread_mutex_unlock(&pff_i->lock);
+}
+
+int multipath_pff_add(struct pff_i * pff_i,
+                      uint64_t       addr,
+                      int *          fd,
+                      size_t         len)
+{
+        assert(pff_i);
+        assert(len > 0);
+
+        if (add_to_htable(pff_i, addr, fd, len))
+                return -1;
+
+        if (add_addr(pff_i, addr)) {
+                htable_delete(rcu_table_wr(&pff_i->table), addr);
+                return -1;
+        }
+
+        return 0;
+}
+
+int multipath_pff_update(struct pff_i * pff_i,
+                         uint64_t       addr,
+                         int *          fd,
+                         size_t         len)
+{
+        struct htable * table;
+
+        assert(pff_i);
+        assert(len > 0);
+
+        table = rcu_table_wr(&pff_i->table);
+        if (table == NULL)
+                return -ENOMEM;
+
+        if (htable_delete(table, addr))
+                return -1;
+
+        return add_to_htable(pff_i, addr, fd, len);
+}
+
+int multipath_pff_del(struct pff_i * pff_i,
+                      uint64_t       addr)
+{
+        struct htable * table;
+
+        assert(pff_i);
+
+        del_addr(pff_i, addr);
+
+        table = rcu_table_wr(&pff_i->table);
+        if (table == NULL)
+                return -ENOMEM;
+
+        if (htable_delete(table, addr))
+                return -1;
+
+        return 0;
+}
+
+void multipath_pff_flush(struct pff_i * pff_i)
+{
+        assert(pff_i);
+
+        rcu_table_flush(&pff_i->table);
+
+        del_nhops_down(pff_i);
+
+        del_addrs(pff_i);
+}
+
+int multipath_pff_nhop(struct pff_i * pff_i,
+                       uint64_t       addr,
+                       uint64_t       hash)
+{
+        int    fd = -1;
+        size_t len;
+        void * el;
+        int    tok;
+
+        assert(pff_i);
+
+        tok = rcu_read_lock(pff_i->table.rcu);
+
+        /* PDUs of a flow hash to the same hop and stay in order. */
+        if (!htable_lookup(rcu_table_rd(&pff_i->table), addr, &el, &len))
+                fd = ((int *) el)[1 + hash % len];
+
+        rcu_read_unlock(pff_i->table.rcu, tok);
+
+        return fd;
+}
+
+int multipath_flow_state_change(struct pff_i * pff_i,
+                                int            fd,
+                                bool           up)
+{
+        struct list_head * pos = NULL;
+        struct htable *    table;
+        size_t             len;
+        void *             el;
+        int *              fds;
+        int                i;
+
+        assert(pff_i);
+
+        multipath_pff_lock(pff_i);
+
+        if (up) {
+                if (del_nhop_down(pff_i, fd))
+                        goto fail;
+        } else {
+                if (add_nhop_down(pff_i, fd))
+                        goto fail;
+        }
+
+        /* Rehash in a copy, lookups see all changes at once. */
+        table = rcu_table_wr(&pff_i->table);
+        if (table == NULL)
+                goto fail;
+
+        list_for_each(pos, &pff_i->addrs) {
+                struct addr * e = list_entry(pos, struct addr, next);
+                if (htable_lookup(table, e->addr, &el, &len))
+                        goto fail_lookup;
+
+                fds = (int *) el;
+
+                for (i = 1; i <= fds[0]; ++i)
+                        if (fds[i] == fd)
+                                break;
+
+                /* Not a next hop towards this address */
+                if (i > fds[0])
+                        continue;
+
+                /* The table frees the old set on delete */
+                fds = dup_nhops(el, len);
+                if (fds == NULL)
+                        goto fail_lookup;
+
+                htable_delete(table, e->addr);
+
+                if (add_to_htable(pff_i, e->addr, fds + 1, fds[0])) {
+                        free(fds);
+                        goto fail_lookup;
+                }
+
+                free(fds);
+        }
+
+        multipath_pff_unlock(pff_i);
+
+        return 0;
+
+ fail_lookup:
+        rcu_table_abort(&pff_i->table);
+ fail:
+        multipath_pff_unlock(pff_i);
+        return -1;
+}
@@ -30,11 +30,12 @@
 #include <assert.h>
 #include <pthread.h>
 
+#include "rcu.h"
 #include "simple_pff.h"
 
 struct pff_i {
-        struct htable *  table;
-        pthread_rwlock_t lock;
+        struct rcu_table table;
+        pthread_mutex_t  lock;
 };
 
 struct pol_pff_ops simple_pff_ops = {
@@ -56,41 +57,44 @@ struct pff_i * simple_pff_create(void)
 
         tmp = malloc(sizeof(*tmp));
         if (tmp == NULL)
-                return NULL;
+                goto fail_malloc;
 
-        if (pthread_rwlock_init(&tmp->lock, NULL)) {
-                free(tmp);
-                return NULL;
-        }
+        if (pthread_mutex_init(&tmp->lock, NULL))
+                goto fail_lock;
 
-        tmp->table = htable_create(PFT_SIZE, false);
-        if (tmp->table == NULL) {
-                pthread_rwlock_destroy(&tmp->lock);
-                free(tmp);
-                return NULL;
-        }
+        if (rcu_table_init(&tmp->table, PFT_SIZE, NULL))
+                goto fail_table;
 
         return tmp;
+
+ fail_table:
+        pthread_mutex_destroy(&tmp->lock);
+ fail_lock:
+        free(tmp);
+ fail_malloc:
+        return NULL;
 }
 
 void simple_pff_destroy(struct pff_i * pff_i)
 {
         assert(pff_i);
 
-        htable_destroy(pff_i->table);
+        rcu_table_fini(&pff_i->table);
 
-        pthread_rwlock_destroy(&pff_i->lock);
+        pthread_mutex_destroy(&pff_i->lock);
         free(pff_i);
 }
 
 void simple_pff_lock(struct pff_i * pff_i)
 {
-        pthread_rwlock_wrlock(&pff_i->lock);
+        pthread_mutex_lock(&pff_i->lock);
 }
 
 void simple_pff_unlock(struct pff_i * pff_i)
 {
-        pthread_rwlock_unlock(&pff_i->lock);
+        rcu_table_publish(&pff_i->table);
+
+        pthread_mutex_unlock(&pff_i->lock);
 }
 
 int simple_pff_add(struct pff_i * pff_i,
@@ -98,23 +102,19 @@ int simple_pff_add(struct pff_i * pff_i,
                    int *          fd,
                    size_t         len)
 {
-        int * val;
+        struct htable * table;
 
         assert(pff_i);
         assert(len > 0);
 
         (void) len;
 
-        val = malloc(sizeof(*val));
-        if (val == NULL)
+        table = rcu_table_wr(&pff_i->table);
+        if (table == NULL)
                 return -ENOMEM;
 
-        *val = fd[0];
-
-        if (htable_insert(pff_i->table, addr, val, 1)) {
-                free(val);
+        if (htable_insert_num(table, addr, fd[0]))
                 return -1;
-        }
 
         return 0;
 }
@@ -124,27 +124,22 @@ int simple_pff_update(struct pff_i * pff_i,
                       int *          fd,
                       size_t         len)
 {
-        int * val;
+        struct htable * table;
 
         assert(pff_i);
         assert(len > 0);
 
         (void) len;
 
-        val = malloc(sizeof(*val));
-        if (val == NULL)
+        table = rcu_table_wr(&pff_i->table);
+        if (table == NULL)
                 return -ENOMEM;
-        *val = fd[0];
 
-        if (htable_delete(pff_i->table, addr)) {
-                free(val);
+        if (htable_delete(table, addr))
                 return -1;
-        }
 
-        if (htable_insert(pff_i->table, addr, val, 1)) {
-                free(val);
+        if (htable_insert_num(table, addr, fd[0]))
                 return -1;
-        }
 
         return 0;
 }
@@ -152,9 +147,15 @@ int simple_pff_update(struct pff_i * pff_i,
 int simple_pff_del(struct pff_i * pff_i,
                    uint64_t       addr)
 {
+        struct htable * table;
+
         assert(pff_i);
 
-        if (htable_delete(pff_i->table, addr))
+        table = rcu_table_wr(&pff_i->table);
+        if (table == NULL)
+                return -ENOMEM;
+
+        if (htable_delete(table, addr))
                 return -1;
 
         return 0;
@@ -164,24 +165,27 @@ void simple_pff_flush(struct pff_i * pff_i)
 {
         assert(pff_i);
 
-        htable_flush(pff_i->table);
+        rcu_table_flush(&pff_i->table);
 }
 
 int simple_pff_nhop(struct pff_i * pff_i,
-                    uint64_t       addr)
+                    uint64_t       addr,
+                    uint64_t       hash)
 {
-        void * j;
-        size_t len;
-        int    fd = -1;
+        int64_t j;
+        int     fd = -1;
+        int     tok;
+
+        (void) hash;
 
         assert(pff_i);
 
-        pthread_rwlock_rdlock(&pff_i->lock);
+        tok = rcu_read_lock(pff_i->table.rcu);
 
-        if (!htable_lookup(pff_i->table, addr, &j, &len))
-                fd = *((int *) j);
+        if (!htable_lookup_num(rcu_table_rd(&pff_i->table), addr, &j))
+                fd = (int) j;
 
-        pthread_rwlock_unlock(&pff_i->lock);
+        rcu_read_unlock(pff_i->table.rcu, tok);
 
         return fd;
 }
@@ -50,7 +50,8 @@ void           simple_pff_flush(struct pff_i * pff_i);
 
 /* Returns fd towards next hop */
 int            simple_pff_nhop(struct pff_i * pff_i,
-                               uint64_t       addr);
+                               uint64_t       addr,
+                               uint64_t       hash);
 
 struct pol_pff_ops simple_pff_ops;
 
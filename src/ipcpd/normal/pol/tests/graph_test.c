@@ -23,6 +23,7 @@
 #define _POSIX_C_SOURCE 200112L
 
 #include <ouroboros/utils.h>
+#include <ouroboros/time_utils.h>
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -30,6 +31,10 @@
 
 #include "graph.c"
 
+#define SCALE_SIDE   100 /* grid of SCALE_SIDE x SCALE_SIDE vertices */
+#define SCALE_CHORDS 10000
+#define SCALE_FLAPS  100
+
 struct graph *   graph;
 struct list_head table;
 qosspec_t        qs;
@@ -39,7 +44,8 @@ int graph_test_entries(int entries)
         struct list_head * p;
         int                i = 0;
 
-        if (graph_routing_table(graph, ROUTING_SIMPLE, 1, &table)) {
+        if (graph_routing_table(graph, ROUTING_SIMPLE, QOS_CUBE_BE, 1,
+                                &table)) {
                 printf("Failed to get routing table.\n");
                 return -1;
         }
@@ -63,7 +69,8 @@ int graph_test_double_link(void)
         struct list_head * p;
         int                i = 0;
 
-        if (graph_routing_table(graph, ROUTING_SIMPLE, 1, &table)) {
+        if (graph_routing_table(graph, ROUTING_SIMPLE, QOS_CUBE_BE, 1,
+                                &table)) {
                 printf("Failed to get routing table.\n");
                 return -1;
         }
@@ -101,7 +108,8 @@ int graph_test_single_link(void)
         struct list_head * p;
         int                i = 0;
 
-        if (graph_routing_table(graph, ROUTING_SIMPLE, 1, &table)) {
+        if (graph_routing_table(graph, ROUTING_SIMPLE, QOS_CUBE_BE, 1,
+                                &table)) {
                 printf("Failed to get routing table.\n");
                 return -1;
         }
@@ -133,6 +141,378 @@ int graph_test_single_link(void)
         return 0;
 }
 
+static int graph_test_link(uint64_t s,
+                           uint64_t d)
+{
+        if (graph_update_edge(graph, s, d, qs))
+                return -1;
+
+        return graph_update_edge(graph, d, s, qs);
+}
+
+/* Only dst has two equal-cost next hops, a and b. */
+static int graph_test_ecmp(uint64_t dst,
+                           uint64_t a,
+                           uint64_t b)
+{
+        struct list_head * p;
+        struct list_head * q;
+
+        if (graph_routing_table(graph, ROUTING_ECMP, QOS_CUBE_BE, 1, &table)) {
+                printf("Failed to get routing table.\n");
+                return -1;
+        }
+
+        list_for_each(p, &table) {
+                struct routing_table * t =
+                        list_entry(p, struct routing_table, next);
+                int                    i = 0;
+                bool                   has_a = false;
+                bool                   has_b = false;
+
+                list_for_each(q, &t->nhops) {
+                        struct nhop * n = list_entry(q, struct nhop, next);
+                        has_a |= n->nhop == a;
+                        has_b |= n->nhop == b;
+                        ++i;
+                }
+
+                if (t->dst == dst ? !(i == 2 && has_a && has_b) : i != 1) {
+                        printf("Wrong ECMP entry for %" PRIu64 ".\n",
+                               t->dst);
+                        graph_free_routing_table(graph, &table);
+                        return -1;
+                }
+        }
+
+        graph_free_routing_table(graph, &table);
+
+        return 0;
+}
+
+static int graph_test_time(enum routing_algo algo,
+                           const char *      name,
+                           int               entries)
+{
+        struct timespec    t0;
+        struct timespec    t1;
+        struct list_head * p;
+
+        /* Time a calculation from scratch, not the cached trees. */
+        list_for_each(p, &graph->spts) {
+                struct spt * spt = list_entry(p, struct spt, next);
+                spt->valid = false;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+
+        if (graph_routing_table(graph, algo, QOS_CUBE_BE, 1, &table)) {
+                printf("Failed to get routing table.\n");
+                return -1;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+
+        graph_free_routing_table(graph, &table);
+
+        printf("%-24s %d vertices: %ld ms.\n", name, entries + 1,
+               (long) ts_diff_ms(&t0, &t1));
+
+        return graph_test_entries(entries);
+}
+
+/* Compare the repaired trees with a calculation from scratch. */
+static int graph_test_spts(void)
+{
+        struct list_head * p;
+        int *              dist;
+        size_t             i;
+
+        dist = malloc(sizeof(*dist) * graph->cap);
+        if (dist == NULL)
+                return -1;
+
+        list_for_each(p, &graph->spts) {
+                struct spt * spt = list_entry(p, struct spt, next);
+
+                memcpy(dist, spt->dist, sizeof(*dist) * graph->n_idx);
+
+                if (spt_full(graph, spt)) {
+                        free(dist);
+                        return -1;
+                }
+
+                for (i = 0; i < graph->n_idx; ++i) {
+                        if (dist[i] != spt->dist[i]) {
+                                printf("Repaired tree differs.\n");
+                                free(dist);
+                                return -1;
+                        }
+                }
+        }
+
+        free(dist);
+
+        return 0;
+}
+
+/* Flap random links, the trees are repaired incrementally. */
+static int graph_test_flaps(uint64_t * r,
+                            int        n)
+{
+        struct timespec    t0;
+        struct timespec    t1;
+        struct list_head * p;
+        long               ns = 0;
+        int                i;
+        int                trees = 0;
+
+        /* Keep the trees of the neighbours as well. */
+        if (graph_routing_table(graph, ROUTING_LFA, QOS_CUBE_BE, 1, &table))
+                return -1;
+
+        graph_free_routing_table(graph, &table);
+
+        for (i = 0; i < SCALE_FLAPS; ++i) {
+                struct vertex * v;
+                struct edge *   e;
+                uint64_t        s;
+                uint64_t        d;
+
+                *r = *r * 6364136223846793005ULL + 1442695040888963407ULL;
+                s = (*r >> 33) % n + 1;
+
+                v = find_vertex_by_addr(graph, s);
+                e = list_first_entry(&v->edges, struct edge, next);
+                d = e->nb->addr;
+
+                clock_gettime(CLOCK_MONOTONIC, &t0);
+
+                if (graph_del_edge(graph, s, d) || graph_del_edge(graph, d, s))
+                        return -1;
+
+                clock_gettime(CLOCK_MONOTONIC, &t1);
+
+                ns += ts_diff_ns(&t0, &t1);
+
+                if (graph_test_spts())
+                        return -1;
+
+                clock_gettime(CLOCK_MONOTONIC, &t0);
+
+                if (graph_test_link(s, d))
+                        return -1;
+
+                clock_gettime(CLOCK_MONOTONIC, &t1);
+
+                ns += ts_diff_ns(&t0, &t1);
+
+                if (graph_test_spts())
+                        return -1;
+        }
+
+        list_for_each(p, &graph->spts)
+                ++trees;
+
+        printf("Link flap, %d trees: %ld us.\n",
+               trees, ns / SCALE_FLAPS / 1000);
+
+        return 0;
+}
+
+static int graph_test_trees(void)
+{
+        struct list_head * p;
+        int                n = 0;
+
+        list_for_each(p, &graph->spts)
+                ++n;
+
+        return n;
+}
+
+static int graph_test_metric(uint64_t s,
+                             uint64_t d,
+                             uint32_t delay,
+                             uint64_t bandwidth)
+{
+        qosspec_t m = qs;
+
+        m.delay     = delay;
+        m.bandwidth = bandwidth;
+
+        if (graph_update_edge(graph, s, d, m))
+                return -1;
+
+        return graph_update_edge(graph, d, s, m);
+}
+
+/* Checks the first next hop towards dst in the table of a cube. */
+static int graph_test_nhop(qoscube_t qc,
+                           uint64_t  dst,
+                           uint64_t  nhop)
+{
+        struct list_head * p;
+        int                ret = -1;
+
+        if (graph_routing_table(graph, ROUTING_SIMPLE, qc, 1, &table)) {
+                printf("Failed to get routing table.\n");
+                return -1;
+        }
+
+        list_for_each(p, &table) {
+                struct routing_table * t =
+                        list_entry(p, struct routing_table, next);
+                struct nhop *          n =
+                        list_first_entry(&t->nhops, struct nhop, next);
+
+                if (t->dst == dst && n->nhop == nhop)
+                        ret = 0;
+        }
+
+        graph_free_routing_table(graph, &table);
+
+        if (ret < 0)
+                printf("Wrong next hop for cube %d.\n", qc);
+
+        return ret;
+}
+
+/*
+ * 1 - 2 - 4 is short and narrow, 1 - 3 - 4 is long and wide. Voice
+ * takes the short path, best effort the wide one.
+ */
+static int graph_test_weights(void)
+{
+        qosspec_t m = qs;
+
+        graph = graph_create();
+        if (graph == NULL) {
+                printf("Failed to create graph.\n");
+                return -1;
+        }
+
+        if (graph_test_metric(1, 2, 1, 1000000000ULL) ||
+            graph_test_metric(2, 4, 1, 1000000000ULL) ||
+            graph_test_metric(1, 3, 20, 100000000000ULL) ||
+            graph_test_metric(3, 4, 20, 100000000000ULL))
+                goto fail;
+
+        if (graph_test_nhop(QOS_CUBE_VOICE, 4, 2) ||
+            graph_test_nhop(QOS_CUBE_BE, 4, 3))
+                goto fail;
+
+        /* Video weighs like voice and reuses its tree. */
+        if (!graph_same_weights(QOS_CUBE_VOICE, QOS_CUBE_VIDEO) ||
+            graph_same_weights(QOS_CUBE_VOICE, QOS_CUBE_BE))
+                goto fail;
+
+        if (graph_test_nhop(QOS_CUBE_VIDEO, 4, 2) || graph_test_trees() != 2)
+                goto fail;
+
+        /* Only one side announces a higher delay, the worst counts. */
+        m.delay     = 50;
+        m.bandwidth = 1000000000ULL;
+
+        if (graph_update_edge_qos(graph, 1, 2, m))
+                goto fail;
+
+        if (graph_test_spts())
+                goto fail;
+
+        if (graph_test_nhop(QOS_CUBE_VOICE, 4, 3) ||
+            graph_test_nhop(QOS_CUBE_BE, 4, 3))
+                goto fail;
+
+        m.delay = 1;
+
+        if (graph_update_edge_qos(graph, 1, 2, m))
+                goto fail;
+
+        if (graph_test_spts())
+                goto fail;
+
+        if (graph_test_nhop(QOS_CUBE_VOICE, 4, 2))
+                goto fail;
+
+        graph_destroy(graph);
+
+        return 0;
+ fail:
+        graph_destroy(graph);
+        return -1;
+}
+
+/* Routing on synthetic 10k vertex topologies. */
+static int graph_test_scale(void)
+{
+        uint64_t i;
+        uint64_t j;
+        uint64_t r = 1;
+        int      n = SCALE_SIDE * SCALE_SIDE;
+
+        graph = graph_create();
+        if (graph == NULL) {
+                printf("Failed to create graph.\n");
+                return -1;
+        }
+
+        for (i = 0; i < SCALE_SIDE; ++i) {
+                for (j = 0; j < SCALE_SIDE; ++j) {
+                        uint64_t v = i * SCALE_SIDE + j + 1;
+                        if (j + 1 < SCALE_SIDE && graph_test_link(v, v + 1))
+                                goto fail;
+                        if (i + 1 < SCALE_SIDE &&
+                            graph_test_link(v, v + SCALE_SIDE))
+                                goto fail;
+                }
+        }
+
+        if (graph_test_time(ROUTING_SIMPLE, "Grid, simple:", n - 1))
+                goto fail;
+
+        if (graph_test_time(ROUTING_LFA, "Grid, LFA:", n - 1))
+                goto fail;
+
+        if (graph_test_time(ROUTING_ECMP, "Grid, ECMP:", n - 1))
+                goto fail;
+
+        /* Random shortcuts make it a small world. */
+        for (i = 0; i < SCALE_CHORDS; ++i) {
+                uint64_t s;
+                uint64_t d;
+
+                r = r * 6364136223846793005ULL + 1442695040888963407ULL;
+                s = (r >> 33) % n + 1;
+                r = r * 6364136223846793005ULL + 1442695040888963407ULL;
+                d = (r >> 33) % n + 1;
+
+                if (s == d || find_edge_by_addr(find_vertex_by_addr(graph, s),
+                                                d) != NULL)
+                        continue;
+
+                if (graph_test_link(s, d))
+                        goto fail;
+        }
+
+        if (graph_test_time(ROUTING_SIMPLE, "Small world, simple:", n - 1))
+                goto fail;
+
+        if (graph_test_time(ROUTING_LFA, "Small world, LFA:", n - 1))
+                goto fail;
+
+        if (graph_test_flaps(&r, n))
+                goto fail;
+
+        graph_destroy(graph);
+
+        return 0;
+ fail:
+        printf("Failed to build topology.\n");
+        graph_destroy(graph);
+        return -1;
+}
+
 int graph_test(int     argc,
                char ** argv)
 {
@@ -243,7 +623,8 @@ int graph_test(int     argc,
                 return -1;
         }
 
-        if (graph_routing_table(graph, ROUTING_SIMPLE, 1, &table)) {
+        if (graph_routing_table(graph, ROUTING_SIMPLE, QOS_CUBE_BE, 1,
+                                &table)) {
                 printf("Failed to get routing table.\n");
                 return -1;
         }
@@ -296,5 +677,29 @@ int graph_test(int     argc,
 
         graph_free_routing_table(graph, &table);
 
-        return 0;
+        /* 6 is now two hops away over both 2 and 3. */
+        graph_update_edge(graph, 3, 6, qs);
+        graph_update_edge(graph, 6, 3, qs);
+
+        if (graph_test_ecmp(6, 2, 3)) {
+                graph_destroy(graph);
+                return -1;
+        }
+
+        /* A direct link to 6 as long as the path over 3. */
+        graph_del_edge(graph, 2, 6);
+        graph_del_edge(graph, 6, 2);
+
+        if (graph_test_metric(1, 6, 1, 50000000000ULL) ||
+            graph_test_ecmp(6, 3, 6)) {
+                graph_destroy(graph);
+                return -1;
+        }
+
+        graph_destroy(graph);
+
+        if (graph_test_weights())
+                return -1;
+
+        return graph_test_scale();
 }
@@ -41,6 +41,8 @@
 #include <stdlib.h>
 #include <string.h>
 
+#define READ_BATCH 16
+
 static int qos_prio [] = {
         QOS_PRIO_BE,
         QOS_PRIO_VIDEO,
@@ -66,8 +68,10 @@ static void cleanup_reader(void * o)
 static void * packet_reader(void * o)
 {
         struct psched *       sched;
-        struct shm_du_buff *  sdb;
+        struct shm_du_buff *  sdb[READ_BATCH];
         int                   fd;
+        int                   n;
+        int                   i;
         fqueue_t *            fq;
         qoscube_t             qc;
 
@@ -101,10 +105,13 @@ static void * packet_reader(void * o)
                                 notifier_event(NOTIFY_DT_FLOW_UP, &fd);
                                 break;
                         case FLOW_PKT:
-                                if (ipcp_flow_read(fd, &sdb))
+                                /* May be read on an earlier event. */
+                                n = ipcp_flow_read_batch(fd, sdb, READ_BATCH);
+                                if (n <= 0)
                                         continue;
 
-                                sched->callback(fd, qc, sdb);
+                                for (i = 0; i < n; ++i)
+                                        sched->callback(fd, qc, sdb[i]);
                                 break;
                         default:
                                 break;
@@ -139,6 +146,9 @@ struct psched * psched_create(next_packet_fn_t callback)
                                 fset_destroy(psched->set[j]);
                         goto fail_flow_set;
                 }
+#ifdef IPCP_BUSY_POLL
+                fset_spin(psched->set[i], NULL);
+#endif
         }
 
         for (i = 0; i < QOS_CUBE_MAX * IPCP_SCHED_THR_MUL; ++i) {
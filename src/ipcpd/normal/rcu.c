@@ -0,0 +1,207 @@
+/*
+ * Ouroboros - Copyright (C) 2016 - 2018
+ *
+ * Epoch-based read-copy-update
+ *
+ *    Dimitri Staessens <dimitri.staessens@ugent.be>
+ *    Sander Vrijders   <sander.vrijders@ugent.be>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., http://www.fsf.org/about/contact/.
+ */
+
+#if defined(__linux__) || defined(__CYGWIN__)
+#define _DEFAULT_SOURCE
+#else
+#define _POSIX_C_SOURCE 200112L
+#endif
+
+#include "rcu.h"
+
+#include <assert.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define RCU_SLOTS 64 /* shared by threads beyond this */
+#define CACHE_LINE 64
+
+struct rcu_slot {
+        size_t cnt[2]; /* readers per epoch parity */
+        char   pad[CACHE_LINE - 2 * sizeof(size_t)];
+};
+
+struct rcu {
+        struct rcu_slot slots[RCU_SLOTS];
+        size_t          epoch;
+};
+
+static size_t       rcu_threads;
+static __thread int rcu_slot = -1;
+
+struct rcu * rcu_create(void)
+{
+        struct rcu * rcu;
+
+        /* Aligned, or the slots would share cache lines after all. */
+        if (posix_memalign((void **) &rcu, CACHE_LINE, sizeof(*rcu)))
+                return NULL;
+
+        memset(rcu, 0, sizeof(*rcu));
+
+        return rcu;
+}
+
+void rcu_destroy(struct rcu * rcu)
+{
+        assert(rcu);
+
+        free(rcu);
+}
+
+int rcu_read_lock(struct rcu * rcu)
+{
+        size_t e;
+
+        if (rcu_slot < 0)
+                rcu_slot = __atomic_fetch_add(&rcu_threads, 1,
+                                              __ATOMIC_RELAXED) % RCU_SLOTS;
+
+        /* Retry if a writer moved on before our count was seen. */
+        while (true) {
+                e = __atomic_load_n(&rcu->epoch, __ATOMIC_SEQ_CST) & 1;
+                __atomic_add_fetch(&rcu->slots[rcu_slot].cnt[e], 1,
+                                   __ATOMIC_SEQ_CST);
+                if ((__atomic_load_n(&rcu->epoch, __ATOMIC_SEQ_CST) & 1) == e)
+                        break;
+                __atomic_sub_fetch(&rcu->slots[rcu_slot].cnt[e], 1,
+                                   __ATOMIC_RELEASE);
+        }
+
+        return (rcu_slot << 1) | e;
+}
+
+void rcu_read_unlock(struct rcu * rcu,
+                     int          token)
+{
+        __atomic_sub_fetch(&rcu->slots[token >> 1].cnt[token & 1], 1,
+                           __ATOMIC_RELEASE);
+}
+
+/* Writers are serialized by the caller. */
+void rcu_synchronize(struct rcu * rcu)
+{
+        size_t e;
+        int    i;
+
+        e = __atomic_fetch_add(&rcu->epoch, 1, __ATOMIC_SEQ_CST) & 1;
+
+        for (i = 0; i < RCU_SLOTS; ++i)
+                while (__atomic_load_n(&rcu->slots[i].cnt[e],
+                                       __ATOMIC_ACQUIRE) != 0)
+                        sched_yield();
+}
+
+int rcu_table_init(struct rcu_table * t,
+                   uint64_t           buckets,
+                   void *          (* dup)(const void * val,
+                                           size_t       len))
+{
+        assert(t);
+
+        t->rcu = rcu_create();
+        if (t->rcu == NULL)
+                goto fail_rcu;
+
+        t->table = htable_create(buckets, true);
+        if (t->table == NULL)
+                goto fail_table;
+
+        t->next    = NULL;
+        t->buckets = buckets;
+        t->dup     = dup;
+
+        return 0;
+
+ fail_table:
+        rcu_destroy(t->rcu);
+ fail_rcu:
+        return -1;
+}
+
+void rcu_table_fini(struct rcu_table * t)
+{
+        assert(t);
+        assert(t->next == NULL);
+
+        htable_destroy(t->table);
+        rcu_destroy(t->rcu);
+}
+
+struct htable * rcu_table_wr(struct rcu_table * t)
+{
+        assert(t);
+
+        if (t->next == NULL)
+                t->next = htable_copy(t->table, t->dup);
+
+        return t->next;
+}
+
+void rcu_table_flush(struct rcu_table * t)
+{
+        struct htable * table;
+
+        assert(t);
+
+        /* Start from an empty table, no need to copy. */
+        table = htable_create(t->buckets, true);
+        if (table == NULL) {
+                table = rcu_table_wr(t);
+                if (table != NULL)
+                        htable_flush(table);
+                return;
+        }
+
+        if (t->next != NULL)
+                htable_destroy(t->next);
+
+        t->next = table;
+}
+
+void rcu_table_abort(struct rcu_table * t)
+{
+        assert(t);
+
+        if (t->next != NULL)
+                htable_destroy(t->next);
+
+        t->next = NULL;
+}
+
+void rcu_table_publish(struct rcu_table * t)
+{
+        struct htable * old;
+
+        assert(t);
+
+        if (t->next == NULL)
+                return;
+
+        old = t->table;
+        rcu_store(&t->table, t->next);
+        t->next = NULL;
+        rcu_synchronize(t->rcu);
+        htable_destroy(old);
+}
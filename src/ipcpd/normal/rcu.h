@@ -0,0 +1,84 @@
+/*
+ * Ouroboros - Copyright (C) 2016 - 2018
+ *
+ * Epoch-based read-copy-update
+ *
+ *    Dimitri Staessens <dimitri.staessens@ugent.be>
+ *    Sander Vrijders   <sander.vrijders@ugent.be>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., http://www.fsf.org/about/contact/.
+ */
+
+#ifndef OUROBOROS_IPCPD_NORMAL_RCU_H
+#define OUROBOROS_IPCPD_NORMAL_RCU_H
+
+#include <ouroboros/hashtable.h>
+
+/*
+ * Readers take no locks, they mark the epoch they run in on a
+ * counter of their own. Writers publish a new version and call
+ * rcu_synchronize before freeing the old one.
+ */
+
+#define rcu_load(ptr)       __atomic_load_n(ptr, __ATOMIC_ACQUIRE)
+#define rcu_store(ptr, val) __atomic_store_n(ptr, val, __ATOMIC_RELEASE)
+
+struct rcu * rcu_create(void);
+
+void         rcu_destroy(struct rcu * rcu);
+
+/* Returns a token to pass to rcu_read_unlock */
+int          rcu_read_lock(struct rcu * rcu);
+
+void         rcu_read_unlock(struct rcu * rcu,
+                             int          token);
+
+/* Waits until all readers that may see the old version are done */
+void         rcu_synchronize(struct rcu * rcu);
+
+/*
+ * A hash table that lookups read without locking. The writer, which
+ * the caller serializes, changes a copy and publishes it at once.
+ */
+struct rcu_table {
+        struct htable *  table;
+        struct htable *  next;
+        struct rcu *     rcu;
+        uint64_t         buckets;
+        void *        (* dup)(const void * val,
+                              size_t       len);
+};
+
+#define rcu_table_rd(t) rcu_load(&(t)->table)
+
+int             rcu_table_init(struct rcu_table * t,
+                               uint64_t           buckets,
+                               void *          (* dup)(const void * val,
+                                                       size_t       len));
+
+void            rcu_table_fini(struct rcu_table * t);
+
+/* The copy the writer changes, made on the first change */
+struct htable * rcu_table_wr(struct rcu_table * t);
+
+/* Starts the writer from an empty table */
+void            rcu_table_flush(struct rcu_table * t);
+
+/* Drops the changes of the writer */
+void            rcu_table_abort(struct rcu_table * t);
+
+/* Publishes the changes, waits for the readers of the old table */
+void            rcu_table_publish(struct rcu_table * t);
+
+#endif /* OUROBOROS_IPCPD_NORMAL_RCU_H */
@@ -34,6 +34,7 @@ int routing_init(enum pol_routing pr)
         switch (pr) {
         case ROUTING_LINK_STATE:
         case ROUTING_LINK_STATE_LFA:
+        case ROUTING_LINK_STATE_ECMP:
                 r_ops = &link_state_ops;
                 break;
         default:
@@ -43,9 +44,10 @@ int routing_init(enum pol_routing pr)
         return r_ops->init(pr);
 }
 
-struct routing_i * routing_i_create(struct pff * pff)
+struct routing_i * routing_i_create(struct pff * pff,
+                                    qoscube_t    qc)
 {
-        return r_ops->routing_i_create(pff);
+        return r_ops->routing_i_create(pff, qc);
 }
 
 void routing_i_destroy(struct routing_i * instance)
@@ -25,6 +25,7 @@
 
 #include <ouroboros/ipcp.h>
 #include <ouroboros/qos.h>
+#include <ouroboros/qoscube.h>
 
 #include "pff.h"
 
@@ -34,7 +35,9 @@ int                routing_init(enum pol_routing pr);
 
 void               routing_fini(void);
 
-struct routing_i * routing_i_create(struct pff * pff);
+/* Calculates the pff with the link weights for the cube */
+struct routing_i * routing_i_create(struct pff * pff,
+                                    qoscube_t    qc);
 
 void               routing_i_destroy(struct routing_i * instance);
 
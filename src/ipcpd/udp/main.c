@@ -141,6 +141,9 @@ static int udp_data_init(void)
         udp_data.np1_flows = fset_create();
         if (udp_data.np1_flows == NULL)
                 goto fail_fset;
+#ifdef IPCP_BUSY_POLL
+        fset_spin(udp_data.np1_flows, NULL);
+#endif
 
         udp_data.fq = fqueue_create();
         if (udp_data.fq == NULL)
@@ -44,6 +44,7 @@
 #include <ouroboros/shm_rbuff.h>
 #include <ouroboros/utils.h>
 #include <ouroboros/fqueue.h>
+#include <ouroboros/list.h>
 
 #include <stdlib.h>
 #include <string.h>
@@ -62,8 +63,19 @@
 
 #define CRCLEN    (sizeof(uint32_t))
 
+/* Maximum number of SDUs moved per lock round-trip in batched I/O. */
+#define IOV_BATCH    64
+
+/* Wait before writing the next fragment to a full tx rbuff again. */
+#define FRAG_RETRY   (100 * 1000) /* ns */
+
+#define spins(busy, spin) ((busy) || (spin)->tv_sec > 0 || (spin)->tv_nsec > 0)
+
 struct flow_set {
-        size_t   idx;
+        size_t          idx;
+
+        bool            busy;  /* Spin until an event arrives. */
+        struct timespec spin;  /* Spin budget before waiting.  */
 };
 
 struct fqueue {
@@ -107,6 +119,9 @@ struct flow {
         struct timespec       snd_timeo;
         struct timespec       rcv_timeo;
 
+        bool                  rcv_busy;
+        struct timespec       rcv_spin;
+
         struct frcti *        frcti;
 };
 
@@ -128,6 +143,29 @@ struct {
         pthread_rwlock_t      lock;
 } ai;
 
+static int chk_crc(struct shm_du_buff * sdb)
+{
+        uint32_t crc;
+        uint8_t * head = shm_du_buff_head(sdb);
+        uint8_t * tail = shm_du_buff_tail_release(sdb, CRCLEN);
+
+        mem_hash(HASH_CRC32, &crc, head, tail - head);
+
+        return !(crc == *((uint32_t *) tail));
+}
+
+static int add_crc(struct shm_du_buff * sdb)
+{
+        uint8_t * head = shm_du_buff_head(sdb);
+        uint8_t * tail = shm_du_buff_tail_alloc(sdb, CRCLEN);
+        if (tail == NULL)
+                return -1;
+
+        mem_hash(HASH_CRC32, tail, head, tail - head);
+
+        return 0;
+}
+
 #include "frct.c"
 
 static void port_destroy(struct port * p)
@@ -445,8 +483,6 @@ static void fini(void)
         if (ai.fds == NULL)
                 return;
 
-        rxmwheel_fini();
-
         if (ai.prog != NULL)
                 free(ai.prog);
 
@@ -462,6 +498,8 @@ static void fini(void)
                 }
         }
 
+        rxmwheel_fini();
+
         shm_flow_set_destroy(ai.fqset);
 
         for (i = 0; i < SYS_MAX_FLOWS; ++i) {
@@ -687,6 +725,7 @@ int fccntl(int fd,
         uint32_t          rx_acl;
         uint32_t          tx_acl;
         size_t *          qlen;
+        int *             cc;
         struct flow *     flow;
 
         if (fd < 0 || fd >= SYS_MAX_FLOWS)
@@ -739,6 +778,23 @@ int fccntl(int fd,
                         goto eperm;
                 *timeo = flow->snd_timeo;
                 break;
+        case FLOWSRCVSPIN:
+                timeo = va_arg(l, struct timespec *);
+                if (timeo == NULL) {
+                        flow->rcv_busy = true;
+                } else {
+                        flow->rcv_busy = false;
+                        flow->rcv_spin = *timeo;
+                }
+                break;
+        case FLOWGRCVSPIN:
+                timeo = va_arg(l, struct timespec *);
+                if (timeo == NULL)
+                        goto einval;
+                if (flow->rcv_busy)
+                        goto eperm;
+                *timeo = flow->rcv_spin;
+                break;
         case FLOWGQOSSPEC:
                 qs = va_arg(l, qosspec_t *);
                 if (qs == NULL)
@@ -798,6 +854,30 @@ int fccntl(int fd,
                         goto eperm;
                 *cflags = frcti_getconf(flow->frcti);
                 break;
+        case FRCTGSRTT:
+        case FRCTGRTTVAR:
+        case FRCTGRTO:
+                timeo = va_arg(l, struct timespec *);
+                if (timeo == NULL)
+                        goto einval;
+                if (flow->frcti == NULL)
+                        goto eperm;
+                frcti_getrtt(flow->frcti, cmd, timeo);
+                break;
+        case FRCTSCC:
+                if (flow->frcti == NULL)
+                        goto eperm;
+                if (frcti_setcc(flow->frcti, va_arg(l, int)))
+                        goto einval;
+                break;
+        case FRCTGCC:
+                cc = va_arg(l, int *);
+                if (cc == NULL)
+                        goto einval;
+                if (flow->frcti == NULL)
+                        goto eperm;
+                *cc = frcti_getcc(flow->frcti);
+                break;
         default:
                 pthread_rwlock_unlock(&ai.lock);
                 va_end(l);
@@ -821,25 +901,258 @@ int fccntl(int fd,
         return -EPERM;
 }
 
-static int chk_crc(struct shm_du_buff * sdb)
+/* Deadline for spinning, NULL spins until something arrives. */
+static const struct timespec * spin_deadline(bool                    busy,
+                                             const struct timespec * spin,
+                                             const struct timespec * abstime,
+                                             struct timespec *       dl)
 {
-        uint32_t crc;
-        uint8_t * head = shm_du_buff_head(sdb);
-        uint8_t * tail = shm_du_buff_tail_release(sdb, CRCLEN);
+        if (busy)
+                return abstime;
 
-        mem_hash(HASH_CRC32, &crc, head, tail - head);
+        clock_gettime(PTHREAD_COND_CLOCK, dl);
+        ts_add(dl, spin, dl);
 
-        return !(crc == *((uint32_t *) tail));
+        if (abstime != NULL && ts_diff_ns(abstime, dl) > 0)
+                *dl = *abstime;
+
+        return dl;
 }
 
-static int add_crc(struct shm_du_buff * sdb)
+static bool spin_continue(const struct timespec * dl)
 {
-        uint8_t * head = shm_du_buff_head(sdb);
-        uint8_t * tail = shm_du_buff_tail_alloc(sdb, CRCLEN);
-        if (tail == NULL)
-                return -1;
+        struct timespec now;
 
-        mem_hash(HASH_CRC32, tail, head, tail - head);
+        pthread_testcancel();
+
+        if (dl == NULL)
+                return true;
+
+        clock_gettime(PTHREAD_COND_CLOCK, &now);
+
+        return ts_diff_ns(&now, dl) > 0;
+}
+
+static ssize_t flow_rb_read(struct flow *           flow,
+                            struct shm_rbuff *      rb,
+                            bool                    noblock,
+                            const struct timespec * abstime)
+{
+        const struct timespec * dl;
+        struct timespec         ts;
+        ssize_t                 idx;
+
+        if (noblock)
+                return shm_rbuff_read(rb);
+
+        if (!spins(flow->rcv_busy, &flow->rcv_spin))
+                return shm_rbuff_read_b(rb, abstime);
+
+        dl = spin_deadline(flow->rcv_busy, &flow->rcv_spin, abstime, &ts);
+
+        while ((idx = shm_rbuff_read(rb)) == -EAGAIN && spin_continue(dl))
+                ;
+
+        if (idx != -EAGAIN)
+                return idx;
+
+        return shm_rbuff_read_b(rb, abstime);
+}
+
+static ssize_t flow_rx_next(struct flow *           flow,
+                            struct shm_rbuff *      rb,
+                            bool                    noblock,
+                            const struct timespec * abstime)
+{
+        ssize_t              idx;
+        struct shm_du_buff * sdb;
+
+        /* A PDU may complete an SDU that FRCT queued, check each time. */
+        while (true) {
+                idx = frcti_queued_pdu(flow->frcti);
+                if (idx >= 0)
+                        return idx;
+
+                idx = flow_rb_read(flow, rb, noblock, abstime);
+                if (idx < 0)
+                        return idx;
+
+                sdb = shm_rdrbuff_get(ai.rdrb, idx);
+                if (flow->spec.ber == 0 && chk_crc(sdb) != 0) {
+                        shm_rdrbuff_remove(ai.rdrb, idx);
+                        continue;
+                }
+
+                if (frcti_rcv(flow->frcti, sdb) == 0)
+                        return idx;
+        }
+}
+
+static ssize_t flow_rx_sdu(struct flow *           flow,
+                           struct shm_rbuff *      rb,
+                           bool                    noblock,
+                           const struct timespec * abstime)
+{
+        ssize_t idx;
+
+        if (noblock)
+                return flow_rx_next(flow, rb, true, abstime);
+
+        frcti_rd_enter(flow->frcti);
+
+        pthread_cleanup_push(frcti_rd_exit, flow->frcti);
+
+        idx = flow_rx_next(flow, rb, false, abstime);
+
+        pthread_cleanup_pop(true);
+
+        return idx;
+}
+
+/*
+ * Copy an SDU, which may consist of FRCT fragments, into buf. Leaves
+ * the part that does not fit in part_idx.
+ */
+static ssize_t flow_rx_copy(struct flow * flow,
+                            ssize_t       idx,
+                            uint8_t *     buf,
+                            size_t        count,
+                            bool          partrd)
+{
+        ssize_t              n;
+        size_t               off = 0;
+        uint8_t *            packet;
+        struct shm_du_buff * sdb;
+
+        flow->part_idx = NO_PART;
+
+        while (idx >= 0) {
+                n = shm_rdrbuff_read(&packet, ai.rdrb, idx);
+
+                assert(n >= 0);
+
+                if (n > (ssize_t) (count - off)) {
+                        if (!partrd) {
+                                shm_rdrbuff_remove(ai.rdrb, idx);
+                                while ((idx = frcti_frag_next(flow->frcti))
+                                       >= 0)
+                                        shm_rdrbuff_remove(ai.rdrb, idx);
+                                return -EMSGSIZE;
+                        }
+                        memcpy(buf + off, packet, count - off);
+                        sdb = shm_rdrbuff_get(ai.rdrb, idx);
+                        shm_du_buff_head_release(sdb, count - off);
+                        flow->part_idx = idx;
+                        return count;
+                }
+
+                memcpy(buf + off, packet, n);
+                off += n;
+
+                shm_rdrbuff_remove(ai.rdrb, idx);
+
+                idx = frcti_frag_next(flow->frcti);
+        }
+
+        return off;
+}
+
+/* With retry set, wait for room in a full tx rbuff. */
+static int flow_tx_sdu(struct flow * flow,
+                       ssize_t       idx,
+                       bool          more,
+                       bool          retry)
+{
+        struct shm_du_buff * sdb;
+        struct timespec      intv = {0, FRAG_RETRY};
+        int                  ret;
+
+        sdb = shm_rdrbuff_get(ai.rdrb, idx);
+
+        if (frcti_snd_frag(flow->frcti, sdb, more) < 0) {
+                shm_rdrbuff_remove(ai.rdrb, idx);
+                return -ENOMEM;
+        }
+
+        if (flow->spec.ber == 0 && add_crc(sdb) != 0) {
+                shm_rdrbuff_remove(ai.rdrb, idx);
+                return -ENOMEM;
+        }
+
+        pthread_rwlock_rdlock(&ai.lock);
+
+        while ((ret = shm_rbuff_write(flow->tx_rb, idx)) == -EAGAIN
+               && retry) {
+                pthread_rwlock_unlock(&ai.lock);
+                nanosleep(&intv, NULL);
+                pthread_rwlock_rdlock(&ai.lock);
+        }
+
+        if (ret < 0)
+                shm_rdrbuff_remove(ai.rdrb, idx);
+        else
+                shm_flow_set_notify(flow->set, flow->flow_id, FLOW_PKT);
+
+        pthread_rwlock_unlock(&ai.lock);
+
+        assert(ret <= 0);
+
+        return ret;
+}
+
+/*
+ * Send an SDU as FRCT fragments. Only the first fragment waits for the
+ * windows and buffer space as requested. Once it is sent, the others
+ * block until they are sent as well, since the receiver would glue a
+ * partial SDU to the next one. They only fail when the flow is gone.
+ */
+static int flow_write_frags(struct flow *           flow,
+                            const uint8_t *         buf,
+                            size_t                  count,
+                            int                     flags,
+                            const struct timespec * abstime)
+{
+        ssize_t idx;
+        size_t  len;
+        size_t  off   = 0;
+        bool    block = !(flags & FLOWFWNOBLOCK);
+        int     ret;
+
+        ret = frcti_snd_wait(flow->frcti, block, abstime);
+        if (ret < 0)
+                return ret;
+
+        while (off < count) {
+                len = MIN(count - off, FRCT_FRAG_SIZE);
+
+                if (off > 0) {
+                        ret = frcti_snd_wait(flow->frcti, true, NULL);
+                        if (ret < 0)
+                                return ret;
+                }
+
+                if (off == 0 && !block)
+                        idx = shm_rdrbuff_write(ai.rdrb,
+                                                DU_BUFF_HEADSPACE,
+                                                DU_BUFF_TAILSPACE,
+                                                buf,
+                                                len);
+                else
+                        idx = shm_rdrbuff_write_b(ai.rdrb,
+                                                  DU_BUFF_HEADSPACE,
+                                                  DU_BUFF_TAILSPACE,
+                                                  buf + off,
+                                                  len,
+                                                  off == 0 ? abstime : NULL);
+                if (idx < 0)
+                        return idx;
+
+                ret = flow_tx_sdu(flow, idx, off + len < count, off > 0);
+                if (ret < 0)
+                        return ret;
+
+                off += len;
+        }
 
         return 0;
 }
@@ -854,7 +1167,6 @@ ssize_t flow_write(int          fd,
         int                  flags;
         struct timespec      abs;
         struct timespec *    abstime = NULL;
-        struct shm_du_buff * sdb;
 
         if (buf == NULL)
                 return 0;
@@ -885,6 +1197,13 @@ ssize_t flow_write(int          fd,
         if ((flags & FLOWFACCMODE) == FLOWFRDONLY)
                 return -EPERM;
 
+        if (frcti_fragments(flow->frcti, count))
+                return flow_write_frags(flow, buf, count, flags, abstime);
+
+        ret = frcti_snd_wait(flow->frcti, !(flags & FLOWFWNOBLOCK), abstime);
+        if (ret < 0)
+                return ret;
+
         if (flags & FLOWFWNOBLOCK)
                 idx = shm_rdrbuff_write(ai.rdrb,
                                         DU_BUFF_HEADSPACE,
@@ -901,31 +1220,136 @@ ssize_t flow_write(int          fd,
         if (idx < 0)
                 return idx;
 
-        sdb = shm_rdrbuff_get(ai.rdrb, idx);
+        return flow_tx_sdu(flow, idx, false, false);
+}
 
-        if (frcti_snd(flow->frcti, sdb) < 0) {
-                shm_rdrbuff_remove(ai.rdrb, idx);
-                return -ENOMEM;
-        }
+ssize_t flow_writev(int                  fd,
+                    const struct iovec * iov,
+                    int                  iovcnt)
+{
+        struct flow *        flow;
+        ssize_t              idx[IOV_BATCH];
+        ssize_t              ret = 0;
+        int                  err = 0;
+        int                  flags;
+        int                  i;
+        int                  n;
+        int                  sent = 0;
+        struct timespec      abs;
+        struct timespec *    abstime = NULL;
+        struct shm_du_buff * sdb;
 
-        if (flow->spec.ber == 0 && add_crc(sdb) != 0) {
-                shm_rdrbuff_remove(ai.rdrb, idx);
-                return -ENOMEM;
-        }
+        if (iov == NULL || iovcnt <= 0)
+                return 0;
+
+        if (fd < 0 || fd > PROG_MAX_FLOWS)
+                return -EBADF;
+
+        flow = &ai.flows[fd];
+
+        clock_gettime(PTHREAD_COND_CLOCK, &abs);
 
         pthread_rwlock_rdlock(&ai.lock);
 
-        ret = shm_rbuff_write(flow->tx_rb, idx);
-        if (ret < 0)
-                shm_rdrbuff_remove(ai.rdrb, idx);
-        else
-                shm_flow_set_notify(flow->set, flow->flow_id, FLOW_PKT);
+        if (flow->flow_id < 0) {
+                pthread_rwlock_unlock(&ai.lock);
+                return -ENOTALLOC;
+        }
+
+        if (ai.flows[fd].snd_timesout) {
+                ts_add(&abs, &flow->snd_timeo, &abs);
+                abstime = &abs;
+        }
+
+        flags = flow->oflags;
 
         pthread_rwlock_unlock(&ai.lock);
 
-        assert(ret <= 0);
+        if ((flags & FLOWFACCMODE) == FLOWFRDONLY)
+                return -EPERM;
 
-        return ret;
+        while (sent < iovcnt && ret == 0) {
+                for (n = 0; n < IOV_BATCH && sent + n < iovcnt; ++n) {
+                        const struct iovec * v = &iov[sent + n];
+                        if (frcti_fragments(flow->frcti, v->iov_len))
+                                break;
+
+                        ret = frcti_snd_wait(flow->frcti,
+                                             !(flags & FLOWFWNOBLOCK),
+                                             abstime);
+                        if (ret < 0)
+                                break;
+
+                        if (flags & FLOWFWNOBLOCK)
+                                idx[n] = shm_rdrbuff_write(ai.rdrb,
+                                                           DU_BUFF_HEADSPACE,
+                                                           DU_BUFF_TAILSPACE,
+                                                           v->iov_base,
+                                                           v->iov_len);
+                        else  /* Blocking. */
+                                idx[n] = shm_rdrbuff_write_b(ai.rdrb,
+                                                             DU_BUFF_HEADSPACE,
+                                                             DU_BUFF_TAILSPACE,
+                                                             v->iov_base,
+                                                             v->iov_len,
+                                                             abstime);
+                        if (idx[n] < 0) {
+                                ret = idx[n];
+                                break;
+                        }
+
+                        sdb = shm_rdrbuff_get(ai.rdrb, idx[n]);
+
+                        if (frcti_snd(flow->frcti, sdb) < 0) {
+                                shm_rdrbuff_remove(ai.rdrb, idx[n]);
+                                ret = -ENOMEM;
+                                break;
+                        }
+
+                        if (flow->spec.ber == 0 && add_crc(sdb) != 0) {
+                                shm_rdrbuff_remove(ai.rdrb, idx[n]);
+                                ret = -ENOMEM;
+                                break;
+                        }
+                }
+
+                /* Send an SDU that needs fragments on its own. */
+                if (n == 0 && ret == 0) {
+                        ret = flow_write_frags(flow, iov[sent].iov_base,
+                                               iov[sent].iov_len, flags,
+                                               abstime);
+                        if (ret == 0)
+                                ++sent;
+                        continue;
+                }
+
+                if (n == 0)
+                        break;
+
+                pthread_rwlock_rdlock(&ai.lock);
+
+                for (i = 0; i < n; ++i) {
+                        err = shm_rbuff_write(flow->tx_rb, idx[i]);
+                        if (err < 0)
+                                break;
+                }
+
+                if (i > 0)
+                        shm_flow_set_notify_n(flow->set, flow->flow_id,
+                                              FLOW_PKT, i);
+
+                pthread_rwlock_unlock(&ai.lock);
+
+                sent += i;
+
+                if (i < n) {
+                        while (i < n)
+                                shm_rdrbuff_remove(ai.rdrb, idx[i++]);
+                        ret = err;
+                }
+        }
+
+        return sent > 0 ? sent : ret;
 }
 
 ssize_t flow_read(int    fd,
@@ -934,9 +1358,7 @@ ssize_t flow_read(int    fd,
 {
         ssize_t              idx;
         ssize_t              n;
-        uint8_t *            packet;
         struct shm_rbuff *   rb;
-        struct shm_du_buff * sdb;
         struct timespec      abs;
         struct timespec *    abstime = NULL;
         struct flow *        flow;
@@ -975,42 +1397,283 @@ ssize_t flow_read(int    fd,
 
         idx = flow->part_idx;
         if (idx < 0) {
-                idx = frcti_queued_pdu(flow->frcti);
-                if (idx < 0) {
-                        do {
-                                idx = noblock ? shm_rbuff_read(rb) :
-                                        shm_rbuff_read_b(rb, abstime);
-                                if (idx < 0)
-                                        return idx;
-                                sdb = shm_rdrbuff_get(ai.rdrb, idx);
-                                if (flow->spec.ber == 0  && chk_crc(sdb) != 0)
-                                        continue;
-                        } while (frcti_rcv(flow->frcti, sdb) != 0);
-                }
+                idx = flow_rx_sdu(flow, rb, noblock, abstime);
+                if (idx < 0)
+                        return idx;
         }
 
-        n = shm_rdrbuff_read(&packet, ai.rdrb, idx);
+        n = flow_rx_copy(flow, idx, buf, count, partrd);
+        if (n == (ssize_t) count && partrd && flow->part_idx == NO_PART)
+                flow->part_idx = DONE_PART;
 
-        assert(n >= 0);
+        return n;
+}
 
-        if (n <= (ssize_t) count) {
-                memcpy(buf, packet, n);
-                shm_rdrbuff_remove(ai.rdrb, idx);
-                flow->part_idx = (partrd && n == (ssize_t) count) ?
-                        DONE_PART : NO_PART;
-                return n;
-        } else {
-                if (partrd) {
-                        memcpy(buf, packet, count);
-                        sdb = shm_rdrbuff_get(ai.rdrb, idx);
-                        shm_du_buff_head_release(sdb, n);
-                        flow->part_idx = idx;
-                        return count;
-                } else {
-                        shm_rdrbuff_remove(ai.rdrb, idx);
-                        return -EMSGSIZE;
-                }
+ssize_t flow_readv(int            fd,
+                   struct iovec * iov,
+                   int            iovcnt)
+{
+        ssize_t              idx;
+        ssize_t              n;
+        struct shm_rbuff *   rb;
+        struct timespec      abs;
+        struct timespec *    abstime = NULL;
+        struct flow *        flow;
+        bool                 noblock;
+        bool                 partrd;
+        int                  i;
+
+        if (iov == NULL || iovcnt <= 0)
+                return 0;
+
+        if (fd < 0 || fd > PROG_MAX_FLOWS)
+                return -EBADF;
+
+        flow = &ai.flows[fd];
+
+        /* Finish a partially read SDU before starting a batch. */
+        if (flow->part_idx != NO_PART) {
+                n = flow_read(fd, iov[0].iov_base, iov[0].iov_len);
+                if (n < 0)
+                        return n;
+                iov[0].iov_len = n;
+                return 1;
+        }
+
+        clock_gettime(PTHREAD_COND_CLOCK, &abs);
+
+        pthread_rwlock_rdlock(&ai.lock);
+
+        if (flow->flow_id < 0) {
+                pthread_rwlock_unlock(&ai.lock);
+                return -ENOTALLOC;
+        }
+
+        rb   = flow->rx_rb;
+        noblock = flow->oflags & FLOWFRNOBLOCK;
+        partrd = !(flow->oflags & FLOWFRNOPART);
+
+        if (ai.flows[fd].rcv_timesout) {
+                ts_add(&abs, &flow->rcv_timeo, &abs);
+                abstime = &abs;
+        }
+
+        pthread_rwlock_unlock(&ai.lock);
+
+        for (i = 0; i < iovcnt; ++i) {
+                /* Only the first SDU waits, return what is queued. */
+                idx = flow_rx_sdu(flow, rb, noblock || i > 0, abstime);
+                if (idx < 0)
+                        return i > 0 ? i : idx;
+
+                n = flow_rx_copy(flow, idx, iov[i].iov_base,
+                                 iov[i].iov_len, partrd);
+                if (n < 0)
+                        return i > 0 ? i : n;
+
+                iov[i].iov_len = n;
+
+                if (flow->part_idx != NO_PART)
+                        return i + 1;
+        }
+
+        return i;
+}
+
+/* Zero-copy functions. */
+
+ssize_t flow_sdu_reserve(int     fd,
+                         void ** buf,
+                         size_t  count)
+{
+        struct flow *        flow;
+        ssize_t              idx;
+        int                  ret;
+        int                  flags;
+        struct timespec      abs;
+        struct timespec *    abstime = NULL;
+        struct shm_du_buff * sdb;
+
+        if (buf == NULL)
+                return -EINVAL;
+
+        if (fd < 0 || fd > PROG_MAX_FLOWS)
+                return -EBADF;
+
+        flow = &ai.flows[fd];
+
+        clock_gettime(PTHREAD_COND_CLOCK, &abs);
+
+        pthread_rwlock_rdlock(&ai.lock);
+
+        if (flow->flow_id < 0) {
+                pthread_rwlock_unlock(&ai.lock);
+                return -ENOTALLOC;
+        }
+
+        if (ai.flows[fd].snd_timesout) {
+                ts_add(&abs, &flow->snd_timeo, &abs);
+                abstime = &abs;
+        }
+
+        flags = flow->oflags;
+
+        pthread_rwlock_unlock(&ai.lock);
+
+        if ((flags & FLOWFACCMODE) == FLOWFRDONLY)
+                return -EPERM;
+
+        /* A reserved SDU is sent as a single PDU. */
+        if (frcti_fragments(flow->frcti, count))
+                return -EMSGSIZE;
+
+        ret = frcti_snd_wait(flow->frcti, !(flags & FLOWFWNOBLOCK), abstime);
+        if (ret < 0)
+                return ret;
+
+        if (flags & FLOWFWNOBLOCK)
+                idx = shm_rdrbuff_write(ai.rdrb,
+                                        DU_BUFF_HEADSPACE,
+                                        DU_BUFF_TAILSPACE,
+                                        NULL,
+                                        count);
+        else  /* Blocking. */
+                idx = shm_rdrbuff_write_b(ai.rdrb,
+                                          DU_BUFF_HEADSPACE,
+                                          DU_BUFF_TAILSPACE,
+                                          NULL,
+                                          count,
+                                          abstime);
+        if (idx < 0)
+                return idx;
+
+        sdb  = shm_rdrbuff_get(ai.rdrb, idx);
+        *buf = shm_du_buff_head(sdb);
+
+        return idx;
+}
+
+int flow_sdu_commit(int     fd,
+                    ssize_t sdu,
+                    size_t  count)
+{
+        struct flow *        flow;
+        struct shm_du_buff * sdb;
+
+        int                  ret;
+
+        if (sdu < 0 || sdu >= SHM_RDRB_BLOCKS)
+                return -EINVAL;
+
+        sdb = shm_rdrbuff_get(ai.rdrb, sdu);
+
+        if (fd < 0 || fd > PROG_MAX_FLOWS) {
+                ret = -EBADF;
+                goto fail;
+        }
+
+        flow = &ai.flows[fd];
+
+        /* Can only shrink, the tailspace is needed for the CRC. */
+        if (count > (size_t) (shm_du_buff_tail(sdb) - shm_du_buff_head(sdb))) {
+                ret = -EMSGSIZE;
+                goto fail;
+        }
+
+        pthread_rwlock_rdlock(&ai.lock);
+
+        if (flow->flow_id < 0) {
+                pthread_rwlock_unlock(&ai.lock);
+                ret = -ENOTALLOC;
+                goto fail;
+        }
+
+        pthread_rwlock_unlock(&ai.lock);
+
+        shm_du_buff_truncate(sdb, count);
+
+        return flow_tx_sdu(flow, sdu, false, false);
+
+ fail:
+        shm_rdrbuff_remove(ai.rdrb, sdu);
+        return ret;
+}
+
+ssize_t flow_sdu_read(int           fd,
+                      const void ** buf,
+                      size_t *      count)
+{
+        ssize_t            idx;
+        ssize_t            n;
+        uint8_t *          packet;
+        struct shm_rbuff * rb;
+        struct timespec    abs;
+        struct timespec *  abstime = NULL;
+        struct flow *      flow;
+        bool               noblock;
+
+        if (buf == NULL || count == NULL)
+                return -EINVAL;
+
+        if (fd < 0 || fd > PROG_MAX_FLOWS)
+                return -EBADF;
+
+        flow = &ai.flows[fd];
+
+        clock_gettime(PTHREAD_COND_CLOCK, &abs);
+
+        pthread_rwlock_rdlock(&ai.lock);
+
+        if (flow->flow_id < 0) {
+                pthread_rwlock_unlock(&ai.lock);
+                return -ENOTALLOC;
+        }
+
+        rb      = flow->rx_rb;
+        noblock = flow->oflags & FLOWFRNOBLOCK;
+
+        if (ai.flows[fd].rcv_timesout) {
+                ts_add(&abs, &flow->rcv_timeo, &abs);
+                abstime = &abs;
         }
+
+        pthread_rwlock_unlock(&ai.lock);
+
+        /* Hand out what is left of a partially read SDU. */
+        idx = flow->part_idx;
+        flow->part_idx = NO_PART;
+        if (idx < 0)
+                idx = frcti_frag_next(flow->frcti);
+        if (idx < 0) {
+                idx = flow_rx_sdu(flow, rb, noblock, abstime);
+                if (idx < 0)
+                        return idx;
+        }
+
+        /* Leave a fragmented SDU for flow_read. */
+        if (frcti_frag_more(flow->frcti)) {
+                flow->part_idx = idx;
+                return -EMSGSIZE;
+        }
+
+        n = shm_rdrbuff_read(&packet, ai.rdrb, idx);
+
+        assert(n >= 0);
+
+        *buf   = packet;
+        *count = n;
+
+        return idx;
+}
+
+int flow_sdu_release(ssize_t sdu)
+{
+        if (sdu < 0 || sdu >= SHM_RDRB_BLOCKS)
+                return -EINVAL;
+
+        shm_rdrbuff_remove(ai.rdrb, sdu);
+
+        return 0;
 }
 
 /* fqueue functions. */
@@ -1025,6 +1688,10 @@ struct flow_set * fset_create()
 
         pthread_rwlock_wrlock(&ai.lock);
 
+        set->busy = false;
+        set->spin.tv_sec  = 0;
+        set->spin.tv_nsec = 0;
+
         set->idx = bmp_allocate(ai.fqueues);
         if (!bmp_is_id_valid(ai.fqueues, set->idx)) {
                 pthread_rwlock_unlock(&ai.lock);
@@ -1174,9 +1841,11 @@ int fevent(struct flow_set *       set,
            struct fqueue *         fq,
            const struct timespec * timeo)
 {
-        ssize_t           ret;
-        struct timespec   abstime;
-        struct timespec * t = NULL;
+        ssize_t                 ret;
+        struct timespec         abstime;
+        struct timespec *       t = NULL;
+        const struct timespec * dl;
+        struct timespec         ts;
 
         if (set == NULL || fq == NULL)
                 return -EINVAL;
@@ -1190,6 +1859,13 @@ int fevent(struct flow_set *       set,
                 t = &abstime;
         }
 
+        if (spins(set->busy, &set->spin)) {
+                dl = spin_deadline(set->busy, &set->spin, t, &ts);
+                while (!shm_flow_set_pending(ai.fqset, set->idx) &&
+                       spin_continue(dl))
+                        ;
+        }
+
         ret = shm_flow_set_wait(ai.fqset, set->idx, fq->fqueue, t);
         if (ret == -ETIMEDOUT) {
                 fq->fqsize = 0;
@@ -1204,6 +1880,22 @@ int fevent(struct flow_set *       set,
         return ret;
 }
 
+int fset_spin(struct flow_set *       set,
+              const struct timespec * spin)
+{
+        if (set == NULL)
+                return -EINVAL;
+
+        if (spin == NULL) {
+                set->busy = true;
+        } else {
+                set->busy = false;
+                set->spin = *spin;
+        }
+
+        return 0;
+}
+
 /* ipcp-dev functions. */
 
 int np1_flow_alloc(pid_t     n_pid,
@@ -1439,6 +2131,94 @@ int ipcp_flow_write(int                  fd,
         return ret;
 }
 
+int ipcp_flow_read_batch(int                   fd,
+                         struct shm_du_buff ** sdb,
+                         size_t                n)
+{
+        struct flow *      flow;
+        struct shm_rbuff * rb;
+        ssize_t            idx;
+        size_t             i;
+
+        assert(fd >= 0 && fd < SYS_MAX_FLOWS);
+        assert(sdb);
+
+        flow = &ai.flows[fd];
+
+        pthread_rwlock_rdlock(&ai.lock);
+
+        assert(flow->flow_id >= 0);
+
+        rb = flow->rx_rb;
+
+        pthread_rwlock_unlock(&ai.lock);
+
+        for (i = 0; i < n; ++i) {
+                idx = flow_rx_sdu(flow, rb, true, NULL);
+                if (idx < 0)
+                        return i > 0 ? (int) i : idx;
+                sdb[i] = shm_rdrbuff_get(ai.rdrb, idx);
+        }
+
+        return i;
+}
+
+int ipcp_flow_write_batch(int                   fd,
+                          struct shm_du_buff ** sdb,
+                          size_t                n)
+{
+        struct flow * flow;
+        int           ret = 0;
+        ssize_t       idx;
+        size_t        i;
+
+        assert(fd >= 0 && fd < SYS_MAX_FLOWS);
+        assert(sdb);
+
+        flow = &ai.flows[fd];
+
+        pthread_rwlock_rdlock(&ai.lock);
+
+        if (flow->flow_id < 0) {
+                pthread_rwlock_unlock(&ai.lock);
+                return -ENOTALLOC;
+        }
+
+        if ((flow->oflags & FLOWFACCMODE) == FLOWFRDONLY) {
+                pthread_rwlock_unlock(&ai.lock);
+                return -EPERM;
+        }
+
+        assert(flow->tx_rb);
+
+        for (i = 0; i < n; ++i) {
+                idx = shm_du_buff_get_idx(sdb[i]);
+
+                if (frcti_snd(flow->frcti, sdb[i]) < 0) {
+                        ret = -ENOMEM;
+                        break;
+                }
+
+                if (flow->spec.ber == 0 && add_crc(sdb[i]) != 0) {
+                        ret = -ENOMEM;
+                        break;
+                }
+
+                ret = shm_rbuff_write(flow->tx_rb, idx);
+                if (ret < 0)
+                        break;
+        }
+
+        if (i > 0)
+                shm_flow_set_notify_n(flow->set, flow->flow_id, FLOW_PKT, i);
+
+        pthread_rwlock_unlock(&ai.lock);
+
+        assert(ret <= 0);
+
+        return i > 0 ? (int) i : ret;
+}
+
 int ipcp_sdb_reserve(struct shm_du_buff ** sdb,
                      size_t                len)
 {
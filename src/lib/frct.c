@@ -25,13 +25,27 @@
 #define DELT_A         0     /* ms */
 #define DELT_R         2000  /* ms */
 
-#define RQ_SIZE        64
+#define RQ_MIN         64        /* PDUs, multiple of 64 */
+#define RQ_DEF         (1 << 10) /* PDUs, bandwidth or delay unknown */
+#define RQ_MAX         ((SHM_BUFFER_SIZE) / 4) /* PDUs, rx rbuff room */
+
+#define RTO_INIT       120   /* ms */
+#define RTO_MIN        1     /* ms */
+#define RTO_MAX        DELT_R
+
+#define FRCT_DUPACKS   3     /* dup acks before fast rtx */
+#define FRCT_SACK_MAX  4     /* sack blocks per ack      */
+#define FRCT_FRAGS     16    /* initial reassembly slots */
+#define FRCT_RD_POLL   10    /* ms, writer rechecks for readers */
+#define FRCT_ACK_EVERY 2     /* in-order PDUs per ack    */
 
 #define TW_ELEMENTS    6000
 #define TW_RESOLUTION  1     /* ms */
 
 #define FRCT_PCILEN    (sizeof(struct frct_pci))
 
+#include <frct_cc.c>
+
 struct frct_cr {
         uint32_t lwe;
         uint32_t rwe;
@@ -50,13 +64,40 @@ struct frcti {
         time_t           a;
         time_t           r;
 
-        time_t           rto; /* ms */
+        time_t           srtt;   /* us */
+        time_t           rttvar; /* us */
+        time_t           rto;    /* ms */
 
         struct frct_cr   snd_cr;
         struct frct_cr   rcv_cr;
 
-        ssize_t          rq[RQ_SIZE];
+        size_t           dupacks;
+        size_t           unacked; /* in-order PDUs since the last ack */
+        uint32_t         rcvr;    /* no fast rtx before this is acked */
+
+        bool             fc;      /* peer advertised snd_cr.rwe */
+        struct frct_cc   cc;
+        pthread_mutex_t  mtx;
+        pthread_cond_t   cond;    /* snd_cr.rwe moved */
+        pthread_mutex_t  rd_mtx;  /* held by a writer reading acks */
+        size_t           readers; /* blocked in flow_rx_sdu, atomic */
+
+        ssize_t *        rq;      /* reorder queue, also the window */
+        uint64_t *       rq_map;  /* occupied slots */
+        uint64_t *       rq_more; /* FRCT_MFGM */
+        size_t           rq_size; /* power of 2 */
         pthread_rwlock_t lock;
+
+        ssize_t *        frags;   /* SDU under reassembly */
+        size_t           nfrags;
+        size_t           fcap;
+        size_t           fcur;    /* next fragment to hand out */
+        bool             fdone;   /* got the last fragment */
+        bool             fdrop;   /* dropping the rest of an SDU */
+
+        struct list_head rxms;      /* in the rxmwheel */
+        struct list_head rxm_free;
+        struct list_head rxm_slabs;
 };
 
 enum frct_flags {
@@ -66,6 +107,8 @@ enum frct_flags {
         FRCT_FC   = 0x08, /* FC window valid  */
         FRCT_RDVZ = 0x10, /* Rendez-vous      */
         FRCT_MFGM = 0x20, /* More fragments   */
+        FRCT_SACK = 0x40, /* SACK blocks      */
+        FRCT_DLY  = 0x80, /* Delayed ACK      */
 };
 
 struct frct_pci {
@@ -77,14 +120,104 @@ struct frct_pci {
         uint32_t ackno;
 } __attribute__((packed));
 
+/* Follow the PCI of a pure ACK, the blocks fill the PDU. */
+struct frct_sack {
+        uint32_t start;
+        uint32_t end;     /* first seqno not in the block */
+} __attribute__((packed));
+
+#define RQ_BIT(pos)          ((uint64_t) 1 << ((pos) & 63))
+#define rq_pos(frcti, sn)    ((sn) & ((frcti)->rq_size - 1))
+#define rq_has(frcti, pos)   ((frcti)->rq_map[(pos) >> 6] & RQ_BIT(pos))
+#define rq_more(frcti, pos)  ((frcti)->rq_more[(pos) >> 6] & RQ_BIT(pos))
+
 #include <rxmwheel.c>
 
+/*
+ * Cover the bandwidth-delay product of the qosspec in FRCT PDUs. The
+ * window never promises more than a quarter of the packet buffer.
+ */
+static size_t rq_size(const qosspec_t * qs)
+{
+        double pdus;
+        size_t size = RQ_MIN;
+
+        if (qs->bandwidth == 0 || qs->bandwidth == UINT64_MAX
+            || qs->delay == 0 || qs->delay == UINT32_MAX)
+                return MIN(RQ_DEF, RQ_MAX);
+
+        /* Allow twice the delay bound for the acks to return. */
+        pdus = (double) qs->bandwidth / 8 * qs->delay * 2 / 1000
+                / FRCT_FRAG_SIZE;
+
+        while (size < RQ_MAX && size < pdus)
+                size <<= 1;
+
+        return size;
+}
+
+static void rq_put(struct frcti * frcti,
+                   size_t         pos,
+                   ssize_t        idx,
+                   bool           more)
+{
+        frcti->rq[pos] = idx;
+        frcti->rq_map[pos >> 6] |= RQ_BIT(pos);
+        if (more)
+                frcti->rq_more[pos >> 6] |= RQ_BIT(pos);
+        else
+                frcti->rq_more[pos >> 6] &= ~RQ_BIT(pos);
+}
+
+static ssize_t rq_take(struct frcti * frcti,
+                       size_t         pos)
+{
+        frcti->rq_map[pos >> 6] &= ~RQ_BIT(pos);
+
+        return frcti->rq[pos];
+}
+
+/*
+ * First seqno in [sn, end) with a slot that is occupied (or free),
+ * end if there is none. Scans a word of the map at a time.
+ */
+static uint32_t rq_find(struct frcti * frcti,
+                        uint32_t       sn,
+                        uint32_t       end,
+                        bool           used)
+{
+        while (sn != end) {
+                size_t   pos  = rq_pos(frcti, sn);
+                size_t   off  = pos & 63;
+                uint32_t left = end - sn;
+                uint64_t w;
+
+                w = frcti->rq_map[pos >> 6];
+                if (!used)
+                        w = ~w;
+
+                w >>= off;
+                if (w != 0) {
+                        uint32_t d = __builtin_ctzll(w);
+                        return d < left ? sn + d : end;
+                }
+
+                if (64 - off >= left)
+                        return end;
+
+                sn += 64 - off;
+        }
+
+        return end;
+}
+
 static struct frcti * frcti_create(int fd)
 {
-        struct frcti *  frcti;
-        time_t          delta_t;
-        ssize_t         idx;
-        struct timespec now;
+        struct frcti *     frcti;
+        time_t             delta_t;
+        size_t             words;
+        struct timespec    now;
+        pthread_condattr_t cattr;
 
         frcti = malloc(sizeof(*frcti));
         if (frcti == NULL)
@@ -92,11 +225,43 @@ static struct frcti * frcti_create(int fd)
 
         memset(frcti, 0, sizeof(*frcti));
 
+        /* Only reliable flows reorder. */
+        if (ai.flows[fd].spec.loss == 0) {
+                frcti->rq_size = rq_size(&ai.flows[fd].spec);
+                words          = frcti->rq_size >> 6;
+
+                frcti->rq = malloc(frcti->rq_size * sizeof(*frcti->rq));
+                if (frcti->rq == NULL)
+                        goto fail_rq;
+
+                frcti->rq_map = calloc(2 * words, sizeof(*frcti->rq_map));
+                if (frcti->rq_map == NULL)
+                        goto fail_rq_map;
+
+                frcti->rq_more = frcti->rq_map + words;
+        }
+
         if (pthread_rwlock_init(&frcti->lock, NULL))
                 goto fail_lock;
 
-        for (idx = 0; idx < RQ_SIZE; ++idx)
-                frcti->rq[idx] = -1;
+        if (pthread_mutex_init(&frcti->mtx, NULL))
+                goto fail_mtx;
+
+        if (pthread_mutex_init(&frcti->rd_mtx, NULL))
+                goto fail_rd_mtx;
+
+        if (pthread_condattr_init(&cattr))
+                goto fail_cattr;
+
+#ifndef __APPLE__
+        pthread_condattr_setclock(&cattr, PTHREAD_COND_CLOCK);
+#endif
+        if (pthread_cond_init(&frcti->cond, &cattr))
+                goto fail_cond;
+
+        pthread_condattr_destroy(&cattr);
+
+        rxmwheel_flow_init(frcti);
 
         clock_gettime(CLOCK_REALTIME_COARSE, &now);
 
@@ -109,12 +274,16 @@ static struct frcti * frcti_create(int fd)
 
         frcti->snd_cr.inact  = 3 * delta_t;
         frcti->snd_cr.act    = now.tv_sec - (frcti->snd_cr.inact + 1);
-        /* Initial rto. FIXME: recalc using Karn algorithm. */
-        frcti->rto           = 120;
+        /* Initial rto, updated from rtt samples in frcti_rtt. */
+        frcti->rto           = RTO_INIT;
 
+        /* Flow control needs the acks of a reliable flow. */
         if (ai.flows[fd].spec.loss == 0) {
-                frcti->snd_cr.cflags |= FRCTFRTX;
-                frcti->rcv_cr.cflags |= FRCTFRTX;
+                frcti->snd_cr.cflags |= FRCTFRTX | FRCTFRESCNTRL;
+                frcti->rcv_cr.cflags |= FRCTFRTX | FRCTFRESCNTRL;
+                frct_cc_init(&frcti->cc, FRCTCCAIMD);
+        } else {
+                frct_cc_init(&frcti->cc, FRCTCCNONE);
         }
 
         frcti->rcv_cr.inact  = 2 * delta_t;
@@ -122,21 +291,58 @@ static struct frcti * frcti_create(int fd)
 
         return frcti;
 
+ fail_cond:
+        pthread_condattr_destroy(&cattr);
+ fail_cattr:
+        pthread_mutex_destroy(&frcti->rd_mtx);
+ fail_rd_mtx:
+        pthread_mutex_destroy(&frcti->mtx);
+ fail_mtx:
+        pthread_rwlock_destroy(&frcti->lock);
  fail_lock:
+        free(frcti->rq_map);
+ fail_rq_map:
+        free(frcti->rq);
+ fail_rq:
         free(frcti);
  fail_malloc:
         return NULL;
 }
 
+static void frcti_frag_drop(struct frcti * frcti)
+{
+        while (frcti->fcur < frcti->nfrags)
+                shm_rdrbuff_remove(ai.rdrb, frcti->frags[frcti->fcur++]);
+
+        frcti->nfrags = 0;
+        frcti->fcur   = 0;
+        frcti->fdone  = false;
+}
+
 static void frcti_destroy(struct frcti * frcti)
 {
+        size_t pos;
+
         /*
          * FIXME: In case of reliable transmission we should
          * make sure everything we sent is acked.
          */
 
-        rxmwheel_clear(frcti->fd);
+        rxmwheel_clear(frcti);
 
+        frcti_frag_drop(frcti);
+        free(frcti->frags);
+
+        for (pos = 0; pos < frcti->rq_size; ++pos)
+                if (rq_has(frcti, pos))
+                        shm_rdrbuff_remove(ai.rdrb, rq_take(frcti, pos));
+
+        free(frcti->rq_map);
+        free(frcti->rq);
+
+        pthread_cond_destroy(&frcti->cond);
+        pthread_mutex_destroy(&frcti->rd_mtx);
+        pthread_mutex_destroy(&frcti->mtx);
         pthread_rwlock_destroy(&frcti->lock);
 
         free(frcti);
@@ -157,50 +363,531 @@ static uint16_t frcti_getconf(struct frcti * frcti)
         return ret;
 }
 
+static int frcti_setcc(struct frcti * frcti,
+                       int            algo)
+{
+        int ret;
+
+        assert(frcti);
+
+        pthread_rwlock_wrlock(&frcti->lock);
+
+        ret = frct_cc_init(&frcti->cc, algo);
+
+        pthread_rwlock_unlock(&frcti->lock);
+
+        return ret;
+}
+
+static int frcti_getcc(struct frcti * frcti)
+{
+        int ret;
+
+        assert(frcti);
+
+        pthread_rwlock_rdlock(&frcti->lock);
+
+        ret = frcti->cc.algo;
+
+        pthread_rwlock_unlock(&frcti->lock);
+
+        return ret;
+}
+
+static void frcti_getrtt(struct frcti *    frcti,
+                         int               cmd,
+                         struct timespec * ts)
+{
+        time_t us;
+
+        assert(frcti);
+        assert(ts);
+
+        pthread_rwlock_rdlock(&frcti->lock);
+
+        switch (cmd) {
+        case FRCTGSRTT:
+                us = frcti->srtt;
+                break;
+        case FRCTGRTTVAR:
+                us = frcti->rttvar;
+                break;
+        default:
+                us = frcti->rto * 1000;
+                break;
+        }
+
+        pthread_rwlock_unlock(&frcti->lock);
+
+        ts->tv_sec  = us / MILLION;
+        ts->tv_nsec = (us % MILLION) * 1000;
+}
+
+/* RFC 6298, rtt in us, flow lock held. */
+static void frcti_rtt(struct frcti * frcti,
+                      time_t         rtt)
+{
+        time_t rto;
+
+        if (frcti->srtt == 0) {
+                frcti->srtt   = rtt;
+                frcti->rttvar = rtt >> 1;
+        } else {
+                time_t d = frcti->srtt - rtt;
+                if (d < 0)
+                        d = -d;
+                frcti->rttvar = (3 * frcti->rttvar + d) >> 2;
+                frcti->srtt   = (7 * frcti->srtt + rtt) >> 3;
+        }
+
+        rto = frcti->srtt + MAX(RTO_MIN * 1000, frcti->rttvar << 2);
+        rto = (rto + 999) / 1000;
+
+        frcti->rto = MIN(MAX(rto, RTO_MIN), RTO_MAX);
+}
+
 #define frcti_queued_pdu(frcti) \
         (frcti == NULL ? -1 : __frcti_queued_pdu(frcti))
 
+#define frcti_snd_wait(frcti, block, abstime) \
+        (frcti == NULL ? 0 : __frcti_snd_wait(frcti, block, abstime))
+
 #define frcti_snd(frcti, sdb) \
-        (frcti == NULL ? 0 : __frcti_snd(frcti, sdb))
+        (frcti == NULL ? 0 : __frcti_snd(frcti, sdb, false))
+
+#define frcti_snd_frag(frcti, sdb, more) \
+        (frcti == NULL ? 0 : __frcti_snd(frcti, sdb, more))
+
+#define frcti_frag_next(frcti) \
+        (frcti == NULL ? -1 : __frcti_frag_next(frcti))
+
+#define frcti_frag_more(frcti) \
+        (frcti == NULL ? false : __frcti_frag_more(frcti))
+
+/* Reliable flows split SDUs larger than FRCT_FRAG_SIZE. */
+#define frcti_fragments(frcti, count) \
+        (frcti != NULL && frcti->snd_cr.cflags & FRCTFRTX \
+         && (count) > FRCT_FRAG_SIZE)
 
 #define frcti_rcv(frcti, sdb) \
-        (frcti == NULL ? 0 : __frcti_rcv(frcti, sdb))
+        (frcti == NULL ? 0 : __frcti_rcv(frcti, sdb, false))
+
+static int __frcti_rcv(struct frcti *       frcti,
+                       struct shm_du_buff * sdb,
+                       bool                 queue);
+
+static struct frct_pci * frcti_alloc_head(struct shm_du_buff * sdb)
+{
+        struct frct_pci * pci;
+
+        pci = (struct frct_pci *) shm_du_buff_head_alloc(sdb, FRCT_PCILEN);
+        if (pci != NULL)
+                memset(pci, 0, sizeof(*pci));
+
+        return pci;
+}
+
+/*
+ * Fill in the cumulative ack, the window and the sack blocks from the
+ * rq. The window is counted from the next PDU for the application.
+ */
+static size_t frcti_sack(struct frcti *     frcti,
+                         uint32_t *         ackno,
+                         uint16_t *         wnd,
+                         struct frct_sack * sack)
+{
+        uint32_t seqno;
+        uint32_t end;
+        size_t   n = 0;
+
+        seqno = frcti->rcv_cr.seqno;
+        end   = seqno + frcti->rq_size;
+
+        /* Packets that are queued in order are acked cumulatively. */
+        seqno = rq_find(frcti, seqno, end, false);
+
+        *ackno = seqno;
+
+        frcti->rcv_cr.rwe = end;
+        *wnd = frcti->rcv_cr.rwe - seqno;
+
+        frcti->unacked = 0;
+
+        while (n < FRCT_SACK_MAX) {
+                seqno = rq_find(frcti, seqno, end, true);
+                if (seqno == end)
+                        break;
+
+                sack[n].start = hton32(seqno);
+                seqno = rq_find(frcti, seqno, end, false);
+                sack[n++].end = hton32(seqno);
+        }
+
+        return n;
+}
+
+/*
+ * Send a pure ACK, the sack blocks are its payload. An ACK that was
+ * delayed until the application read is no good for an rtt sample.
+ */
+static void frcti_snd_ack(struct frcti *           frcti,
+                          uint32_t                 ackno,
+                          uint16_t                 wnd,
+                          const struct frct_sack * sack,
+                          size_t                   n,
+                          bool                     dly)
+{
+        struct shm_du_buff * sdb;
+        struct frct_pci *    pci;
+        struct flow *        f;
+        ssize_t              idx;
+
+        idx = shm_rdrbuff_write(ai.rdrb,
+                                DU_BUFF_HEADSPACE,
+                                DU_BUFF_TAILSPACE,
+                                (const uint8_t *) sack,
+                                n * sizeof(*sack));
+        if (idx < 0)
+                return;
+
+        sdb = shm_rdrbuff_get(ai.rdrb, idx);
+
+        pci = frcti_alloc_head(sdb);
+        if (pci == NULL)
+                goto fail;
+
+        pci->flags = FRCT_ACK;
+        if (n > 0)
+                pci->flags |= FRCT_SACK;
+        if (dly)
+                pci->flags |= FRCT_DLY;
+
+        if (frcti->rcv_cr.cflags & FRCTFRESCNTRL) {
+                pci->flags |= FRCT_FC;
+                pci->window = hton16(wnd);
+        }
+
+        pci->ackno = hton32(ackno);
+
+        f = &ai.flows[frcti->fd];
+
+        if (f->spec.ber == 0 && add_crc(sdb) != 0)
+                goto fail;
+
+        if (shm_rbuff_write(f->tx_rb, idx))
+                goto fail;
+
+        shm_flow_set_notify(f->set, f->flow_id, FLOW_PKT);
+
+        return;
+ fail:
+        shm_rdrbuff_remove(ai.rdrb, idx);
+}
+
+/* Update the peer when the application opened half a window. */
+#define frcti_wnd_upd(frcti)                                            \
+        ((frcti)->rcv_cr.cflags & FRCTFRESCNTRL                         \
+         && (int32_t) ((frcti)->rcv_cr.seqno + (frcti)->rq_size         \
+                       - (frcti)->rcv_cr.rwe) >= (int32_t) (frcti)->rq_size / 2)
+
+/*
+ * Ack every other in-order PDU, or right away if no PDU follows it.
+ * Only counts on reliable flows, the others are not acked.
+ */
+#define frcti_ack_due(frcti)                                            \
+        ((frcti)->rcv_cr.cflags & FRCTFRTX                              \
+         && (++(frcti)->unacked >= FRCT_ACK_EVERY                       \
+             || shm_rbuff_queued(ai.flows[(frcti)->fd].rx_rb) == 0))
+
+/*
+ * Collect an in-order fragment, lock held. Returns the first fragment
+ * once the SDU is complete, the rest follow from frcti_frag_next.
+ */
+static ssize_t frcti_frag(struct frcti * frcti,
+                          ssize_t        idx,
+                          bool           more)
+{
+        ssize_t * frags;
+        size_t    cap;
+
+        if (frcti->fdrop) {
+                frcti->fdrop = more;
+                shm_rdrbuff_remove(ai.rdrb, idx);
+                return -EAGAIN;
+        }
+
+        if (frcti->nfrags == frcti->fcap) {
+                cap   = frcti->fcap == 0 ? FRCT_FRAGS : frcti->fcap << 1;
+                frags = realloc(frcti->frags, cap * sizeof(*frags));
+                if (frags == NULL) {
+                        frcti_frag_drop(frcti);
+                        frcti->fdrop = more;
+                        shm_rdrbuff_remove(ai.rdrb, idx);
+                        return -EAGAIN;
+                }
+                frcti->frags = frags;
+                frcti->fcap  = cap;
+        }
+
+        frcti->frags[frcti->nfrags++] = idx;
+
+        if (more)
+                return -EAGAIN;
+
+        frcti->fdone = true;
+
+        return frcti->frags[0];
+}
+
+static ssize_t __frcti_frag_next(struct frcti * frcti)
+{
+        ssize_t idx = -1;
+
+        pthread_rwlock_wrlock(&frcti->lock);
+
+        if (frcti->fdone) {
+                if (frcti->fcur < frcti->nfrags)
+                        idx = frcti->frags[frcti->fcur++];
+                else
+                        frcti_frag_drop(frcti);
+        }
+
+        pthread_rwlock_unlock(&frcti->lock);
+
+        return idx;
+}
+
+/* Are fragments of the SDU that is handed out left? */
+static bool __frcti_frag_more(struct frcti * frcti)
+{
+        bool ret;
+
+        pthread_rwlock_rdlock(&frcti->lock);
+
+        ret = frcti->fdone && frcti->fcur < frcti->nfrags;
+
+        pthread_rwlock_unlock(&frcti->lock);
+
+        return ret;
+}
 
 static ssize_t __frcti_queued_pdu(struct frcti * frcti)
 {
-        ssize_t idx;
-        size_t  pos;
+        ssize_t          idx = -1;
+        size_t           pos;
+        uint32_t         ackno;
+        uint16_t         wnd;
+        struct frct_sack sack[FRCT_SACK_MAX];
+        size_t           n   = 0;
+        bool             upd = false;
 
         assert(frcti);
 
         /* See if we already have the next PDU. */
         pthread_rwlock_wrlock(&frcti->lock);
 
-        pos = frcti->rcv_cr.seqno & (RQ_SIZE - 1);
-        idx = frcti->rq[pos];
-        if (idx != -1) {
+        if (frcti->fdone && frcti->fcur == 0) {
+                /* Reassembled in __frcti_rcv. */
+                frcti->fcur = 1;
+                idx = frcti->frags[0];
+        }
+
+        /* Nothing passes an SDU that is being handed out. */
+        while (idx == -1 && !frcti->fdone && frcti->rq != NULL) {
+                pos = rq_pos(frcti, frcti->rcv_cr.seqno);
+                if (!rq_has(frcti, pos))
+                        break;
+
+                idx = rq_take(frcti, pos);
                 ++frcti->rcv_cr.seqno;
-                frcti->rq[pos] = -1;
+                upd = upd || frcti_wnd_upd(frcti);
+
+                if (rq_more(frcti, pos) || frcti->nfrags > 0 || frcti->fdrop) {
+                        idx = frcti_frag(frcti, idx, rq_more(frcti, pos));
+                        if (idx >= 0)
+                                frcti->fcur = 1;
+                        else
+                                idx = -1;
+                }
         }
 
+        if (upd)
+                n = frcti_sack(frcti, &ackno, &wnd, sack);
+
         pthread_rwlock_unlock(&frcti->lock);
 
+        if (upd)
+                frcti_snd_ack(frcti, ackno, wnd, sack, n, true);
+
         return idx;
 }
 
-static struct frct_pci * frcti_alloc_head(struct shm_du_buff * sdb)
+/*
+ * Check the peer's window and the congestion window. Until the peer
+ * advertises its window, it is assumed to be the size of our own rq.
+ */
+static bool frcti_snd_open(struct frcti * frcti)
 {
-        struct frct_pci * pci;
+        struct frct_cr * snd_cr = &frcti->snd_cr;
+        struct timespec  now;
+        bool             open   = true;
 
-        pci = (struct frct_pci *) shm_du_buff_head_alloc(sdb, FRCT_PCILEN);
-        if (pci != NULL)
-                memset(pci, 0, sizeof(*pci));
+        clock_gettime(CLOCK_REALTIME_COARSE, &now);
 
-        return pci;
+        pthread_rwlock_rdlock(&frcti->lock);
+
+        /* Otherwise the next PDU starts a new run, with fresh windows. */
+        if (now.tv_sec - snd_cr->act <= snd_cr->inact) {
+                if (snd_cr->cflags & FRCTFRESCNTRL)
+                        open = (int32_t) (snd_cr->seqno - snd_cr->rwe) < 0;
+                if (open)
+                        open = frct_cc_open(&frcti->cc,
+                                            snd_cr->seqno - snd_cr->lwe);
+        }
+
+        pthread_rwlock_unlock(&frcti->lock);
+
+        return open;
+}
+
+/*
+ * A writer that does not read has to process the acks itself, they
+ * open its windows and hold buffers until they are read. Anything
+ * that arrives is processed, data is queued in the rq for the next
+ * read. A reader that is blocked in flow_rx_sdu processes the acks,
+ * so this is skipped while there is one, returning -EBUSY. With a
+ * deadline, this waits for the first PDU.
+ */
+static int frcti_drain(struct frcti *          frcti,
+                       const struct timespec * dl)
+{
+        struct flow *        f   = &ai.flows[frcti->fd];
+        struct shm_du_buff * sdb;
+        ssize_t              idx;
+        int                  ret = 0;
+
+        if (!(frcti->rcv_cr.cflags & FRCTFRTX))
+                return 0;
+
+        if (__atomic_load_n(&frcti->readers, __ATOMIC_SEQ_CST) > 0)
+                return -EBUSY;
+
+        pthread_mutex_lock(&frcti->rd_mtx);
+
+        pthread_cleanup_push((void(*)(void *)) pthread_mutex_unlock,
+                             (void *) &frcti->rd_mtx);
+
+        /* A reader announces itself, then waits for this mutex. */
+        while (true) {
+                if (__atomic_load_n(&frcti->readers, __ATOMIC_SEQ_CST) > 0) {
+                        ret = -EBUSY;
+                        break;
+                }
+
+                if (dl != NULL)
+                        idx = shm_rbuff_read_b(f->rx_rb, dl);
+                else
+                        idx = shm_rbuff_read(f->rx_rb);
+                if (idx < 0) {
+                        if (idx != -EAGAIN && idx != -ETIMEDOUT)
+                                ret = (int) idx;
+                        break;
+                }
+
+                dl = NULL;
+
+                sdb = shm_rdrbuff_get(ai.rdrb, idx);
+                if (f->spec.ber == 0 && chk_crc(sdb) != 0)
+                        shm_rdrbuff_remove(ai.rdrb, idx);
+                else
+                        __frcti_rcv(frcti, sdb, true);
+        }
+
+        pthread_cleanup_pop(true);
+
+        return ret;
+}
+
+/* A blocking reader keeps writers from draining, see frcti_drain. */
+static void frcti_rd_enter(struct frcti * frcti)
+{
+        if (frcti == NULL || !(frcti->rcv_cr.cflags & FRCTFRTX))
+                return;
+
+        __atomic_add_fetch(&frcti->readers, 1, __ATOMIC_SEQ_CST);
+
+        /* Wait for a writer that is draining. */
+        pthread_mutex_lock(&frcti->rd_mtx);
+        pthread_mutex_unlock(&frcti->rd_mtx);
+}
+
+static void frcti_rd_exit(void * o)
+{
+        struct frcti * frcti = (struct frcti *) o;
+
+        if (frcti == NULL || !(frcti->rcv_cr.cflags & FRCTFRTX))
+                return;
+
+        __atomic_sub_fetch(&frcti->readers, 1, __ATOMIC_SEQ_CST);
+}
+
+static int __frcti_snd_wait(struct frcti *          frcti,
+                            bool                    block,
+                            const struct timespec * abstime)
+{
+        struct timespec now;
+        struct timespec dl;
+        struct timespec intv = {FRCT_RD_POLL / 1000,
+                                (FRCT_RD_POLL % 1000) * MILLION};
+        int             ret;
+
+        assert(frcti);
+
+        /* Process the acks that arrived since the last write. */
+        frcti_drain(frcti, NULL);
+
+        if (frcti_snd_open(frcti))
+                return 0;
+
+        if (!block)
+                return -EAGAIN;
+
+        while (!frcti_snd_open(frcti)) {
+                clock_gettime(PTHREAD_COND_CLOCK, &now);
+
+                if (abstime != NULL && ts_diff_ns(abstime, &now) >= 0)
+                        return -ETIMEDOUT;
+
+                /* Recheck for readers now and then. */
+                ts_add(&now, &intv, &dl);
+                if (abstime != NULL && ts_diff_ns(abstime, &dl) > 0)
+                        dl = *abstime;
+
+                ret = frcti_drain(frcti, &dl);
+                if (ret == 0)
+                        continue;
+
+                if (ret != -EBUSY)
+                        return ret;
+
+                pthread_mutex_lock(&frcti->mtx);
+
+                pthread_cleanup_push((void(*)(void *)) pthread_mutex_unlock,
+                                     (void *) &frcti->mtx);
+
+                if (!frcti_snd_open(frcti))
+                        pthread_cond_timedwait(&frcti->cond, &frcti->mtx,
+                                               &dl);
+
+                pthread_cleanup_pop(true);
+        }
+
+        return 0;
 }
 
 static int __frcti_snd(struct frcti *       frcti,
-                       struct shm_du_buff * sdb)
+                       struct shm_du_buff * sdb,
+                       bool                 more)
 {
         struct frct_pci * pci;
         struct timespec   now;
@@ -224,6 +911,9 @@ static int __frcti_snd(struct frcti *       frcti,
 
         pci->flags |= FRCT_DATA;
 
+        if (more)
+                pci->flags |= FRCT_MFGM;
+
         /* Set DRF if there are no unacknowledged packets. */
         if (snd_cr->seqno == snd_cr->lwe)
                 pci->flags |= FRCT_DRF;
@@ -238,6 +928,10 @@ static int __frcti_snd(struct frcti *       frcti,
                 random_buffer(&snd_cr->seqno, sizeof(snd_cr->seqno));
 #endif
                 frcti->snd_cr.lwe = snd_cr->seqno - 1;
+                frcti->rcvr       = frcti->snd_cr.lwe;
+                /* The window of a new run is not advertised yet. */
+                frcti->snd_cr.rwe = snd_cr->seqno + frcti->rq_size;
+                frcti->fc         = false;
         }
 
         pci->seqno = hton32(snd_cr->seqno);
@@ -249,6 +943,12 @@ static int __frcti_snd(struct frcti *       frcti,
                         pci->flags |= FRCT_ACK;
                         pci->ackno = hton32(rcv_cr->seqno);
                         rcv_cr->lwe = rcv_cr->seqno;
+                        frcti->unacked = 0;
+                        if (rcv_cr->cflags & FRCTFRESCNTRL) {
+                                rcv_cr->rwe = rcv_cr->seqno + frcti->rq_size;
+                                pci->flags |= FRCT_FC;
+                                pci->window = hton16(frcti->rq_size);
+                        }
                 }
         }
 
@@ -260,9 +960,13 @@ static int __frcti_snd(struct frcti *       frcti,
         return 0;
 }
 
-/* Returns 0 when idx contains a packet for the application. */
+/*
+ * Returns 0 when idx contains a packet for the application. With
+ * queue set, in-order data is also left in the rq.
+ */
 static int __frcti_rcv(struct frcti *       frcti,
-                       struct shm_du_buff * sdb)
+                       struct shm_du_buff * sdb,
+                       bool                 queue)
 {
         ssize_t           idx;
         struct frct_pci * pci;
@@ -270,6 +974,12 @@ static int __frcti_rcv(struct frcti *       frcti,
         struct frct_cr *  snd_cr;
         struct frct_cr *  rcv_cr;
         uint32_t          seqno;
+        uint32_t          ackno;
+        uint16_t          wnd;
+        struct frct_sack  sack[FRCT_SACK_MAX];
+        size_t            n   = 0;
+        bool              ack = false;
+        bool              upd = false;
         int               ret = 0;
 
         assert(frcti);
@@ -287,45 +997,142 @@ static int __frcti_rcv(struct frcti *       frcti,
 
         seqno = ntoh32(pci->seqno);
 
+        if (!(pci->flags & FRCT_DATA)) {
+                ret = -EAGAIN;
+                goto process_ack;
+        }
+
         /* Check if receiver inactivity is true. */
         if (now.tv_sec - rcv_cr->act > rcv_cr->inact) {
                 /* Inactive receiver, check for DRF. */
-                if (pci->flags & FRCT_DRF) /* New run. */
+                if (pci->flags & FRCT_DRF) { /* New run. */
                         rcv_cr->seqno = seqno;
-                else
+                        rcv_cr->rwe   = seqno + frcti->rq_size;
+                } else {
                         goto drop_packet;
+                }
         }
 
-        if (seqno == rcv_cr->seqno) {
+        if (seqno == rcv_cr->seqno && frcti->fdone) {
+                /* Queue behind the reassembled SDU. */
+                size_t pos = rq_pos(frcti, seqno);
+                if (rq_has(frcti, pos))
+                        goto drop_packet;
+                rq_put(frcti, pos, idx, pci->flags & FRCT_MFGM);
+                ret = -EAGAIN;
+        } else if (seqno == rcv_cr->seqno && !queue) {
                 ++rcv_cr->seqno;
-        } else { /* Out of order. */
-                if ((int32_t)(seqno - rcv_cr->seqno) < 0)
+                /* Filled a hole, ack the queued packets. */
+                if (frcti->rq != NULL
+                    && rq_has(frcti, rq_pos(frcti, rcv_cr->seqno)))
+                        ack = true;
+                else if (frcti_ack_due(frcti))
+                        ack = true;
+                else if (frcti_wnd_upd(frcti))
+                        ack = true;
+                /* Fragments wait for their SDU, see __frcti_queued_pdu. */
+                if (frcti->rq != NULL && (pci->flags & FRCT_MFGM
+                                          || frcti->nfrags > 0
+                                          || frcti->fdrop)) {
+                        frcti_frag(frcti, idx, pci->flags & FRCT_MFGM);
+                        ret = -EAGAIN;
+                }
+        } else { /* Out of order, or queued. */
+                if ((int32_t)(seqno - rcv_cr->seqno) < 0) {
+                        /* Duplicate, our ack may have been lost. */
+                        ack = rcv_cr->cflags & FRCTFRTX;
                         goto drop_packet;
+                }
 
                 if (rcv_cr->cflags & FRCTFRTX) {
-                        size_t pos = seqno & (RQ_SIZE - 1);
-                        if ((seqno - rcv_cr->lwe) > RQ_SIZE /* Out of rq. */
-                            || frcti->rq[pos] != -1) /* Duplicate in rq. */
+                        size_t pos = rq_pos(frcti, seqno);
+                        /* Out of rq. */
+                        if ((seqno - rcv_cr->seqno) >= frcti->rq_size)
+                                goto drop_packet;
+                        ack = true;
+                        if (rq_has(frcti, pos)) /* Duplicate in rq. */
                                 goto drop_packet;
                         /* Queue. */
-                        frcti->rq[pos] = idx;
+                        rq_put(frcti, pos, idx, pci->flags & FRCT_MFGM);
                         ret = -EAGAIN;
                 } else {
                         rcv_cr->seqno = seqno + 1;
                 }
         }
 
+        rcv_cr->act = now.tv_sec;
+
+ process_ack:
         if (rcv_cr->cflags & FRCTFRTX && pci->flags & FRCT_ACK) {
-                uint32_t ackno = ntoh32(pci->ackno);
+                struct frct_sack * blk   = NULL;
+                size_t             nblk  = 0;
+                bool               fast  = false;
+                size_t             acked = 0;
+                time_t             rtt   = -1;
+
+                if (pci->flags & FRCT_SACK) {
+                        blk  = (struct frct_sack *) shm_du_buff_head(sdb);
+                        nblk = (shm_du_buff_tail(sdb) - (uint8_t *) blk)
+                                / sizeof(*blk);
+                }
+
+                ackno = ntoh32(pci->ackno);
+
+                if (snd_cr->cflags & FRCTFRESCNTRL && pci->flags & FRCT_FC) {
+                        uint32_t rwe = ackno + ntoh16(pci->window);
+                        if (!frcti->fc || (int32_t)(rwe - snd_cr->rwe) > 0) {
+                                snd_cr->rwe = rwe;
+                                frcti->fc   = true;
+                                upd         = true;
+                        }
+                }
+
                 /* Check for duplicate (old) acks. */
-                if ((int32_t)(ackno - snd_cr->lwe) >= 0)
-                        snd_cr->lwe = ackno;
+                if ((int32_t)(ackno - snd_cr->lwe) > 0) {
+                        acked          = ackno - snd_cr->lwe;
+                        snd_cr->lwe    = ackno;
+                        frcti->dupacks = 0;
+                        upd            = true; /* Opens the cwnd. */
+                } else if (ackno == snd_cr->lwe && !(pci->flags & FRCT_DATA)
+                           && snd_cr->lwe != snd_cr->seqno && !upd) {
+                        ++frcti->dupacks;
+                }
+
+                /* Fast retransmit, once per window. */
+                if (frcti->dupacks >= FRCT_DUPACKS
+                    && (int32_t)(snd_cr->lwe - frcti->rcvr) >= 0) {
+                        fast           = true;
+                        frcti->dupacks = 0;
+                        frcti->rcvr    = snd_cr->seqno;
+                }
+
+                if (acked > 0 || nblk > 0 || fast) {
+                        rtt = rxmwheel_ack(frcti, blk, nblk, fast);
+                        if (pci->flags & FRCT_DLY)
+                                rtt = -1;
+                        if (rtt >= 0)
+                                frcti_rtt(frcti, rtt);
+                }
+
+                frct_cc_ack(&frcti->cc, acked, rtt);
+                if (fast)
+                        frct_cc_loss(&frcti->cc);
         }
 
-        rcv_cr->act = now.tv_sec;
+        if (ack)
+                n = frcti_sack(frcti, &ackno, &wnd, sack);
 
         pthread_rwlock_unlock(&frcti->lock);
 
+        if (ack)
+                frcti_snd_ack(frcti, ackno, wnd, sack, n, false);
+
+        if (upd) {
+                pthread_mutex_lock(&frcti->mtx);
+                pthread_cond_broadcast(&frcti->cond);
+                pthread_mutex_unlock(&frcti->mtx);
+        }
+
         if (!(pci->flags & FRCT_DATA))
                 shm_rdrbuff_remove(ai.rdrb, idx);
 
@@ -334,7 +1141,14 @@ static int __frcti_rcv(struct frcti *       frcti,
         return ret;
 
  drop_packet:
+        if (ack)
+                n = frcti_sack(frcti, &ackno, &wnd, sack);
+
         pthread_rwlock_unlock(&frcti->lock);
+
+        if (ack)
+                frcti_snd_ack(frcti, ackno, wnd, sack, n, false);
+
         shm_rdrbuff_remove(ai.rdrb, idx);
         rxmwheel_move();
         return -EAGAIN;
@@ -0,0 +1,206 @@
+/*
+ * Ouroboros - Copyright (C) 2016 - 2018
+ *
+ * Congestion control for FRCT
+ *
+ *    Dimitri Staessens <dimitri.staessens@ugent.be>
+ *    Sander Vrijders   <sander.vrijders@ugent.be>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., http://www.fsf.org/about/contact/.
+ */
+
+#define CC_INIT_WND    4          /* PDUs */
+#define CC_MIN_WND     2          /* PDUs */
+#define CC_MAX_WND     (1 << 16)  /* PDUs */
+
+/* Delay-based, in PDUs queued in the network per rtt. */
+#define CC_DELAY_ALPHA 2
+#define CC_DELAY_BETA  4
+
+struct frct_cc;
+
+struct frct_cc_ops {
+        void (* init)(struct frct_cc * cc);
+
+        /* Called with the number of PDUs acked and an rtt sample. */
+        void (* ack)(struct frct_cc * cc,
+                     size_t           acked,
+                     time_t           rtt);
+
+        void (* loss)(struct frct_cc * cc,
+                      bool             timeout);
+};
+
+struct frct_cc {
+        const struct frct_cc_ops * ops;
+        int                        algo;
+
+        size_t                     cwnd;     /* PDUs */
+        size_t                     ssthresh; /* PDUs */
+        size_t                     inc;      /* acked towards +1 */
+        size_t                     dec;      /* acked towards -1 */
+        time_t                     base;     /* lowest rtt (us) */
+
+        size_t                     rtos;     /* atomic, rxmwheel */
+        size_t                     seen;     /* rtos handled */
+};
+
+static void cc_reno_init(struct frct_cc * cc)
+{
+        cc->cwnd     = CC_INIT_WND;
+        cc->ssthresh = CC_MAX_WND;
+        cc->inc      = 0;
+        cc->dec      = 0;
+        cc->base     = 0;
+}
+
+/* Additive increase of one PDU per window of acked PDUs. */
+static void cc_grow(struct frct_cc * cc,
+                    size_t           acked)
+{
+        if (cc->cwnd < cc->ssthresh) {
+                cc->cwnd += acked;
+        } else {
+                cc->inc += acked;
+                while (cc->inc >= cc->cwnd) {
+                        cc->inc -= cc->cwnd;
+                        ++cc->cwnd;
+                }
+        }
+
+        cc->cwnd = MIN(cc->cwnd, CC_MAX_WND);
+}
+
+static void cc_reno_ack(struct frct_cc * cc,
+                        size_t           acked,
+                        time_t           rtt)
+{
+        (void) rtt;
+
+        cc_grow(cc, acked);
+}
+
+/* Multiplicative decrease, restart from the minimum on a timeout. */
+static void cc_reno_loss(struct frct_cc * cc,
+                         bool             timeout)
+{
+        cc->ssthresh = MAX(cc->cwnd >> 1, CC_MIN_WND);
+        cc->cwnd     = timeout ? CC_MIN_WND : cc->ssthresh;
+        cc->inc      = 0;
+        cc->dec      = 0;
+}
+
+/*
+ * Keep between ALPHA and BETA PDUs queued in the network, estimated
+ * from the rtt increase over the lowest rtt seen, as in TCP Vegas.
+ */
+static void cc_delay_ack(struct frct_cc * cc,
+                         size_t           acked,
+                         time_t           rtt)
+{
+        size_t queued;
+
+        if (rtt <= 0) {
+                cc_grow(cc, acked);
+                return;
+        }
+
+        if (cc->base == 0 || rtt < cc->base)
+                cc->base = rtt;
+
+        queued = cc->cwnd * (rtt - cc->base) / rtt;
+
+        if (queued < CC_DELAY_ALPHA) {
+                cc_grow(cc, acked);
+        } else if (queued > CC_DELAY_BETA) {
+                /* Leave slow start, back off one PDU per window. */
+                cc->ssthresh = MIN(cc->ssthresh, cc->cwnd);
+                cc->dec += acked;
+                while (cc->dec >= cc->cwnd && cc->cwnd > CC_MIN_WND) {
+                        cc->dec -= cc->cwnd;
+                        --cc->cwnd;
+                }
+        }
+}
+
+static const struct frct_cc_ops cc_reno_ops = {
+        .init = cc_reno_init,
+        .ack  = cc_reno_ack,
+        .loss = cc_reno_loss
+};
+
+static const struct frct_cc_ops cc_delay_ops = {
+        .init = cc_reno_init,
+        .ack  = cc_delay_ack,
+        .loss = cc_reno_loss
+};
+
+static int frct_cc_init(struct frct_cc * cc,
+                        int              algo)
+{
+        switch (algo) {
+        case FRCTCCNONE:
+                cc->ops = NULL;
+                break;
+        case FRCTCCAIMD:
+                cc->ops = &cc_reno_ops;
+                break;
+        case FRCTCCDELAY:
+                cc->ops = &cc_delay_ops;
+                break;
+        default:
+                return -EINVAL;
+        }
+
+        cc->algo = algo;
+        cc->seen = __atomic_load_n(&cc->rtos, __ATOMIC_RELAXED);
+
+        if (cc->ops != NULL)
+                cc->ops->init(cc);
+
+        return 0;
+}
+
+/* Does the congestion window allow a new PDU? */
+static bool frct_cc_open(struct frct_cc * cc,
+                         size_t           inflight)
+{
+        return cc->ops == NULL || inflight < cc->cwnd;
+}
+
+static void frct_cc_ack(struct frct_cc * cc,
+                        size_t           acked,
+                        time_t           rtt)
+{
+        size_t rtos;
+
+        if (cc->ops == NULL)
+                return;
+
+        /* Timeouts are counted by the rxmwheel, under its own lock. */
+        rtos = __atomic_load_n(&cc->rtos, __ATOMIC_RELAXED);
+        if (cc->seen != rtos) {
+                cc->seen = rtos;
+                cc->ops->loss(cc, true);
+        }
+
+        if (acked > 0)
+                cc->ops->ack(cc, acked, rtt);
+}
+
+static void frct_cc_loss(struct frct_cc * cc)
+{
+        if (cc->ops != NULL)
+                cc->ops->loss(cc, false);
+}
@@ -1,7 +1,7 @@
 /*
  * Ouroboros - Copyright (C) 2016 - 2018
  *
- * Hash table with separate chaining on collisions
+ * Hash table with Robin Hood open addressing
  *
  *    Dimitri Staessens <dimitri.staessens@ugent.be>
  *    Sander Vrijders   <sander.vrijders@ugent.be>
@@ -20,36 +20,67 @@
  * Foundation, Inc., http://www.fsf.org/about/contact/.
  */
 
-#if defined(__linux__) || defined(__CYGWIN__)
-#define _DEFAULT_SOURCE
-#endif
-
 #include <ouroboros/hashtable.h>
-#include <ouroboros/list.h>
 #include <ouroboros/errno.h>
-#include <ouroboros/hash.h>
 
 #include <assert.h>
 #include <string.h>
 
+#define HT_MIN_SIZE 16
+
+/* Grow when the table would be more than 3/4 full. */
+#define HT_FULL(t)  ((t)->count + 1 > (t)->size - ((t)->size >> 2))
+
 struct htable_entry {
-        struct list_head next;
-        uint64_t         key;
-        void *           val;
-        size_t           len;
+        uint64_t key;
+        union {
+                void *  ptr;
+                int64_t num;
+        } val;
+        size_t   len;  /* 0 for an inline value */
+        uint32_t dist; /* probe distance + 1, 0 if free */
 };
 
 struct htable {
-        struct list_head * buckets;
-        bool               hash_key;
-        uint64_t           buckets_size;
+        struct htable_entry * slots;
+        uint64_t              size;  /* power of 2 */
+        uint64_t              count;
+        bool                  hash_key;
 };
 
+/* 64-bit finalizer of MurmurHash3. */
+static uint64_t hash(uint64_t key)
+{
+        key ^= key >> 33;
+        key *= 0xff51afd7ed558ccdULL;
+        key ^= key >> 33;
+        key *= 0xc4ceb9fe1a85ec53ULL;
+        key ^= key >> 33;
+
+        return key;
+}
+
+static uint64_t calc_key(const struct htable * table,
+                         uint64_t              key)
+{
+        if (table->hash_key)
+                key = hash(key);
+
+        return (key & (table->size - 1));
+}
+
+static void entry_free(struct htable_entry * e)
+{
+        if (e->len > 0)
+                free(e->val.ptr);
+
+        e->dist = 0;
+}
+
 struct htable * htable_create(uint64_t buckets,
                               bool     hash_key)
 {
         struct htable * tmp;
-        unsigned int i;
 
         if (buckets == 0)
                 return NULL;
@@ -63,78 +94,173 @@ struct htable * htable_create(uint64_t buckets,
         buckets |= buckets >> 32;
         buckets++;
 
+        if (buckets < HT_MIN_SIZE)
+                buckets = HT_MIN_SIZE;
+
         tmp = malloc(sizeof(*tmp));
         if (tmp == NULL)
                 return NULL;
 
         tmp->hash_key = hash_key;
-        tmp->buckets_size = buckets;
+        tmp->size     = buckets;
+        tmp->count    = 0;
 
-        tmp->buckets = malloc(buckets * sizeof(*tmp->buckets));
-        if (tmp->buckets == NULL) {
+        tmp->slots = calloc(buckets, sizeof(*tmp->slots));
+        if (tmp->slots == NULL) {
                 free(tmp);
                 return NULL;
         }
 
-        for (i = 0; i < buckets; i++)
-                list_head_init(&(tmp->buckets[i]));
+        return tmp;
+}
+
+struct htable * htable_copy(struct htable * table,
+                            void *          (* dup)(const void * val,
+                                                    size_t       len))
+{
+        struct htable * tmp;
+        uint64_t        i;
+
+        assert(table);
+
+        tmp = malloc(sizeof(*tmp));
+        if (tmp == NULL)
+                goto fail_malloc;
+
+        *tmp = *table;
+
+        tmp->slots = malloc(table->size * sizeof(*tmp->slots));
+        if (tmp->slots == NULL)
+                goto fail_slots;
+
+        memcpy(tmp->slots, table->slots, table->size * sizeof(*tmp->slots));
+
+        for (i = 0; i < tmp->size; i++) {
+                struct htable_entry * e = &tmp->slots[i];
+                if (e->dist == 0 || e->len == 0)
+                        continue;
+                assert(dup);
+                e->val.ptr = dup(e->val.ptr, e->len);
+                if (e->val.ptr == NULL)
+                        goto fail_dup;
+        }
 
         return tmp;
+
+ fail_dup:
+        while (i-- > 0)
+                if (tmp->slots[i].dist != 0)
+                        entry_free(&tmp->slots[i]);
+        free(tmp->slots);
+ fail_slots:
+        free(tmp);
+ fail_malloc:
+        return NULL;
 }
 
 void htable_destroy(struct htable * table)
 {
         assert(table);
-        assert(table->buckets);
+        assert(table->slots);
 
         htable_flush(table);
-        free(table->buckets);
+        free(table->slots);
         free(table);
 }
 
 void htable_flush(struct htable * table)
 {
-        unsigned int          i;
-        struct list_head *    pos = NULL;
-        struct list_head *    n = NULL;
-        struct htable_entry * entry;
+        uint64_t i;
 
         assert(table);
 
-        for (i = 0; i < table->buckets_size; i++) {
-                list_for_each_safe(pos, n, &(table->buckets[i])) {
-                        entry = list_entry(pos, struct htable_entry, next);
-                        list_del(&entry->next);
-                        free(entry->val);
-                        free(entry);
+        for (i = 0; i < table->size; i++)
+                if (table->slots[i].dist != 0)
+                        entry_free(&table->slots[i]);
+
+        table->count = 0;
+}
+
+static struct htable_entry * find(const struct htable * table,
+                                  uint64_t              key)
+{
+        uint64_t mask = table->size - 1;
+        uint64_t pos  = calc_key(table, key);
+        uint32_t dist = 1;
+
+        while (true) {
+                struct htable_entry * e = &table->slots[pos];
+                /* A richer entry means the key is not in the table. */
+                if (e->dist < dist)
+                        return NULL;
+                if (e->key == key)
+                        return e;
+                pos = (pos + 1) & mask;
+                ++dist;
+        }
+}
+
+/* Robin Hood: take the slot of any entry closer to its home. */
+static void place(struct htable *     table,
+                  struct htable_entry e)
+{
+        uint64_t mask = table->size - 1;
+        uint64_t pos  = calc_key(table, e.key);
+
+        e.dist = 1;
+
+        while (table->slots[pos].dist != 0) {
+                if (table->slots[pos].dist < e.dist) {
+                        struct htable_entry tmp = table->slots[pos];
+                        table->slots[pos] = e;
+                        e = tmp;
                 }
+                pos = (pos + 1) & mask;
+                ++e.dist;
         }
+
+        table->slots[pos] = e;
+        ++table->count;
 }
 
-static uint64_t hash(uint64_t key)
+static int grow(struct htable * table)
 {
-        void *   res;
-        uint64_t ret;
-        uint8_t  keys[4];
+        struct htable_entry * old = table->slots;
+        uint64_t              size = table->size;
+        uint64_t              i;
 
-        memcpy(keys, &key, 4);
+        table->slots = calloc(size << 1, sizeof(*table->slots));
+        if (table->slots == NULL) {
+                table->slots = old;
+                return -ENOMEM;
+        }
 
-        mem_hash(HASH_MD5, &res, keys, 4);
+        table->size  = size << 1;
+        table->count = 0;
 
-        ret = (* (uint64_t *) res);
+        for (i = 0; i < size; i++)
+                if (old[i].dist != 0)
+                        place(table, old[i]);
 
-        free(res);
+        free(old);
 
-        return ret;
+        return 0;
 }
 
-static uint64_t calc_key(struct htable * table,
-                         uint64_t        key)
+static int insert(struct htable *     table,
+                  struct htable_entry e)
 {
-        if (table->hash_key)
-                key = hash(key);
+        assert(table);
+
+        if (find(table, e.key) != NULL)
+                return -1;
+
+        if (HT_FULL(table) && grow(table))
+                return -ENOMEM;
 
-        return (key & (table->buckets_size - 1));
+        place(table, e);
+
+        return 0;
 }
 
 int htable_insert(struct htable * table,
@@ -142,32 +268,28 @@ int htable_insert(struct htable * table,
                   void *          val,
                   size_t          len)
 {
-        struct htable_entry * entry;
-        uint64_t              lookup_key;
-        struct list_head *    pos = NULL;
+        struct htable_entry e;
 
-        assert(table);
+        assert(len > 0);
 
-        lookup_key = calc_key(table, key);
-
-        list_for_each(pos, &(table->buckets[lookup_key])) {
-                entry = list_entry(pos, struct htable_entry, next);
-                if (entry->key == key)
-                        return -1;
-        }
+        e.key     = key;
+        e.val.ptr = val;
+        e.len     = len;
 
-        entry = malloc(sizeof(*entry));
-        if (entry == NULL)
-                return -ENOMEM;
+        return insert(table, e);
+}
 
-        entry->key = key;
-        entry->val = val;
-        entry->len = len;
-        list_head_init(&entry->next);
+int htable_insert_num(struct htable * table,
+                      uint64_t        key,
+                      int64_t         val)
+{
+        struct htable_entry e;
 
-        list_add(&entry->next, &(table->buckets[lookup_key]));
+        e.key     = key;
+        e.val.num = val;
+        e.len     = 0;
 
-        return 0;
+        return insert(table, e);
 }
 
 int htable_lookup(struct htable * table,
@@ -175,47 +297,66 @@ int htable_lookup(struct htable * table,
                   void **         val,
                   size_t *        len)
 {
-        struct htable_entry * entry;
-        struct list_head *    pos = NULL;
-        uint64_t              lookup_key;
+        struct htable_entry * e;
 
         assert(table);
 
-        lookup_key = calc_key(table, key);
+        e = find(table, key);
+        if (e == NULL || e->len == 0)
+                return -1;
 
-        list_for_each(pos, &(table->buckets[lookup_key])) {
-                entry = list_entry(pos, struct htable_entry, next);
-                if (entry->key == key) {
-                        *val = entry->val;
-                        *len = entry->len;
-                        return 0;
-                }
-        }
+        *val = e->val.ptr;
+        *len = e->len;
+
+        return 0;
+}
+
+int htable_lookup_num(struct htable * table,
+                      uint64_t        key,
+                      int64_t *       val)
+{
+        struct htable_entry * e;
+
+        assert(table);
+
+        e = find(table, key);
+        if (e == NULL || e->len != 0)
+                return -1;
+
+        *val = e->val.num;
 
-        return -1;
+        return 0;
 }
 
 int htable_delete(struct htable * table,
                   uint64_t        key)
 {
-        struct htable_entry * entry;
-        uint64_t              lookup_key;
-        struct list_head *    pos = NULL;
-        struct list_head *    n = NULL;
+        struct htable_entry * e;
+        uint64_t              mask;
+        uint64_t              pos;
+        uint64_t              next;
 
         assert(table);
 
-        lookup_key = calc_key(table, key);
+        e = find(table, key);
+        if (e == NULL)
+                return -1;
 
-        list_for_each_safe(pos, n, &(table->buckets[lookup_key])) {
-                entry = list_entry(pos, struct htable_entry, next);
-                if (entry->key == key) {
-                        list_del(&entry->next);
-                        free(entry->val);
-                        free(entry);
-                        return 0;
-                }
+        entry_free(e);
+        --table->count;
+
+        /* Shift the following entries back, no tombstones. */
+        mask = table->size - 1;
+        pos  = e - table->slots;
+        next = (pos + 1) & mask;
+
+        while (table->slots[next].dist > 1) {
+                table->slots[pos] = table->slots[next];
+                --table->slots[pos].dist;
+                table->slots[next].dist = 0;
+                pos  = next;
+                next = (next + 1) & mask;
         }
 
-        return -1;
+        return 0;
 }
@@ -42,3 +42,15 @@ qoscube_t qos_spec_to_cube(qosspec_t qs)
         else
                 return QOS_CUBE_BE;
 }
+
+qosspec_t qos_cube_to_spec(qoscube_t qc)
+{
+        switch (qc) {
+        case QOS_CUBE_VOICE:
+                return qos_voice;
+        case QOS_CUBE_VIDEO:
+                return qos_video;
+        default:
+                return qos_best_effort;
+        }
+}
@@ -22,216 +22,324 @@
 
 #include <ouroboros/list.h>
 
-#define RXMQ_S     12                 /* defines #slots     */
-#define RXMQ_M     15                 /* defines max delay  */
-#define RXMQ_R     (RXMQ_M - RXMQ_S)  /* defines resolution */
-#define RXMQ_SLOTS (1 << RXMQ_S)
-#define RXMQ_MAX   (1 << RXMQ_M)      /* ms                 */
+#define RXMQ_S      12                 /* defines #slots     */
+#define RXMQ_M      15                 /* defines max delay  */
+#define RXMQ_R      (RXMQ_M - RXMQ_S)  /* defines resolution */
+#define RXMQ_SLOTS  (1 << RXMQ_S)
+#define RXMQ_MAX    (1 << RXMQ_M)      /* ms                 */
+#define RXMQ_SHARDS 4                  /* flows hash on fd   */
+
+#define RXM_SLAB    64                 /* rxms per allocation */
 
 /* Small inacurracy to avoid slow division by MILLION. */
 #define ts_to_ms(ts) (ts.tv_sec * 1000 + (ts.tv_nsec >> 20))
 #define ts_to_slot(ts) ((ts_to_ms(ts) >> RXMQ_R) & (RXMQ_SLOTS - 1))
+#define ts_to_us(ts) (ts.tv_sec * MILLION + ts.tv_nsec / 1000)
+
+#define fd_to_shard(fd) (&rw.shards[(fd) & (RXMQ_SHARDS - 1)])
 
 struct rxm {
-        struct list_head     next;
+        struct list_head     next;  /* Slot in the wheel.                */
+        struct list_head     flow;  /* Per-flow list or slab free list.  */
         uint32_t             seqno;
         struct shm_du_buff * sdb;
         uint8_t *            head;
         uint8_t *            tail;
         time_t               t0;    /* Time when original was sent (s).  */
+        time_t               ts;    /* Send time (us), 0 after a rtx.    */
         size_t               mul;   /* RTO multiplier.                   */
         struct frcti *       frcti;
 };
 
-struct {
+struct rxm_slab {
+        struct list_head next;
+        struct rxm       rxms[RXM_SLAB];
+};
+
+/* A flow only lives in the shard of its fd, which also guards its rxms. */
+struct rxm_shard {
         struct list_head wheel[RXMQ_SLOTS];
 
         size_t           prv; /* Last processed slot. */
         pthread_mutex_t  lock;
+};
+
+struct {
+        struct rxm_shard shards[RXMQ_SHARDS];
 } rw;
 
 static void rxmwheel_fini(void)
 {
-        size_t             i;
-        struct list_head * p;
-        struct list_head * h;
+        size_t i;
 
-        for (i = 0; i < RXMQ_SLOTS; ++i) {
-                list_for_each_safe(p, h, &rw.wheel[i]) {
-                        struct rxm * rxm = list_entry(p, struct rxm, next);
-                        list_del(&rxm->next);
-                        free(rxm);
-                }
-        }
+        /* The rxms are owned by the flows and freed with them. */
+        for (i = 0; i < RXMQ_SHARDS; ++i)
+                pthread_mutex_destroy(&rw.shards[i].lock);
 }
 
 static int rxmwheel_init(void)
 {
         struct timespec now;
         size_t          i;
-
-        if (pthread_mutex_init(&rw.lock, NULL))
-                return -1;
+        size_t          j;
 
         clock_gettime(PTHREAD_COND_CLOCK, &now);
 
-        /* Mark the previous timeslot as the last one processed. */
-        rw.prv = (ts_to_slot(now) - 1) & (RXMQ_SLOTS - 1);
+        for (i = 0; i < RXMQ_SHARDS; ++i) {
+                struct rxm_shard * s = &rw.shards[i];
 
-        for (i = 0; i < RXMQ_SLOTS; ++i)
-                list_head_init(&rw.wheel[i]);
+                if (pthread_mutex_init(&s->lock, NULL))
+                        goto fail_lock;
+
+                /* Mark the previous timeslot as the last one processed. */
+                s->prv = (ts_to_slot(now) - 1) & (RXMQ_SLOTS - 1);
+
+                for (j = 0; j < RXMQ_SLOTS; ++j)
+                        list_head_init(&s->wheel[j]);
+        }
 
         return 0;
+
+ fail_lock:
+        while (i-- > 0)
+                pthread_mutex_destroy(&rw.shards[i].lock);
+        return -1;
 }
 
-static void rxmwheel_clear(int fd)
+static void rxmwheel_flow_init(struct frcti * frcti)
 {
-        size_t i;
+        list_head_init(&frcti->rxms);
+        list_head_init(&frcti->rxm_free);
+        list_head_init(&frcti->rxm_slabs);
+}
 
-        /* FIXME: Add list element to avoid looping over full rxmwheel. */
-        pthread_mutex_lock(&rw.lock);
+/* Shard lock held. */
+static struct rxm * rxm_alloc(struct frcti * frcti)
+{
+        struct rxm_slab * slab;
+        struct rxm *      r;
+        size_t            i;
 
-        for (i = 0; i < RXMQ_SLOTS; ++i) {
-                struct list_head * p;
-                struct list_head * h;
+        if (list_is_empty(&frcti->rxm_free)) {
+                slab = malloc(sizeof(*slab));
+                if (slab == NULL)
+                        return NULL;
 
-                list_for_each_safe(p, h, &rw.wheel[i]) {
-                        struct rxm * r = list_entry(p, struct rxm, next);
-                        if (r->frcti->fd == fd) {
-                                list_del(&r->next);
-                                shm_du_buff_ack(r->sdb);
-                                ipcp_sdb_release(r->sdb);
-                                free(r);
-                        }
-                }
+                list_add(&slab->next, &frcti->rxm_slabs);
+
+                for (i = 0; i < RXM_SLAB; ++i)
+                        list_add_tail(&slab->rxms[i].flow, &frcti->rxm_free);
         }
 
-        pthread_mutex_unlock(&rw.lock);
+        r = list_first_entry(&frcti->rxm_free, struct rxm, flow);
+        list_del(&r->flow);
+
+        list_add_tail(&r->flow, &frcti->rxms);
+
+        return r;
 }
 
-/* Return fd on r-timer expiry. */
-static int rxmwheel_move(void)
+/* Shard lock held. */
+static void rxm_free(struct rxm * r)
+{
+        list_del(&r->next);
+        list_del(&r->flow);
+
+        list_add(&r->flow, &r->frcti->rxm_free);
+}
+
+static void rxmwheel_clear(struct frcti * frcti)
+{
+        struct rxm_shard * s = fd_to_shard(frcti->fd);
+        struct list_head * p;
+        struct list_head * h;
+
+        pthread_mutex_lock(&s->lock);
+
+        list_for_each_safe(p, h, &frcti->rxms) {
+                struct rxm * r = list_entry(p, struct rxm, flow);
+                shm_du_buff_ack(r->sdb);
+                ipcp_sdb_release(r->sdb);
+                rxm_free(r);
+        }
+
+        pthread_mutex_unlock(&s->lock);
+
+        list_for_each_safe(p, h, &frcti->rxm_slabs) {
+                struct rxm_slab * slab = list_entry(p, struct rxm_slab, next);
+                list_del(&slab->next);
+                free(slab);
+        }
+
+        list_head_init(&frcti->rxm_free);
+}
+
+/* Shard lock held. */
+static void rxm_drop(struct rxm * r)
+{
+        shm_du_buff_ack(r->sdb);
+        ipcp_sdb_release(r->sdb);
+        rxm_free(r);
+}
+
+/* Retransmit a copy and reschedule after delay ms, shard lock held. */
+static int rxm_rtx(struct rxm_shard * s,
+                   struct rxm *       r,
+                   struct timespec *  now,
+                   time_t             delay)
+{
+        size_t               rslot;
+        time_t               newtime;
+        ssize_t              idx;
+        struct shm_du_buff * sdb;
+        uint8_t *            head;
+        struct flow *        f;
+
+        /* Copy the payload, safe rtx in other layers. */
+        if (ipcp_sdb_reserve(&sdb, r->tail - r->head)) {
+                rxm_drop(r);
+                return -ENOMEM;
+        }
+
+        idx = shm_du_buff_get_idx(sdb);
+
+        head = shm_du_buff_head(sdb);
+        memcpy(head, r->head, r->tail - r->head);
+
+        /* Release the old copy. */
+        shm_du_buff_ack(r->sdb);
+        ipcp_sdb_release(r->sdb);
+
+        /* Update ackno and make sure DRF is not set. */
+        ((struct frct_pci *) head)->ackno = ntoh32(r->frcti->rcv_cr.lwe);
+        ((struct frct_pci *) head)->flags &= ~FRCT_DRF;
+
+        f = &ai.flows[r->frcti->fd];
+
+        /* Retransmit the copy. */
+        if (shm_rbuff_write(f->tx_rb, idx)) {
+                ipcp_sdb_release(sdb);
+                rxm_free(r);
+                return -EAGAIN;
+        }
+
+        shm_flow_set_notify(f->set, f->flow_id, FLOW_PKT);
+
+        /* Reschedule. */
+        shm_du_buff_wait_ack(sdb);
+
+        r->head = head;
+        r->tail = shm_du_buff_tail(sdb);
+        r->sdb  = sdb;
+        r->ts   = 0; /* Karn: no rtt samples from retransmissions. */
+
+        newtime = ts_to_ms((*now)) + delay;
+        rslot   = (newtime >> RXMQ_R) & (RXMQ_SLOTS - 1);
+
+        list_del(&r->next);
+        list_add_tail(&r->next, &s->wheel[rslot]);
+
+        return 0;
+}
+
+/* Return fd on r-timer expiry, shard lock held. */
+static int rxmwheel_move_shard(struct rxm_shard * s,
+                               struct timespec *  now,
+                               size_t             slot)
 {
-        struct timespec    now;
         struct list_head * p;
         struct list_head * h;
-        size_t             slot;
         size_t             i;
 
-        clock_gettime(PTHREAD_COND_CLOCK, &now);
+        for (i = s->prv; (ssize_t) (i - slot) <= 0; ++i) {
+                list_for_each_safe(p, h, &s->wheel[i & (RXMQ_SLOTS - 1)]) {
+                        struct rxm *   r;
+                        struct frcti * frcti;
+                        int            fd;
 
-        slot = ts_to_slot(now);
+                        r     = list_entry(p, struct rxm, next);
+                        frcti = r->frcti;
+                        fd    = frcti->fd;
 
-        pthread_mutex_lock(&rw.lock);
-
-        for (i = rw.prv; (ssize_t) (i - slot) <= 0; ++i) {
-                list_for_each_safe(p, h, &rw.wheel[i]) {
-                        struct rxm *         r;
-                        struct frct_cr *     snd_cr;
-                        struct frct_cr *     rcv_cr;
-                        size_t               rslot;
-                        time_t               newtime;
-                        ssize_t              idx;
-                        struct shm_du_buff * sdb;
-                        uint8_t *            head;
-                        struct flow *        f;
-
-                        r = list_entry(p, struct rxm, next);
-                        list_del(&r->next);
-
-                        snd_cr = &r->frcti->snd_cr;
-                        rcv_cr = &r->frcti->rcv_cr;
                         /* Has been ack'd, remove. */
-                        if ((int) (r->seqno - snd_cr->lwe) <= 0) {
-                                shm_du_buff_ack(r->sdb);
-                                ipcp_sdb_release(r->sdb);
-                                free(r);
+                        if ((int) (r->seqno - frcti->snd_cr.lwe) < 0) {
+                                rxm_drop(r);
                                 continue;
                         }
                         /* Check for r-timer expiry. */
-                        if (ts_to_ms(now) - r->t0 > r->frcti->r) {
-                                int fd = r->frcti->fd;
-                                pthread_mutex_unlock(&rw.lock);
-                                shm_du_buff_ack(r->sdb);
-                                ipcp_sdb_release(r->sdb);
-                                free(r);
+                        if (ts_to_ms((*now)) - r->t0 > frcti->r) {
+                                rxm_drop(r);
                                 return fd;
                         }
 
-                        /* Copy the payload, safe rtx in other layers. */
-                        if (ipcp_sdb_reserve(&sdb, r->tail - r->head)) {
-                                /* FIXME: reschedule send? */
-                                int fd = r->frcti->fd;
-                                pthread_mutex_unlock(&rw.lock);
-                                shm_du_buff_ack(r->sdb);
-                                ipcp_sdb_release(r->sdb);
-                                free(r);
-                                return fd;
-                        }
+                        __atomic_fetch_add(&frcti->cc.rtos, 1,
+                                           __ATOMIC_RELAXED);
 
-                        idx = shm_du_buff_get_idx(sdb);
+                        /* FIXME: reschedule send? */
+                        if (rxm_rtx(s, r, now, frcti->rto << ++r->mul)
+                            == -ENOMEM)
+                                return fd;
+                }
+        }
 
-                        head = shm_du_buff_head(sdb);
-                        memcpy(head, r->head, r->tail - r->head);
+        __atomic_store_n(&s->prv, slot, __ATOMIC_RELAXED);
 
-                        /* Release the old copy. */
-                        shm_du_buff_ack(r->sdb);
-                        ipcp_sdb_release(r->sdb);
+        return 0;
+}
 
-                        /* Update ackno and make sure DRF is not set. */
-                        ((struct frct_pci *) head)->ackno = ntoh32(rcv_cr->lwe);
-                        ((struct frct_pci *) head)->flags &= ~FRCT_DRF;
+/*
+ * Return fd on r-timer expiry. Shards that are already up to date
+ * are skipped without taking their lock.
+ */
+static int rxmwheel_move(void)
+{
+        struct timespec now;
+        size_t          slot;
+        size_t          i;
+        int             fd = 0;
 
-                        f = &ai.flows[r->frcti->fd];
+        clock_gettime(PTHREAD_COND_CLOCK, &now);
 
-                        /* Retransmit the copy. */
-                        if (shm_rbuff_write(f->tx_rb, idx)) {
-                                ipcp_sdb_release(sdb);
-                                free(r);
-                                /* FIXME: reschedule send? */
-                                continue;
-                        }
+        slot = ts_to_slot(now);
 
-                        shm_flow_set_notify(f->set, f->flow_id, FLOW_PKT);
+        for (i = 0; i < RXMQ_SHARDS && fd == 0; ++i) {
+                struct rxm_shard * s = &rw.shards[i];
 
-                        /* Reschedule. */
-                        shm_du_buff_wait_ack(sdb);
+                if (__atomic_load_n(&s->prv, __ATOMIC_RELAXED) == slot)
+                        continue;
 
-                        r->head = head;
-                        r->tail = shm_du_buff_tail(sdb);
-                        r->sdb  = sdb;
+                pthread_mutex_lock(&s->lock);
 
-                        newtime = ts_to_ms(now) + (f->frcti->rto << ++r->mul);
-                        rslot   = (newtime >> RXMQ_R) & (RXMQ_SLOTS - 1);
+                fd = rxmwheel_move_shard(s, &now, slot);
 
-                        list_add_tail(&r->next, &rw.wheel[rslot]);
-                }
+                pthread_mutex_unlock(&s->lock);
         }
 
-        rw.prv = slot;
-
-        pthread_mutex_unlock(&rw.lock);
-
-        return 0;
+        return fd;
 }
 
+/* Caller holds the flow lock. */
 static int rxmwheel_add(struct frcti *       frcti,
                         uint32_t             seqno,
                         struct shm_du_buff * sdb)
 {
-        struct timespec now;
-        struct rxm *    r;
-        size_t          slot;
-
-        r = malloc(sizeof(*r));
-        if (r == NULL)
-                return -ENOMEM;
+        struct rxm_shard * s = fd_to_shard(frcti->fd);
+        struct timespec    now;
+        struct rxm *       r;
+        size_t             slot;
 
         clock_gettime(PTHREAD_COND_CLOCK, &now);
 
-        pthread_mutex_lock(&rw.lock);
+        pthread_mutex_lock(&s->lock);
+
+        r = rxm_alloc(frcti);
+        if (r == NULL) {
+                pthread_mutex_unlock(&s->lock);
+                return -ENOMEM;
+        }
 
         r->t0    = ts_to_ms(now);
+        r->ts    = ts_to_us(now);
         r->mul   = 0;
         r->seqno = seqno;
         r->sdb   = sdb;
@@ -241,11 +349,79 @@ static int rxmwheel_add(struct frcti *       frcti,
 
         slot = ((r->t0 + frcti->rto) >> RXMQ_R) & (RXMQ_SLOTS - 1);
 
-        list_add_tail(&r->next, &rw.wheel[slot]);
+        list_add_tail(&r->next, &s->wheel[slot]);
 
-        pthread_mutex_unlock(&rw.lock);
+        pthread_mutex_unlock(&s->lock);
 
         shm_du_buff_wait_ack(sdb);
 
         return 0;
 }
+
+/*
+ * Process a (selective) ack. Drops all rxms below the cumulative ack
+ * and inside the sack blocks. On fast retransmit, the holes below the
+ * highest sacked seqno are retransmitted, or only the first unacked
+ * seqno when there are no sack blocks. Returns an rtt sample (us)
+ * from the most recent PDU that was acked, or -1 if there is none.
+ * Caller holds the flow lock.
+ */
+static time_t rxmwheel_ack(struct frcti *             frcti,
+                         const struct frct_sack *   sack,
+                         size_t                     n,
+                         bool                       fast)
+{
+        struct rxm_shard * s = fd_to_shard(frcti->fd);
+        struct timespec    now;
+        struct list_head * p;
+        struct list_head * h;
+        uint32_t           lwe;
+        uint32_t           high;
+        size_t             i;
+        time_t             rtt = -1;
+
+        clock_gettime(PTHREAD_COND_CLOCK, &now);
+
+        lwe  = frcti->snd_cr.lwe;
+        high = lwe + 1;
+        for (i = 0; i < n; ++i)
+                if ((int32_t) (ntoh32(sack[i].end) - high) > 0)
+                        high = ntoh32(sack[i].end);
+
+        pthread_mutex_lock(&s->lock);
+
+        list_for_each_safe(p, h, &frcti->rxms) {
+                struct rxm * r = list_entry(p, struct rxm, flow);
+
+                if ((int32_t) (r->seqno - lwe) < 0) {
+                        if (r->ts != 0)
+                                rtt = ts_to_us(now) - r->ts;
+                        rxm_drop(r);
+                        continue;
+                }
+
+                /* The rxms are in order, nothing to do above high. */
+                if ((int32_t) (r->seqno - high) >= 0)
+                        break;
+
+                for (i = 0; i < n; ++i) {
+                        if ((int32_t) (r->seqno - ntoh32(sack[i].start)) >= 0
+                            && (int32_t) (r->seqno - ntoh32(sack[i].end)) < 0)
+                                break;
+                }
+
+                if (i < n) {
+                        if (r->ts != 0)
+                                rtt = ts_to_us(now) - r->ts;
+                        rxm_drop(r);
+                        continue;
+                }
+
+                if (fast)
+                        rxm_rtx(s, r, &now, frcti->rto << r->mul);
+        }
+
+        pthread_mutex_unlock(&s->lock);
+
+        return rtt;
+}
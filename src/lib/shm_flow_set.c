@@ -327,6 +327,15 @@ int shm_flow_set_has(struct shm_flow_set * set,
 void shm_flow_set_notify(struct shm_flow_set * set,
                          int                   flow_id,
                          int                   event)
+{
+        shm_flow_set_notify_n(set, flow_id, event, 1);
+}
+
+/* One event per packet, but a single lock and wakeup for the batch. */
+void shm_flow_set_notify_n(struct shm_flow_set * set,
+                           int                   flow_id,
+                           int                   event,
+                           size_t                n)
 {
         assert(set);
         assert(!(flow_id < 0) && flow_id < SYS_MAX_FLOWS);
@@ -338,16 +347,27 @@ void shm_flow_set_notify(struct shm_flow_set * set,
                 return;
         }
 
-        (fqueue_ptr(set, set->mtable[flow_id]) +
-         (set->heads[set->mtable[flow_id]]))->flow_id = flow_id;
-        (fqueue_ptr(set, set->mtable[flow_id]) +
-         (set->heads[set->mtable[flow_id]])++)->event = event;
+        while (n-- > 0) {
+                (fqueue_ptr(set, set->mtable[flow_id]) +
+                 (set->heads[set->mtable[flow_id]]))->flow_id = flow_id;
+                (fqueue_ptr(set, set->mtable[flow_id]) +
+                 (set->heads[set->mtable[flow_id]])++)->event = event;
+        }
 
         pthread_cond_signal(&set->conds[set->mtable[flow_id]]);
 
         pthread_mutex_unlock(set->lock);
 }
 
+/* Peek without taking the lock, for spinning before a wait. */
+bool shm_flow_set_pending(const struct shm_flow_set * set,
+                          size_t                      idx)
+{
+        assert(set);
+        assert(idx < PROG_MAX_FQUEUES);
+
+        return __atomic_load_n(set->heads + idx, __ATOMIC_RELAXED) != 0;
+}
 
 ssize_t shm_flow_set_wait(const struct shm_flow_set * set,
                           size_t                      idx,
@@ -20,7 +20,11 @@
  * Foundation, Inc., http://www.fsf.org/about/contact/.
  */
 
+#if defined(__linux__)
+#define _DEFAULT_SOURCE
+#else
 #define _POSIX_C_SOURCE 200809L
+#endif
 
 #include "config.h"
 
@@ -43,10 +47,18 @@
 #include <assert.h>
 #include <stdbool.h>
 
+#if (defined(SHM_RBUFF_LOCKLESS) && defined(__linux__) &&      \
+     (defined(__GNUC__) || defined (__clang__)))
+#define SHM_RBUFF_FUTEX
+#endif
+
 #define FN_MAX_CHARS 255
 
+/* Head and tail are on their own cache line, the rest shares one. */
+#define CACHE_LINE   64
+
 #define SHM_RB_FILE_SIZE ((SHM_BUFFER_SIZE) * sizeof(ssize_t)           \
-                          + 3 * sizeof(size_t)                          \
+                          + 3 * CACHE_LINE                              \
                           + sizeof(pthread_mutex_t)                     \
                           + 2 * sizeof (pthread_cond_t))
 
@@ -62,6 +74,14 @@ struct shm_rbuff {
         size_t *          head;     /* start of ringbuffer head      */
         size_t *          tail;     /* start of ringbuffer tail      */
         size_t *          acl;      /* access control                */
+#ifdef SHM_RBUFF_FUTEX
+        uint32_t *        rd_wait;  /* futex, consumer is sleeping   */
+        uint32_t *        wr_wait;  /* futex, fini is sleeping       */
+        size_t            ctail;    /* tail as last seen by producer */
+        size_t            chead;    /* head as last seen by consumer */
+        pthread_mutex_t   wr_lock;  /* threads of the producer       */
+        pthread_mutex_t   rd_lock;  /* threads of the consumer       */
+#endif
         pthread_mutex_t * lock;     /* lock all free space in shm    */
         pthread_cond_t *  add;      /* packet arrived                */
         pthread_cond_t *  del;      /* packet removed                */
@@ -75,6 +95,10 @@ void shm_rbuff_close(struct shm_rbuff * rb)
 
         munmap(rb->shm_base, SHM_RB_FILE_SIZE);
 
+#ifdef SHM_RBUFF_FUTEX
+        pthread_mutex_destroy(&rb->rd_lock);
+        pthread_mutex_destroy(&rb->wr_lock);
+#endif
         free(rb);
 }
 
@@ -95,6 +119,13 @@ struct shm_rbuff * rbuff_create(pid_t pid,
         if (rb == NULL)
                 goto fail_malloc;
 
+#ifdef SHM_RBUFF_FUTEX
+        if (pthread_mutex_init(&rb->wr_lock, NULL))
+                goto fail_wr_lock;
+
+        if (pthread_mutex_init(&rb->rd_lock, NULL))
+                goto fail_rd_lock;
+#endif
         fd = shm_open(fn, flags, 0666);
         if (fd == -1)
                 goto fail_open;
@@ -110,14 +141,20 @@ struct shm_rbuff * rbuff_create(pid_t pid,
 
         rb->shm_base = shm_base;
         rb->head     = (size_t *) (rb->shm_base + (SHM_BUFFER_SIZE));
-        rb->tail     = rb->head + 1;
-        rb->acl      = rb->tail + 1;
-        rb->lock     = (pthread_mutex_t *) (rb->acl + 1);
+        rb->tail     = (size_t *) ((uint8_t *) rb->head + CACHE_LINE);
+        rb->acl      = (size_t *) ((uint8_t *) rb->tail + CACHE_LINE);
+        rb->lock     = (pthread_mutex_t *)
+                ((uint8_t *) rb->acl + CACHE_LINE);
         rb->add      = (pthread_cond_t *) (rb->lock + 1);
         rb->del      = rb->add + 1;
         rb->pid      = pid;
         rb->flow_id  = flow_id;
-
+#ifdef SHM_RBUFF_FUTEX
+        rb->rd_wait  = (uint32_t *) (rb->acl + 1);
+        rb->wr_wait  = rb->rd_wait + 1;
+        rb->ctail    = *rb->tail;
+        rb->chead    = *rb->head;
+#endif
         return rb;
 
  fail_truncate:
@@ -125,6 +162,12 @@ struct shm_rbuff * rbuff_create(pid_t pid,
         if (flags & O_CREAT)
                 shm_unlink(fn);
  fail_open:
+#ifdef SHM_RBUFF_FUTEX
+        pthread_mutex_destroy(&rb->rd_lock);
+ fail_rd_lock:
+        pthread_mutex_destroy(&rb->wr_lock);
+ fail_wr_lock:
+#endif
         free(rb);
  fail_malloc:
         return NULL;
@@ -202,8 +245,7 @@ struct shm_rbuff * shm_rbuff_open(pid_t pid,
         return rbuff_create(pid, flow_id, O_RDWR);
 }
 
-#if (defined(SHM_RBUFF_LOCKLESS) &&                            \
-     (defined(__GNUC__) || defined (__clang__)))
+#ifdef SHM_RBUFF_FUTEX
 #include "shm_rbuff_ll.c"
 #else
 #include "shm_rbuff_pthr.c"
@@ -1,7 +1,7 @@
 /*
  * Ouroboros - Copyright (C) 2016 - 2018
  *
- * Lockless ring buffer for incoming packets
+ * Ring buffer, lockless between the producer and consumer process
  *
  *    Dimitri Staessens <dimitri.staessens@ugent.be>
  *    Sander Vrijders   <sander.vrijders@ugent.be>
@@ -20,8 +20,73 @@
  * Foundation, Inc., http://www.fsf.org/about/contact/.
  */
 
-#define RB_HEAD __sync_fetch_and_add(rb->head, 0)
-#define RB_TAIL __sync_fetch_and_add(rb->tail, 0)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <limits.h>
+
+/*
+ * The producer and the consumer live in different processes, and the
+ * processes never share a lock. A process can have several threads
+ * on one side of the ring: a writer, FRCT acks and retransmissions,
+ * or the packet handlers of an IPCP. These are serialized by a
+ * process-local lock, so that only the head is written by the
+ * producer and only the tail by the consumer. Each side caches the
+ * index of the other and only rereads it when the ring looks full or
+ * empty.
+ */
+
+#define RB_MASK ((SHM_BUFFER_SIZE) - 1)
+
+#if PTHREAD_COND_CLOCK == CLOCK_REALTIME
+#define FUTEX_CLOCK FUTEX_CLOCK_REALTIME
+#else
+#define FUTEX_CLOCK 0
+#endif
+
+/* Time between checks on the consumer when waiting in fini. */
+#define FINI_WAIT_NS (10 * MILLION)
+
+#define load_acq(ptr)       __atomic_load_n(ptr, __ATOMIC_ACQUIRE)
+#define store_rel(ptr, val) __atomic_store_n(ptr, val, __ATOMIC_RELEASE)
+#define full_fence()        __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+static int futex_wait(uint32_t *              uaddr,
+                      uint32_t                val,
+                      const struct timespec * abstime)
+{
+        int old;
+        int ret;
+
+        /* The syscall is not a cancellation point by itself. */
+        pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, &old);
+
+        ret = syscall(SYS_futex, uaddr,
+                      FUTEX_WAIT_BITSET | FUTEX_CLOCK, val,
+                      abstime, NULL, FUTEX_BITSET_MATCH_ANY);
+
+        pthread_setcanceltype(old, NULL);
+
+        if (ret < 0 && errno == ETIMEDOUT)
+                return -ETIMEDOUT;
+
+        return 0;
+}
+
+static void futex_wake(uint32_t * uaddr)
+{
+        syscall(SYS_futex, uaddr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/* Only enter the kernel if someone announced it is sleeping. */
+static void rb_wake(uint32_t * uaddr)
+{
+        if (__atomic_load_n(uaddr, __ATOMIC_RELAXED) == 0)
+                return;
+
+        __atomic_store_n(uaddr, 0, __ATOMIC_RELAXED);
+
+        futex_wake(uaddr);
+}
 
 void shm_rbuff_destroy(struct shm_rbuff * rb)
 {
@@ -39,110 +104,106 @@ void shm_rbuff_destroy(struct shm_rbuff * rb)
 int shm_rbuff_write(struct shm_rbuff * rb,
                     size_t             idx)
 {
-        size_t ohead;
-        size_t nhead;
-        bool   was_empty = false;
+        size_t   head;
+        size_t   nhead;
+        uint32_t acl;
 
         assert(rb);
         assert(idx < SHM_BUFFER_SIZE);
 
-        if (__sync_fetch_and_add(rb->acl, 0) != ACL_RDWR) {
-                if (__sync_fetch_and_add(rb->acl, 0) & ACL_FLOWDOWN)
+        acl = __atomic_load_n(rb->acl, __ATOMIC_RELAXED);
+        if (acl != ACL_RDWR) {
+                if (acl & ACL_FLOWDOWN)
                         return -EFLOWDOWN;
-                else if (__sync_fetch_and_add(rb->acl, 0) & ACL_RDONLY)
+                else if (acl & ACL_RDONLY)
                         return -ENOTALLOC;
         }
 
-        if (!shm_rbuff_free(rb))
-                return -EAGAIN;
+        pthread_mutex_lock(&rb->wr_lock);
+
+        head  = *rb->head;
+        nhead = (head + 1) & RB_MASK;
+
+        if (nhead == rb->ctail) {
+                rb->ctail = load_acq(rb->tail);
+                if (nhead == rb->ctail) {
+                        pthread_mutex_unlock(&rb->wr_lock);
+                        return -EAGAIN;
+                }
+        }
 
-        if (shm_rbuff_empty(rb))
-                was_empty = true;
+        *(rb->shm_base + head) = (ssize_t) idx;
 
-        nhead = RB_HEAD;
+        store_rel(rb->head, nhead);
 
-        *(rb->shm_base + nhead) = (ssize_t) idx;
+        pthread_mutex_unlock(&rb->wr_lock);
 
-        do {
-                ohead = nhead;
-                nhead = (ohead + 1) & ((SHM_BUFFER_SIZE) - 1);
-                nhead = __sync_val_compare_and_swap(rb->head, ohead, nhead);
-        } while (nhead != ohead);
+        /* Pairs with the fence in shm_rbuff_read_b. */
+        full_fence();
 
-        if (was_empty)
-                pthread_cond_broadcast(rb->add);
+        rb_wake(rb->rd_wait);
 
         return 0;
 }
 
 ssize_t shm_rbuff_read(struct shm_rbuff * rb)
 {
-        size_t otail;
-        size_t ntail;
+        size_t  tail;
+        ssize_t idx;
 
         assert(rb);
 
-        if (shm_rbuff_empty(rb))
-                return __sync_fetch_and_add(rb->acl, 0) & ACL_FLOWDOWN ?
-                        -EFLOWDOWN : -EAGAIN;
+        pthread_mutex_lock(&rb->rd_lock);
+
+        tail = *rb->tail;
+
+        if (tail == rb->chead) {
+                rb->chead = load_acq(rb->head);
+                if (tail == rb->chead) {
+                        pthread_mutex_unlock(&rb->rd_lock);
+                        return __atomic_load_n(rb->acl, __ATOMIC_RELAXED)
+                                & ACL_FLOWDOWN ? -EFLOWDOWN : -EAGAIN;
+                }
+        }
 
-        ntail = RB_TAIL;
+        idx = *(rb->shm_base + tail);
 
-        do {
-                otail = ntail;
-                ntail = (otail + 1) & ((SHM_BUFFER_SIZE) - 1);
-                ntail = __sync_val_compare_and_swap(rb->tail, otail, ntail);
-        } while (ntail != otail);
+        store_rel(rb->tail, (tail + 1) & RB_MASK);
 
-        pthread_cond_broadcast(rb->del);
+        pthread_mutex_unlock(&rb->rd_lock);
 
-        return *(rb->shm_base + ntail);
+        /* No fence, fini rechecks periodically. */
+        rb_wake(rb->wr_wait);
+
+        return idx;
 }
 
 ssize_t shm_rbuff_read_b(struct shm_rbuff *      rb,
                          const struct timespec * abstime)
 {
-        ssize_t idx = -1;
+        ssize_t idx;
 
         assert(rb);
 
-        /* try a non-blocking read first */
-        idx = shm_rbuff_read(rb);
-        if (idx != -EAGAIN)
-                return idx;
+        while (true) {
+                idx = shm_rbuff_read(rb);
+                if (idx != -EAGAIN)
+                        return idx;
 
-#ifndef HAVE_ROBUST_MUTEX
-        pthread_mutex_lock(rb->lock);
-#else
-        if (pthread_mutex_lock(rb->lock) == EOWNERDEAD)
-                pthread_mutex_consistent(rb->lock);
-#endif
-        pthread_cleanup_push((void(*)(void *))pthread_mutex_unlock,
-                             (void *) rb->lock);
-
-        while (shm_rbuff_empty(rb) && (idx != -ETIMEDOUT)) {
-                if (abstime != NULL)
-                        idx = -pthread_cond_timedwait(rb->add,
-                                                      rb->lock,
-                                                      abstime);
-                else
-                        idx = -pthread_cond_wait(rb->add, rb->lock);
-#ifdef HAVE_ROBUST_MUTEX
-                if (idx == -EOWNERDEAD)
-                        pthread_mutex_consistent(rb->lock);
-#endif
-        }
+                __atomic_store_n(rb->rd_wait, 1, __ATOMIC_RELAXED);
 
-        if (idx != -ETIMEDOUT) {
-                /* do a nonblocking read */
-                idx = shm_rbuff_read(rb);
+                /* Pairs with the fence in shm_rbuff_write. */
+                full_fence();
 
-                assert(idx >= 0);
-        }
+                if (load_acq(rb->head) != load_acq(rb->tail))
+                        continue;
 
-        pthread_cleanup_pop(true);
+                if (load_acq(rb->acl) & ACL_FLOWDOWN)
+                        continue;
 
-        return idx;
+                if (futex_wait(rb->rd_wait, 1, abstime) == -ETIMEDOUT)
+                        return -ETIMEDOUT;
+        }
 }
 
 void shm_rbuff_set_acl(struct shm_rbuff * rb,
@@ -150,46 +211,43 @@ void shm_rbuff_set_acl(struct shm_rbuff * rb,
 {
         assert(rb);
 
-        __sync_bool_compare_and_swap(rb->acl, *rb->acl, flags);
+        __atomic_store_n(rb->acl, (size_t) flags, __ATOMIC_SEQ_CST);
+
+        /* Let sleeping readers see the flow going down. */
+        rb_wake(rb->rd_wait);
 }
 
 uint32_t shm_rbuff_get_acl(struct shm_rbuff * rb)
 {
         assert(rb);
 
-        return __sync_fetch_and_add(rb->acl, 0);
+        return (uint32_t) __atomic_load_n(rb->acl, __ATOMIC_SEQ_CST);
 }
 
 void shm_rbuff_fini(struct shm_rbuff * rb)
 {
+        struct timespec abs;
+        struct timespec intv = {0, FINI_WAIT_NS};
+
         assert(rb);
 
-        if (shm_rbuff_empty(rb))
-                return;
+        while (load_acq(rb->head) != load_acq(rb->tail)) {
+                __atomic_store_n(rb->wr_wait, 1, __ATOMIC_SEQ_CST);
 
-#ifndef HAVE_ROBUST_MUTEX
-        pthread_mutex_lock(rb->lock);
-#else
-        if (pthread_mutex_lock(rb->lock) == EOWNERDEAD)
-                pthread_mutex_consistent(rb->lock);
-#endif
+                if (load_acq(rb->head) == load_acq(rb->tail))
+                        break;
 
-        pthread_cleanup_push((void(*)(void *))pthread_mutex_unlock,
-                             (void *) rb->lock);
+                clock_gettime(PTHREAD_COND_CLOCK, &abs);
+                ts_add(&abs, &intv, &abs);
 
-        while (!shm_rbuff_empty(rb))
-#ifndef HAVE_ROBUST_MUTEX
-                pthread_cond_wait(rb->del, rb->lock);
-#else
-                if (pthread_cond_wait(rb->del, rb->lock) == EOWNERDEAD)
-                        pthread_mutex_consistent(rb->lock);
-#endif
-        pthread_cleanup_pop(true);
+                futex_wait(rb->wr_wait, 1, &abs);
+        }
 }
 
 size_t shm_rbuff_queued(struct shm_rbuff * rb)
 {
         assert(rb);
 
-        return shm_rbuff_used(rb);
+        return (load_acq(rb->head) + (SHM_BUFFER_SIZE) - load_acq(rb->tail))
+                & RB_MASK;
 }
@@ -39,31 +39,94 @@
 #include <signal.h>
 #include <sys/stat.h>
 #include <stdbool.h>
+#include <limits.h>
 #include <assert.h>
 
-#define SHM_BLOCKS_SIZE ((SHM_BUFFER_SIZE) * SHM_RDRB_BLOCK_SIZE)
-#define SHM_FILE_SIZE (SHM_BLOCKS_SIZE + 2 * sizeof(size_t)                    \
-                       + sizeof(pthread_mutex_t) + 2 * sizeof(pthread_cond_t)  \
+/*
+ * Size classes, each pool is a ring of equally sized blocks, or a
+ * stack of free blocks when blocks may be released out of order.
+ * Most packets fit a small or a medium block, by default the pools
+ * hold three times as many packets as a ring of SHM_BUFFER_SIZE pages
+ * in less memory.
+ */
+#define SHM_RDRB_POOLS  3
+
+#define SMALL_BLOCKS    (SHM_RDRB_SMALL_BLOCKS)
+#define MEDIUM_BLOCKS   (SHM_RDRB_MEDIUM_BLOCKS)
+#define LARGE_BLOCKS    (SHM_RDRB_LARGE_BLOCKS)
+
+#define SMALL_SIZE      (SMALL_BLOCKS * SHM_RDRB_SMALL_BLOCK)
+#define MEDIUM_SIZE     (MEDIUM_BLOCKS * SHM_RDRB_MEDIUM_BLOCK)
+#define LARGE_SIZE      (LARGE_BLOCKS * SHM_RDRB_LARGE_BLOCK)
+
+#ifdef SHM_RDRB_FREELIST
+#ifdef SHM_RDRB_MULTI_BLOCK
+#error "SHM_RDRB_FREELIST does not support multiblock packets"
+#endif
+#define SHM_STACK_SIZE  ((SHM_RDRB_BLOCKS) * sizeof(size_t))
+#else
+#define SHM_STACK_SIZE  0
+#endif
+
+#define SHM_BLOCKS_SIZE (SMALL_SIZE + MEDIUM_SIZE + LARGE_SIZE)
+#define SHM_FILE_SIZE (SHM_BLOCKS_SIZE                                         \
+                       + SHM_RDRB_POOLS * sizeof(struct rdrb_pool)             \
+                       + SHM_STACK_SIZE                                        \
                        + sizeof(pid_t))
 
-#define get_head_ptr(rdrb)                                                     \
-        idx_to_du_buff_ptr(rdrb, *rdrb->head)
+#define blk_ptr(rdrb, p, i)                                                    \
+        ((struct shm_du_buff *) (rdrb->shm_base + pool_off[p]                  \
+                                 + (i) * pool_bsz[p]))
 
-#define get_tail_ptr(rdrb)                                                     \
-        idx_to_du_buff_ptr(rdrb, *rdrb->tail)
+#ifdef SHM_RDRB_FREELIST
+#define pool_stack(rdrb, p)                                                    \
+        (rdrb->stack + pool_idx[p])
+#else
+#define get_head_ptr(rdrb, p)                                                  \
+        blk_ptr(rdrb, p, rdrb->pools[p].head)
+
+#define get_tail_ptr(rdrb, p)                                                  \
+        blk_ptr(rdrb, p, rdrb->pools[p].tail)
+
+#define pool_used(rdrb, p)                                                     \
+        (((rdrb->pools[p].head + pool_len[p] - rdrb->pools[p].tail) + 1)      \
+         & (pool_len[p] - 1))
+
+#define pool_free(rdrb, p, i)                                                  \
+        (pool_used(rdrb, p) + i < pool_len[p])
+
+#define pool_empty(rdrb, p)                                                    \
+        (rdrb->pools[p].tail == rdrb->pools[p].head)
+#endif
 
-#define idx_to_du_buff_ptr(rdrb, idx)                                          \
-        ((struct shm_du_buff *) (rdrb->shm_base + idx * SHM_RDRB_BLOCK_SIZE))
+/* Blocks reserved in a process cache carry a tag instead of refs. */
+#define SDB_CACHED ((size_t) 1 << (sizeof(size_t) * CHAR_BIT - 1))
+#define sdb_is_cached(refs) (((refs) & SDB_CACHED) != 0)
 
-#define shm_rdrb_used(rdrb)                                                    \
-        (((*rdrb->head + (SHM_BUFFER_SIZE) - *rdrb->tail) + 1)                 \
-         & ((SHM_BUFFER_SIZE) - 1))
+static const size_t pool_bsz[SHM_RDRB_POOLS] = {
+        SHM_RDRB_SMALL_BLOCK,
+        SHM_RDRB_MEDIUM_BLOCK,
+        SHM_RDRB_LARGE_BLOCK
+};
 
-#define shm_rdrb_free(rdrb, i)                                                 \
-        (shm_rdrb_used(rdrb) + i < (SHM_BUFFER_SIZE))
+static const size_t pool_len[SHM_RDRB_POOLS] = {
+        SMALL_BLOCKS,
+        MEDIUM_BLOCKS,
+        LARGE_BLOCKS
+};
+
+/* First index and byte offset of each pool. */
+static const size_t pool_idx[SHM_RDRB_POOLS] = {
+        0,
+        SMALL_BLOCKS,
+        SMALL_BLOCKS + MEDIUM_BLOCKS
+};
 
-#define shm_rdrb_empty(rdrb)                                                   \
-        (*rdrb->tail == *rdrb->head)
+static const size_t pool_off[SHM_RDRB_POOLS] = {
+        0,
+        SMALL_SIZE,
+        SMALL_SIZE + MEDIUM_SIZE
+};
 
 struct shm_du_buff {
         size_t size;
@@ -76,35 +139,472 @@ struct shm_du_buff {
         size_t idx;
 };
 
+struct rdrb_pool {
+#ifdef SHM_RDRB_FREELIST
+        size_t          avail;    /* blocks on the free stack */
+#else
+        size_t          head;     /* start of ringbuffer head */
+        size_t          tail;     /* start of ringbuffer tail */
+#endif
+        size_t          gen;      /* generation for cache tags */
+        size_t          waiters;  /* writers blocked on this pool */
+        pthread_mutex_t lock;     /* lock all free space in pool */
+        pthread_cond_t  healthy;  /* flag when packet is read */
+};
+
+#if SHM_RDRB_CACHE_SIZE > 0
+struct rdrb_cache {
+        pthread_mutex_t lock;
+        size_t          blk[SHM_RDRB_CACHE_SIZE]; /* reserved blocks */
+        size_t          count;    /* reserved blocks left */
+        size_t          tag;      /* refs value of reserved blocks */
+};
+#endif
+
 struct shm_rdrbuff {
-        uint8_t *         shm_base; /* start of blocks */
-        size_t *          head;     /* start of ringbuffer head */
-        size_t *          tail;     /* start of ringbuffer tail */
-        pthread_mutex_t * lock;     /* lock all free space in shm */
-        pthread_cond_t *  healthy;  /* flag when packet is read */
-        pid_t *           pid;      /* pid of the irmd owner */
+        uint8_t *          shm_base; /* start of blocks */
+        struct rdrb_pool * pools;    /* ring state per size class */
+#ifdef SHM_RDRB_FREELIST
+        size_t *           stack;    /* free blocks per size class */
+#endif
+        pid_t *            pid;      /* pid of the irmd owner */
+#if SHM_RDRB_CACHE_SIZE > 0
+        struct rdrb_cache  cache[SHM_RDRB_POOLS]; /* reserved blocks */
+#endif
 };
 
-static void garbage_collect(struct shm_rdrbuff * rdrb)
+static size_t idx_to_pool(size_t idx)
+{
+        size_t p = SHM_RDRB_POOLS - 1;
+
+        while (idx < pool_idx[p])
+                --p;
+
+        return p;
+}
+
+static struct shm_du_buff * idx_to_du_buff_ptr(struct shm_rdrbuff * rdrb,
+                                               size_t               idx)
+{
+        size_t p = idx_to_pool(idx);
+
+        return blk_ptr(rdrb, p, idx - pool_idx[p]);
+}
+
+#ifdef SHM_RDRB_FREELIST
+/* Return block i to pool p, lock held. */
+static void pool_push(struct shm_rdrbuff * rdrb,
+                      size_t               p,
+                      size_t               i)
+{
+        struct rdrb_pool * pool = &rdrb->pools[p];
+
+        assert(pool->avail < pool_len[p]);
+
+        pool_stack(rdrb, p)[pool->avail++] = i;
+
+        if (pool->waiters > 0)
+                pthread_cond_signal(&pool->healthy);
+}
+
+/* Reclaim the blocks reserved in the cache of any process. */
+static void pool_reclaim(struct shm_rdrbuff * rdrb,
+                         size_t               p)
+{
+        struct shm_du_buff * sdb;
+        size_t               refs;
+        size_t               i;
+
+        __sync_synchronize();
+
+        for (i = 0; i < pool_len[p]; ++i) {
+                sdb  = blk_ptr(rdrb, p, i);
+                refs = sdb->refs;
+                if (sdb_is_cached(refs) &&
+                    __sync_bool_compare_and_swap(&sdb->refs, refs, 0))
+                        pool_push(rdrb, p, i);
+        }
+}
+
+static void sanitize(struct shm_rdrbuff * rdrb,
+                     size_t               p)
+{
+        pthread_mutex_consistent(&rdrb->pools[p].lock);
+}
+#else
+/*
+ * Blocks are released without taking the lock, so the tail is only
+ * advanced after a full barrier. With steal set, blocks reserved in
+ * the cache of some process are reclaimed as well.
+ */
+static void garbage_collect(struct shm_rdrbuff * rdrb,
+                            size_t               p,
+                            bool                 steal)
+{
+        struct rdrb_pool *   pool = &rdrb->pools[p];
+        struct shm_du_buff * sdb;
+        size_t               refs;
+        size_t               tail = pool->tail;
+
+        while (!pool_empty(rdrb, p)) {
+                __sync_synchronize();
+                sdb  = get_tail_ptr(rdrb, p);
+                refs = sdb->refs;
+                if (refs != 0 && !(steal && sdb_is_cached(refs) &&
+                     __sync_bool_compare_and_swap(&sdb->refs, refs, 0)))
+                        break;
+#ifdef SHM_RDRB_MULTI_BLOCK
+                pool->tail = (pool->tail + sdb->blocks) & (pool_len[p] - 1);
+#else
+                pool->tail = (pool->tail + 1) & (pool_len[p] - 1);
+#endif
+        }
+
+        if (pool->tail != tail)
+                pthread_cond_broadcast(&pool->healthy);
+}
+
+static void sanitize(struct shm_rdrbuff * rdrb,
+                     size_t               p)
+{
+        --get_head_ptr(rdrb, p)->refs;
+        garbage_collect(rdrb, p, false);
+        pthread_mutex_consistent(&rdrb->pools[p].lock);
+}
+#endif
+
+static void pool_lock(struct shm_rdrbuff * rdrb,
+                      size_t               p)
+{
+#ifndef HAVE_ROBUST_MUTEX
+        pthread_mutex_lock(&rdrb->pools[p].lock);
+#else
+        if (pthread_mutex_lock(&rdrb->pools[p].lock) == EOWNERDEAD)
+                sanitize(rdrb, p);
+#endif
+}
+
+static void pool_unlock(struct shm_rdrbuff * rdrb,
+                        size_t               p)
+{
+        pthread_mutex_unlock(&rdrb->pools[p].lock);
+}
+
+static void pool_cancel(void * o)
+{
+        struct rdrb_pool * pool = (struct rdrb_pool *) o;
+
+        --pool->waiters;
+
+        pthread_mutex_unlock(&pool->lock);
+}
+
+#ifdef SHM_RDRB_FREELIST
+/* Pop a free block from pool p, lock held. */
+static struct shm_du_buff * pool_take(struct shm_rdrbuff * rdrb,
+                                      size_t               p,
+                                      size_t               blocks)
+{
+        struct rdrb_pool *   pool = &rdrb->pools[p];
+        struct shm_du_buff * sdb;
+        size_t               i;
+
+        assert(blocks == 1);
+        (void) blocks;
+
+        if (pool->avail == 0)
+                pool_reclaim(rdrb, p);
+
+        if (pool->avail == 0)
+                return NULL;
+
+        i = pool_stack(rdrb, p)[--pool->avail];
+
+        sdb       = blk_ptr(rdrb, p, i);
+        sdb->refs = 1;
+        sdb->idx  = pool_idx[p] + i;
+
+        return sdb;
+}
+#else
+/* Take blocks from the head of pool p, lock held. */
+static struct shm_du_buff * pool_take(struct shm_rdrbuff * rdrb,
+                                      size_t               p,
+                                      size_t               blocks)
 {
+        struct rdrb_pool *   pool      = &rdrb->pools[p];
+        struct shm_du_buff * sdb;
+        size_t               padblocks = 0;
+
+        if (blocks + pool->head > pool_len[p])
+                padblocks = pool_len[p] - pool->head;
+
+        if (!pool_free(rdrb, p, blocks + padblocks))
+                garbage_collect(rdrb, p, true);
+
+        if (!pool_free(rdrb, p, blocks + padblocks))
+                return NULL;
+
+#ifdef SHM_RDRB_MULTI_BLOCK
+        if (padblocks) {
+                sdb = get_head_ptr(rdrb, p);
+                sdb->size    = 0;
+                sdb->blocks  = padblocks;
+                sdb->refs    = 0;
+                sdb->du_head = 0;
+                sdb->du_tail = 0;
+                sdb->idx     = pool_idx[p] + pool->head;
+
+                pool->head = 0;
+        }
+#endif
+        sdb        = get_head_ptr(rdrb, p);
+        sdb->refs  = 1;
+        sdb->idx   = pool_idx[p] + pool->head;
 #ifdef SHM_RDRB_MULTI_BLOCK
+        sdb->blocks  = blocks;
+#endif
+        pool->head = (pool->head + blocks) & (pool_len[p] - 1);
+
+        return sdb;
+}
+#endif
+
+#if SHM_RDRB_CACHE_SIZE > 0
+/* Reserve a batch of single blocks in one go, cache lock held. */
+static void cache_refill(struct shm_rdrbuff * rdrb,
+                         size_t               p)
+{
+        struct rdrb_pool *   pool  = &rdrb->pools[p];
+        struct rdrb_cache *  cache = &rdrb->cache[p];
         struct shm_du_buff * sdb;
-        while (!shm_rdrb_empty(rdrb) &&
-               (sdb = get_tail_ptr(rdrb))->refs == 0)
-                *rdrb->tail = (*rdrb->tail + sdb->blocks)
-                        & ((SHM_BUFFER_SIZE) - 1);
+        size_t               n     = SHM_RDRB_CACHE_SIZE;
+        size_t               i;
+
+        pool_lock(rdrb, p);
+
+#ifdef SHM_RDRB_FREELIST
+        if (pool->avail == 0)
+                pool_reclaim(rdrb, p);
+
+        if (pool->avail < n)
+                n = pool->avail;
+
+        if (n == 0) {
+                pool_unlock(rdrb, p);
+                return;
+        }
+
+        cache->tag   = SDB_CACHED | (++pool->gen & ~SDB_CACHED);
+        cache->count = n;
+
+        for (i = 0; i < n; ++i) {
+                cache->blk[i] = pool_stack(rdrb, p)[--pool->avail];
+                sdb           = blk_ptr(rdrb, p, cache->blk[i]);
+                sdb->refs     = cache->tag;
+                sdb->idx      = pool_idx[p] + cache->blk[i];
+        }
 #else
-        while (!shm_rdrb_empty(rdrb) && get_tail_ptr(rdrb)->refs == 0)
-                *rdrb->tail = (*rdrb->tail + 1) & ((SHM_BUFFER_SIZE) - 1);
+        if (n + pool->head > pool_len[p])
+                n = pool_len[p] - pool->head;
+
+        if (!pool_free(rdrb, p, n))
+                garbage_collect(rdrb, p, true);
+
+        if (!pool_free(rdrb, p, n)) {
+                pool_unlock(rdrb, p);
+                return;
+        }
+
+        cache->tag   = SDB_CACHED | (++pool->gen & ~SDB_CACHED);
+        cache->count = n;
+
+        /* Stacked in reverse, so the run is handed out in order. */
+        for (i = 0; i < n; ++i) {
+                cache->blk[n - 1 - i] = pool->head + i;
+                sdb         = blk_ptr(rdrb, p, pool->head + i);
+                sdb->refs   = cache->tag;
+                sdb->idx    = pool_idx[p] + pool->head + i;
+#ifdef SHM_RDRB_MULTI_BLOCK
+                sdb->blocks = 1;
 #endif
-        pthread_cond_broadcast(rdrb->healthy);
+        }
+
+        pool->head = (pool->head + n) & (pool_len[p] - 1);
+#endif
+        pool_unlock(rdrb, p);
 }
 
-static void sanitize(struct shm_rdrbuff * rdrb)
+/* Blocks in the cache may have been reclaimed by a starving writer. */
+static struct shm_du_buff * cache_alloc(struct shm_rdrbuff * rdrb,
+                                        size_t               p)
 {
-        --get_head_ptr(rdrb)->refs;
-        garbage_collect(rdrb);
-        pthread_mutex_consistent(rdrb->lock);
+        struct rdrb_cache *  cache = &rdrb->cache[p];
+        struct shm_du_buff * sdb;
+
+        pthread_mutex_lock(&cache->lock);
+
+        while (true) {
+                if (cache->count == 0) {
+                        cache_refill(rdrb, p);
+                        if (cache->count == 0)
+                                break;
+                }
+
+                sdb = blk_ptr(rdrb, p, cache->blk[--cache->count]);
+
+                if (__sync_bool_compare_and_swap(&sdb->refs, cache->tag, 1)) {
+                        pthread_mutex_unlock(&cache->lock);
+                        return sdb;
+                }
+        }
+
+        pthread_mutex_unlock(&cache->lock);
+
+        return NULL;
+}
+
+static void cache_flush(struct shm_rdrbuff * rdrb,
+                        size_t               p)
+{
+        struct rdrb_cache *  cache = &rdrb->cache[p];
+        struct shm_du_buff * sdb;
+        size_t               i;
+
+        pthread_mutex_lock(&cache->lock);
+
+        if (cache->count == 0) {
+                pthread_mutex_unlock(&cache->lock);
+                return;
+        }
+
+        pool_lock(rdrb, p);
+
+        while (cache->count > 0) {
+                i   = cache->blk[--cache->count];
+                sdb = blk_ptr(rdrb, p, i);
+                if (!__sync_bool_compare_and_swap(&sdb->refs, cache->tag, 0))
+                        continue;
+#ifdef SHM_RDRB_FREELIST
+                pool_push(rdrb, p, i);
+#endif
+        }
+
+#ifndef SHM_RDRB_FREELIST
+        garbage_collect(rdrb, p, false);
+#endif
+        pool_unlock(rdrb, p);
+
+        pthread_mutex_unlock(&cache->lock);
+}
+#endif
+
+#ifdef SHM_RDRB_FREELIST
+/*
+ * Released blocks go back into the cache of this process when there
+ * is room, unless a writer is blocked waiting for the pool.
+ */
+static void rdrb_release(struct shm_rdrbuff * rdrb,
+                         size_t               p,
+                         size_t               i)
+{
+        struct shm_du_buff * sdb = blk_ptr(rdrb, p, i);
+#if SHM_RDRB_CACHE_SIZE > 0
+        struct rdrb_cache *  cache = &rdrb->cache[p];
+        size_t               tag;
+
+        pthread_mutex_lock(&cache->lock);
+
+        tag = cache->tag;
+
+        if (tag != 0 && cache->count < SHM_RDRB_CACHE_SIZE &&
+            __sync_bool_compare_and_swap(&sdb->refs, 1, tag)) {
+                cache->blk[cache->count++] = i;
+                pthread_mutex_unlock(&cache->lock);
+
+                /* Pairs with the barrier in shm_rdrbuff_write_b. */
+                __sync_synchronize();
+
+                if (*(volatile size_t *) &rdrb->pools[p].waiters == 0)
+                        return;
+
+                if (!__sync_bool_compare_and_swap(&sdb->refs, tag, 0))
+                        return;
+
+                pool_lock(rdrb, p);
+                pool_push(rdrb, p, i);
+                pool_unlock(rdrb, p);
+
+                return;
+        }
+
+        pthread_mutex_unlock(&cache->lock);
+#endif
+        if (!__sync_bool_compare_and_swap(&sdb->refs, 1, 0))
+                return;
+
+        pool_lock(rdrb, p);
+        pool_push(rdrb, p, i);
+        pool_unlock(rdrb, p);
+}
+#endif
+
+/* Smallest pool that fits, returns the number of blocks needed. */
+static ssize_t pool_select(size_t   sz,
+                           size_t * p)
+{
+        for (*p = 0; *p < SHM_RDRB_POOLS; ++*p)
+                if (sz <= pool_bsz[*p])
+                        return 1;
+
+#ifdef SHM_RDRB_MULTI_BLOCK
+        *p = SHM_RDRB_POOLS - 1;
+
+        return (sz + pool_bsz[*p] - 1) / pool_bsz[*p];
+#else
+        return -EMSGSIZE;
+#endif
+}
+
+/* Try the selected pool first, spill over into larger ones. */
+static struct shm_du_buff * rdrb_alloc(struct shm_rdrbuff * rdrb,
+                                       size_t               p,
+                                       size_t               blocks)
+{
+        struct shm_du_buff * sdb;
+
+        for (; p < SHM_RDRB_POOLS; ++p) {
+#if SHM_RDRB_CACHE_SIZE > 0
+                if (blocks == 1) {
+                        sdb = cache_alloc(rdrb, p);
+                        if (sdb != NULL)
+                                return sdb;
+                }
+#endif
+                pool_lock(rdrb, p);
+                sdb = pool_take(rdrb, p, blocks);
+                pool_unlock(rdrb, p);
+                if (sdb != NULL)
+                        return sdb;
+        }
+
+        return NULL;
+}
+
+static ssize_t sdb_init(struct shm_du_buff * sdb,
+                        size_t               headspace,
+                        size_t               tailspace,
+                        const uint8_t *      data,
+                        size_t               len)
+{
+        sdb->size    = headspace + len + tailspace;
+        sdb->du_head = headspace;
+        sdb->du_tail = sdb->du_head + len;
+
+        if (data != NULL)
+                memcpy(((uint8_t *) (sdb + 1)) + headspace, data, len);
+
+        return sdb->idx;
 }
 
 static char * rdrb_filename(void)
@@ -120,12 +620,30 @@ static char * rdrb_filename(void)
         return str;
 }
 
+static void rdrb_fini(struct shm_rdrbuff * rdrb)
+{
+#if SHM_RDRB_CACHE_SIZE > 0
+        size_t i;
+
+        for (i = 0; i < SHM_RDRB_POOLS; ++i)
+                pthread_mutex_destroy(&rdrb->cache[i].lock);
+#endif
+        free(rdrb);
+}
+
 void shm_rdrbuff_close(struct shm_rdrbuff * rdrb)
 {
+#if SHM_RDRB_CACHE_SIZE > 0
+        size_t i;
+#endif
         assert(rdrb);
 
+#if SHM_RDRB_CACHE_SIZE > 0
+        for (i = 0; i < SHM_RDRB_POOLS; ++i)
+                cache_flush(rdrb, i);
+#endif
         munmap(rdrb->shm_base, SHM_FILE_SIZE);
-        free(rdrb);
+        rdrb_fini(rdrb);
 }
 
 void shm_rdrbuff_destroy(struct shm_rdrbuff * rdrb)
@@ -135,7 +653,7 @@ void shm_rdrbuff_destroy(struct shm_rdrbuff * rdrb)
         assert(rdrb);
 
         if (getpid() != *rdrb->pid && kill(*rdrb->pid, 0) == 0) {
-                free(rdrb);
+                rdrb_fini(rdrb);
                 return;
         }
 
@@ -157,6 +675,9 @@ static struct shm_rdrbuff * rdrb_create(int flags)
         int                  fd;
         uint8_t *            shm_base;
         char *               shm_rdrb_fn;
+#if SHM_RDRB_CACHE_SIZE > 0
+        size_t               i;
+#endif
 
         shm_rdrb_fn = rdrb_filename();
         if (shm_rdrb_fn == NULL)
@@ -166,6 +687,14 @@ static struct shm_rdrbuff * rdrb_create(int flags)
         if (rdrb == NULL)
                 goto fail_rdrb;
 
+#if SHM_RDRB_CACHE_SIZE > 0
+        for (i = 0; i < SHM_RDRB_POOLS; ++i) {
+                if (pthread_mutex_init(&rdrb->cache[i].lock, NULL))
+                        goto fail_cache;
+                rdrb->cache[i].count = 0;
+                rdrb->cache[i].tag   = 0;
+        }
+#endif
         fd = shm_open(shm_rdrb_fn, flags, 0666);
         if (fd == -1)
                 goto fail_open;
@@ -180,11 +709,13 @@ static struct shm_rdrbuff * rdrb_create(int flags)
         close(fd);
 
         rdrb->shm_base = shm_base;
-        rdrb->head = (size_t *) ((uint8_t *) rdrb->shm_base + SHM_BLOCKS_SIZE);
-        rdrb->tail = rdrb->head + 1;
-        rdrb->lock = (pthread_mutex_t *) (rdrb->tail + 1);
-        rdrb->healthy = (pthread_cond_t *) (rdrb->lock + 1);
-        rdrb->pid = (pid_t *) (rdrb->healthy + 1);
+        rdrb->pools = (struct rdrb_pool *) (rdrb->shm_base + SHM_BLOCKS_SIZE);
+#ifdef SHM_RDRB_FREELIST
+        rdrb->stack = (size_t *) (rdrb->pools + SHM_RDRB_POOLS);
+        rdrb->pid = (pid_t *) (rdrb->stack + SHM_RDRB_BLOCKS);
+#else
+        rdrb->pid = (pid_t *) (rdrb->pools + SHM_RDRB_POOLS);
+#endif
 
         free(shm_rdrb_fn);
 
@@ -195,6 +726,12 @@ static struct shm_rdrbuff * rdrb_create(int flags)
         if (flags & O_CREAT)
                 shm_unlink(shm_rdrb_fn);
  fail_open:
+#if SHM_RDRB_CACHE_SIZE > 0
+        i = SHM_RDRB_POOLS;
+ fail_cache:
+        while (i-- > 0)
+                pthread_mutex_destroy(&rdrb->cache[i].lock);
+#endif
         free(rdrb);
  fail_rdrb:
         free(shm_rdrb_fn);
@@ -208,6 +745,10 @@ struct shm_rdrbuff * shm_rdrbuff_create()
         mode_t               mask;
         pthread_mutexattr_t  mattr;
         pthread_condattr_t   cattr;
+        size_t               i;
+#ifdef SHM_RDRB_FREELIST
+        size_t               j;
+#endif
 
         mask = umask(0);
 
@@ -225,9 +766,6 @@ struct shm_rdrbuff * shm_rdrbuff_create()
 #ifdef HAVE_ROBUST_MUTEX
         pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST);
 #endif
-        if (pthread_mutex_init(rdrb->lock, &mattr))
-                goto fail_mutex;
-
         if (pthread_condattr_init(&cattr))
                 goto fail_cattr;
 
@@ -235,11 +773,28 @@ struct shm_rdrbuff * shm_rdrbuff_create()
 #ifndef __APPLE__
         pthread_condattr_setclock(&cattr, PTHREAD_COND_CLOCK);
 #endif
-        if (pthread_cond_init(rdrb->healthy, &cattr))
-                goto fail_healthy;
+        for (i = 0; i < SHM_RDRB_POOLS; ++i) {
+                if (pthread_mutex_init(&rdrb->pools[i].lock, &mattr))
+                        goto fail_pool;
+
+                if (pthread_cond_init(&rdrb->pools[i].healthy, &cattr)) {
+                        pthread_mutex_destroy(&rdrb->pools[i].lock);
+                        goto fail_pool;
+                }
 
-        *rdrb->head = 0;
-        *rdrb->tail = 0;
+#ifdef SHM_RDRB_FREELIST
+                /* Stacked in reverse, so blocks are handed out in order. */
+                for (j = 0; j < pool_len[i]; ++j)
+                        pool_stack(rdrb, i)[j] = pool_len[i] - 1 - j;
+
+                rdrb->pools[i].avail = pool_len[i];
+#else
+                rdrb->pools[i].head = 0;
+                rdrb->pools[i].tail = 0;
+#endif
+                rdrb->pools[i].gen     = 0;
+                rdrb->pools[i].waiters = 0;
+        }
 
         *rdrb->pid = getpid();
 
@@ -248,11 +803,13 @@ struct shm_rdrbuff * shm_rdrbuff_create()
 
         return rdrb;
 
- fail_healthy:
+ fail_pool:
+        while (i-- > 0) {
+                pthread_cond_destroy(&rdrb->pools[i].healthy);
+                pthread_mutex_destroy(&rdrb->pools[i].lock);
+        }
         pthread_condattr_destroy(&cattr);
  fail_cattr:
-        pthread_mutex_destroy(rdrb->lock);
- fail_mutex:
         pthread_mutexattr_destroy(&mattr);
  fail_mattr:
         shm_rdrbuff_destroy(rdrb);
@@ -284,75 +841,20 @@ ssize_t shm_rdrbuff_write(struct shm_rdrbuff * rdrb,
                           size_t               len)
 {
         struct shm_du_buff * sdb;
-        size_t               size = headspace + len + tailspace;
-#ifdef SHM_RDRB_MULTI_BLOCK
-        size_t               blocks = 0;
-        size_t               padblocks = 0;
-#endif
-        ssize_t              sz = size + sizeof(*sdb);
+        size_t               p;
+        ssize_t              blocks;
 
         assert(rdrb);
 
-#ifndef SHM_RDRB_MULTI_BLOCK
-        if (sz > SHM_RDRB_BLOCK_SIZE)
-                return -EMSGSIZE;
-#else
-        while (sz > 0) {
-                sz -= SHM_RDRB_BLOCK_SIZE;
-                ++blocks;
-        }
-#endif
-#ifndef HAVE_ROBUST_MUTEX
-        pthread_mutex_lock(rdrb->lock);
-#else
-        if (pthread_mutex_lock(rdrb->lock) == EOWNERDEAD)
-                sanitize(rdrb);
-#endif
-#ifdef SHM_RDRB_MULTI_BLOCK
-        if (blocks + *rdrb->head > (SHM_BUFFER_SIZE))
-                padblocks = (SHM_BUFFER_SIZE) - *rdrb->head;
+        blocks = pool_select(headspace + len + tailspace + sizeof(*sdb), &p);
+        if (blocks < 0)
+                return blocks;
 
-        if (!shm_rdrb_free(rdrb, blocks + padblocks)) {
-#else
-        if (!shm_rdrb_free(rdrb, 1)) {
-#endif
-                pthread_mutex_unlock(rdrb->lock);
+        sdb = rdrb_alloc(rdrb, p, blocks);
+        if (sdb == NULL)
                 return -EAGAIN;
-        }
-
-#ifdef SHM_RDRB_MULTI_BLOCK
-        if (padblocks) {
-                sdb = get_head_ptr(rdrb);
-                sdb->size    = 0;
-                sdb->blocks  = padblocks;
-                sdb->refs    = 0;
-                sdb->du_head = 0;
-                sdb->du_tail = 0;
-                sdb->idx     = *rdrb->head;
-
-                *rdrb->head = 0;
-        }
-#endif
-        sdb        = get_head_ptr(rdrb);
-        sdb->refs  = 1;
-        sdb->idx   = *rdrb->head;
-#ifdef SHM_RDRB_MULTI_BLOCK
-        sdb->blocks  = blocks;
-
-        *rdrb->head = (*rdrb->head + blocks) & ((SHM_BUFFER_SIZE) - 1);
-#else
-        *rdrb->head = (*rdrb->head + 1) & ((SHM_BUFFER_SIZE) - 1);
-#endif
-        pthread_mutex_unlock(rdrb->lock);
-
-        sdb->size    = size;
-        sdb->du_head = headspace;
-        sdb->du_tail = sdb->du_head + len;
 
-        if (data != NULL)
-                memcpy(((uint8_t *) (sdb + 1)) + headspace, data, len);
-
-        return sdb->idx;
+        return sdb_init(sdb, headspace, tailspace, data, len);
 }
 
 ssize_t shm_rdrbuff_write_b(struct shm_rdrbuff *    rdrb,
@@ -363,94 +865,49 @@ ssize_t shm_rdrbuff_write_b(struct shm_rdrbuff *    rdrb,
                             const struct timespec * abstime)
 {
         struct shm_du_buff * sdb;
-        size_t               size      = headspace + len + tailspace;
-#ifdef SHM_RDRB_MULTI_BLOCK
-        size_t               blocks    = 0;
-        size_t               padblocks = 0;
-#endif
-        ssize_t              sz        = size + sizeof(*sdb);
-        int                  ret       = 0;
+        struct rdrb_pool *   pool;
+        size_t               p;
+        ssize_t              blocks;
+        int                  ret = 0;
 
         assert(rdrb);
 
-#ifndef SHM_RDRB_MULTI_BLOCK
-        if (sz > SHM_RDRB_BLOCK_SIZE)
-                return -EMSGSIZE;
-#else
-        while (sz > 0) {
-                sz -= SHM_RDRB_BLOCK_SIZE;
-                ++blocks;
-        }
-#endif
-#ifndef HAVE_ROBUST_MUTEX
-        pthread_mutex_lock(rdrb->lock);
-#else
-        if (pthread_mutex_lock(rdrb->lock) == EOWNERDEAD)
-                sanitize(rdrb);
-#endif
-        pthread_cleanup_push((void (*) (void *)) pthread_mutex_unlock,
-                             (void *) rdrb->lock);
+        blocks = pool_select(headspace + len + tailspace + sizeof(*sdb), &p);
+        if (blocks < 0)
+                return blocks;
 
-#ifdef SHM_RDRB_MULTI_BLOCK
-        if (blocks + *rdrb->head > (SHM_BUFFER_SIZE))
-                padblocks = (SHM_BUFFER_SIZE) - *rdrb->head;
+        sdb = rdrb_alloc(rdrb, p, blocks);
+        if (sdb != NULL)
+                return sdb_init(sdb, headspace, tailspace, data, len);
 
-        while (!shm_rdrb_free(rdrb, blocks + padblocks) && ret != ETIMEDOUT) {
-#else
-        while (!shm_rdrb_free(rdrb, 1) && ret != ETIMEDOUT) {
-#endif
-                if (abstime != NULL)
-                        ret = pthread_cond_timedwait(rdrb->healthy,
-                                                     rdrb->lock,
-                                                     abstime);
-                else
-                        ret = pthread_cond_wait(rdrb->healthy, rdrb->lock);
+        /* All candidate pools are full, wait on the preferred one. */
+        pool = &rdrb->pools[p];
 
-#ifdef SHM_RDRB_MULTI_BLOCK
-                if (blocks + *rdrb->head > (SHM_BUFFER_SIZE))
-                        padblocks = (SHM_BUFFER_SIZE) - *rdrb->head;
-#endif
-        }
+        pool_lock(rdrb, p);
 
-        if (ret != ETIMEDOUT) {
-#ifdef SHM_RDRB_MULTI_BLOCK
-                if (padblocks) {
-                        sdb = get_head_ptr(rdrb);
-                        sdb->size    = 0;
-                        sdb->blocks  = padblocks;
-                        sdb->refs    = 0;
-                        sdb->du_head = 0;
-                        sdb->du_tail = 0;
-                        sdb->idx     = *rdrb->head;
-
-                        *rdrb->head = 0;
-                }
-#endif
-                sdb        = get_head_ptr(rdrb);
-                sdb->refs  = 1;
-                sdb->idx   = *rdrb->head;
-#ifdef SHM_RDRB_MULTI_BLOCK
-                sdb->blocks  = blocks;
+        ++pool->waiters;
 
-                *rdrb->head = (*rdrb->head + blocks) & ((SHM_BUFFER_SIZE) - 1);
-#else
-                *rdrb->head = (*rdrb->head + 1) & ((SHM_BUFFER_SIZE) - 1);
-#endif
+        /* Releases check for waiters before caching a block. */
+        __sync_synchronize();
+
+        pthread_cleanup_push(pool_cancel, (void *) pool);
+
+        while ((sdb = pool_take(rdrb, p, blocks)) == NULL
+               && ret != ETIMEDOUT) {
+                if (abstime != NULL)
+                        ret = pthread_cond_timedwait(&pool->healthy,
+                                                     &pool->lock,
+                                                     abstime);
+                else
+                        ret = pthread_cond_wait(&pool->healthy, &pool->lock);
         }
 
         pthread_cleanup_pop(true);
 
-        if (ret == ETIMEDOUT)
+        if (sdb == NULL)
                 return -ETIMEDOUT;
 
-        sdb->size    = size;
-        sdb->du_head = headspace;
-        sdb->du_tail = sdb->du_head + len;
-
-        if (data != NULL)
-                memcpy(((uint8_t *) (sdb + 1)) + headspace, data, len);
-
-        return sdb->idx;
+        return sdb_init(sdb, headspace, tailspace, data, len);
 }
 
 ssize_t shm_rdrbuff_read(uint8_t **           dst,
@@ -461,7 +918,7 @@ ssize_t shm_rdrbuff_read(uint8_t **           dst,
 
         assert(dst);
         assert(rdrb);
-        assert(idx < (SHM_BUFFER_SIZE));
+        assert(idx < (SHM_RDRB_BLOCKS));
 
         sdb = idx_to_du_buff_ptr(rdrb, idx);
         *dst = ((uint8_t *) (sdb + 1)) + sdb->du_head;
@@ -473,7 +930,7 @@ struct shm_du_buff * shm_rdrbuff_get(struct shm_rdrbuff * rdrb,
                                      size_t               idx)
 {
         assert(rdrb);
-        assert(idx < (SHM_BUFFER_SIZE));
+        assert(idx < (SHM_RDRB_BLOCKS));
 
         return idx_to_du_buff_ptr(rdrb, idx);
 }
@@ -481,29 +938,35 @@ struct shm_du_buff * shm_rdrbuff_get(struct shm_rdrbuff * rdrb,
 int shm_rdrbuff_remove(struct shm_rdrbuff * rdrb,
                        size_t               idx)
 {
+#ifndef SHM_RDRB_FREELIST
         struct shm_du_buff * sdb;
+#endif
+        size_t               p;
 
         assert(rdrb);
-        assert(idx < (SHM_BUFFER_SIZE));
+        assert(idx < (SHM_RDRB_BLOCKS));
 
-#ifndef HAVE_ROBUST_MUTEX
-        pthread_mutex_lock(rdrb->lock);
+        p = idx_to_pool(idx);
+
+#ifdef SHM_RDRB_FREELIST
+        rdrb_release(rdrb, p, idx - pool_idx[p]);
 #else
-        if (pthread_mutex_lock(rdrb->lock) == EOWNERDEAD)
-                sanitize(rdrb);
-#endif
-        assert(!shm_rdrb_empty(rdrb));
+        sdb = blk_ptr(rdrb, p, idx - pool_idx[p]);
 
-        sdb = idx_to_du_buff_ptr(rdrb, idx);
+        /* Only stack needs it, can be removed. */
+        if (!__sync_bool_compare_and_swap(&sdb->refs, 1, 0))
+                return 0;
 
-        if (sdb->refs == 1) { /* only stack needs it, can be removed */
-                sdb->refs = 0;
-                if (idx == *rdrb->tail)
-                        garbage_collect(rdrb);
-        }
+        /* Only a release at the tail lets the collector make progress. */
+        if (idx - pool_idx[p] != *(volatile size_t *) &rdrb->pools[p].tail)
+                return 0;
 
-        pthread_mutex_unlock(rdrb->lock);
+        pool_lock(rdrb, p);
 
+        garbage_collect(rdrb, p, false);
+
+        pool_unlock(rdrb, p);
+#endif
         return 0;
 }
 
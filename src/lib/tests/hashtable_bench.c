@@ -0,0 +1,177 @@
+/*
+ * Ouroboros - Copyright (C) 2016 - 2018
+ *
+ * Benchmark of the hash table, not run as part of the tests
+ *
+ *    Dimitri Staessens <dimitri.staessens@ugent.be>
+ *    Sander Vrijders   <sander.vrijders@ugent.be>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., http://www.fsf.org/about/contact/.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <ouroboros/hashtable.h>
+
+#include <ouroboros/list.h>
+#include <ouroboros/time_utils.h>
+
+#include <stdio.h>
+#include <time.h>
+
+#define BENCH_KEYS    (1 << 16)
+#define BENCH_LOOKUPS (1 << 22)
+#define BENCH_BUCKETS 4096
+
+/* The separately chained table this one replaced, for reference. */
+struct chain_entry {
+        struct list_head next;
+        uint64_t         key;
+        void *           val;
+};
+
+static struct list_head chains[BENCH_BUCKETS];
+
+static int chain_insert(uint64_t key,
+                        int      val)
+{
+        struct chain_entry * e;
+
+        e = malloc(sizeof(*e));
+        if (e == NULL)
+                return -1;
+
+        e->val = malloc(sizeof(int));
+        if (e->val == NULL) {
+                free(e);
+                return -1;
+        }
+
+        *((int *) e->val) = val;
+        e->key = key;
+
+        list_add(&e->next, &chains[key & (BENCH_BUCKETS - 1)]);
+
+        return 0;
+}
+
+static int chain_lookup(uint64_t key)
+{
+        struct list_head * p;
+
+        list_for_each(p, &chains[key & (BENCH_BUCKETS - 1)]) {
+                struct chain_entry * e;
+                e = list_entry(p, struct chain_entry, next);
+                if (e->key == key)
+                        return *((int *) e->val);
+        }
+
+        return -1;
+}
+
+static void chain_destroy(void)
+{
+        struct list_head * p;
+        struct list_head * n;
+        int                i;
+
+        for (i = 0; i < BENCH_BUCKETS; ++i) {
+                list_for_each_safe(p, n, &chains[i]) {
+                        struct chain_entry * e;
+                        e = list_entry(p, struct chain_entry, next);
+                        list_del(&e->next);
+                        free(e->val);
+                        free(e);
+                }
+        }
+}
+
+/* Random-looking addresses, as handed out by the flat address auth. */
+static uint64_t bench_key(uint64_t i)
+{
+        return (i * 0x9e3779b97f4a7c15ULL) >> 32;
+}
+
+int main(int argc, char ** argv)
+{
+        struct htable * table;
+        struct timespec t0;
+        struct timespec t1;
+        uint64_t        i;
+        int64_t         val;
+        long            sum = 0;
+        long            chk = 0;
+
+        (void) argc;
+        (void) argv;
+
+        table = htable_create(BENCH_BUCKETS, true);
+        if (table == NULL) {
+                printf("Failed to create.\n");
+                return -1;
+        }
+
+        for (i = 0; i < BENCH_BUCKETS; ++i)
+                list_head_init(&chains[i]);
+
+        for (i = 0; i < BENCH_KEYS; ++i) {
+                if (htable_insert_num(table, bench_key(i), i)) {
+                        printf("Failed to insert.\n");
+                        goto fail;
+                }
+
+                if (chain_insert(bench_key(i), i)) {
+                        printf("Failed to insert in chains.\n");
+                        goto fail;
+                }
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+
+        for (i = 0; i < BENCH_LOOKUPS; ++i)
+                chk += chain_lookup(bench_key(i & (BENCH_KEYS - 1)));
+
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+
+        printf("Chained:        %4ld ns per lookup.\n",
+               (long) (ts_diff_ns(&t0, &t1) / BENCH_LOOKUPS));
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+
+        for (i = 0; i < BENCH_LOOKUPS; ++i) {
+                if (htable_lookup_num(table, bench_key(i & (BENCH_KEYS - 1)),
+                                      &val))
+                        break;
+                sum += val;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+
+        printf("Open addressed: %4ld ns per lookup.\n",
+               (long) (ts_diff_ns(&t0, &t1) / BENCH_LOOKUPS));
+
+        if (sum != chk) {
+                printf("Lookups returned wrong values.\n");
+                goto fail;
+        }
+
+        chain_destroy();
+        htable_destroy(table);
+
+        return 0;
+ fail:
+        chain_destroy();
+        htable_destroy(table);
+        return -1;
+}
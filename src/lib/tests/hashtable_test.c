@@ -26,10 +26,79 @@
 
 #define HASHTABLE_SIZE 256
 #define INT_TEST 4
+#define NUM_KEYS (1 << 12)
+
+static void * dup(const void * val,
+                  size_t       len)
+{
+        int * j;
+
+        (void) len;
+
+        j = malloc(sizeof(*j));
+        if (j == NULL)
+                return NULL;
+
+        *j = *((const int *) val);
+
+        return j;
+}
+
+/* Enough keys to grow the table, then delete every other one. */
+static int test_num(void)
+{
+        struct htable * table;
+        uint64_t        i;
+        int64_t         val;
+
+        table = htable_create(HASHTABLE_SIZE, true);
+        if (table == NULL) {
+                printf("Failed to create.\n");
+                return -1;
+        }
+
+        for (i = 0; i < NUM_KEYS; ++i) {
+                if (htable_insert_num(table, i * 0x9e3779b97f4a7c15ULL, i)) {
+                        printf("Failed to insert number.\n");
+                        goto fail;
+                }
+        }
+
+        for (i = 0; i < NUM_KEYS; ++i) {
+                if (htable_lookup_num(table, i * 0x9e3779b97f4a7c15ULL, &val)
+                    || val != (int64_t) i) {
+                        printf("Failed to lookup number.\n");
+                        goto fail;
+                }
+        }
+
+        for (i = 0; i < NUM_KEYS; i += 2) {
+                if (htable_delete(table, i * 0x9e3779b97f4a7c15ULL)) {
+                        printf("Failed to delete number.\n");
+                        goto fail;
+                }
+        }
+
+        for (i = 0; i < NUM_KEYS; ++i) {
+                if ((htable_lookup_num(table, i * 0x9e3779b97f4a7c15ULL,
+                                       &val) == 0) != (i & 1)) {
+                        printf("Wrong lookup after deletion.\n");
+                        goto fail;
+                }
+        }
+
+        htable_destroy(table);
+
+        return 0;
+ fail:
+        htable_destroy(table);
+        return -1;
+}
 
 int hashtable_test(int argc, char ** argv)
 {
         struct htable * table;
+        struct htable * copy;
         int             i;
         int *           j;
         void *          el;
@@ -123,7 +192,30 @@ int hashtable_test(int argc, char ** argv)
                 return -1;
         }
 
+        copy = htable_copy(table, dup);
+        if (copy == NULL) {
+                printf("Failed to copy.\n");
+                htable_destroy(table);
+                return -1;
+        }
+
         htable_destroy(table);
 
-        return 0;
+        if (htable_lookup(copy, HASHTABLE_SIZE + INT_TEST, &el, &len)) {
+                printf("Failed to lookup in copy.\n");
+                htable_destroy(copy);
+                return -1;
+        }
+
+        j = (int *) el;
+        if (*j != HASHTABLE_SIZE + INT_TEST) {
+                printf("Copy returned wrong value (%d != %d).\n",
+                       HASHTABLE_SIZE + INT_TEST, *j);
+                htable_destroy(copy);
+                return -1;
+        }
+
+        htable_destroy(copy);
+
+        return test_num();
 }
@@ -76,8 +76,10 @@
 #define FLAT_RANDOM_ADDR_AUTH  "flat"
 #define LINK_STATE_ROUTING     "link_state"
 #define LINK_STATE_LFA_ROUTING "lfa"
+#define LINK_STATE_ECMP_ROUTING "ecmp"
 #define SIMPLE_PFF             "simple"
 #define ALTERNATE_PFF          "alternate"
+#define MULTIPATH_PFF          "multipath"
 
 static void usage(void)
 {
@@ -99,8 +101,9 @@ static void usage(void)
                "                [autobind]\n"
                "where ADDRESS_POLICY = {"FLAT_RANDOM_ADDR_AUTH"}\n"
                "      ROUTING_POLICY = {"LINK_STATE_ROUTING " "
-               LINK_STATE_LFA_ROUTING "}\n"
-               "      PFF_POLICY = {" SIMPLE_PFF " " ALTERNATE_PFF "}\n"
+               LINK_STATE_LFA_ROUTING " " LINK_STATE_ECMP_ROUTING "}\n"
+               "      PFF_POLICY = {" SIMPLE_PFF " " ALTERNATE_PFF " "
+               MULTIPATH_PFF "}\n"
                "      ALGORITHM = {" SHA3_224 " " SHA3_256 " "
                SHA3_384 " " SHA3_512 "}\n\n"
                "if TYPE == " UDP "\n"
@@ -216,6 +219,9 @@ int do_bootstrap_ipcp(int     argc,
                         else if (strcmp(LINK_STATE_LFA_ROUTING,
                                         *(argv + 1)) == 0)
                                 routing_type = ROUTING_LINK_STATE_LFA;
+                        else if (strcmp(LINK_STATE_ECMP_ROUTING,
+                                        *(argv + 1)) == 0)
+                                routing_type = ROUTING_LINK_STATE_ECMP;
                         else
                                 goto unknown_param;
                 } else if (matches(*argv, "pff") == 0) {
@@ -223,6 +229,8 @@ int do_bootstrap_ipcp(int     argc,
                                 pff_type = PFF_SIMPLE;
                         else if (strcmp(ALTERNATE_PFF, *(argv + 1)) == 0)
                                 pff_type = PFF_ALTERNATE;
+                        else if (strcmp(MULTIPATH_PFF, *(argv + 1)) == 0)
+                                pff_type = PFF_MULTIPATH;
                         else
                                 goto unknown_param;
                 } else {
@@ -80,6 +80,7 @@ struct c {
         bool   sleep;
         int    duration;
         int    size;
+        int    batch;
 
         unsigned long sent;
         unsigned long rcvd;
@@ -119,6 +120,8 @@ static void usage(void)
                "  -d, --duration            Test duration (default 60s)\n"
                "  -r, --rate                Rate (b/s)\n"
                "  -s, --size                Payload size (B, default 1500)\n"
+               "  -b, --batch               Packets per write call"
+               " (default 1)\n"
                "  -f, --flood               Send packets as fast as possible\n"
                "      --sleep               Sleep in between sending packets\n"
                "\n"
@@ -170,6 +173,7 @@ int main(int argc, char ** argv)
 
         client.server_name = NULL;
         client.size = 1500;
+        client.batch = 1;
         client.duration = 60000;
         server.timeout = 1000; /* ms */
         client.rate = 1000000;
@@ -185,6 +189,10 @@ int main(int argc, char ** argv)
                            strcmp(*argv, "--size") == 0) {
                         client.size = strtol(*(++argv), &rem, 10);
                         --argc;
+                } else if (strcmp(*argv, "-b") == 0 ||
+                           strcmp(*argv, "--batch") == 0) {
+                        client.batch = strtol(*(++argv), &rem, 10);
+                        --argc;
                 } else if (strcmp(*argv, "-d") == 0 ||
                            strcmp(*argv, "--duration") == 0) {
                         client.duration = strtol(*(++argv), &rem, 10);
@@ -243,6 +251,11 @@ int main(int argc, char ** argv)
                         client.size = 64;
                 }
 
+                if (client.batch < 1) {
+                        printf("Batch size set to 1 packet.\n");
+                        client.batch = 1;
+                }
+
                 ret = client_main();
         }
 
@@ -64,6 +64,52 @@ void shutdown_client(int signo, siginfo_t * info, void * c)
         }
 }
 
+static void * batch_reader(int fd)
+{
+        struct iovec * iov;
+        char *         buf;
+        ssize_t        n;
+        int            i;
+
+        buf = malloc(client.size * client.batch);
+        if (buf == NULL)
+                return (void *) -ENOMEM;
+
+        iov = malloc(client.batch * sizeof(*iov));
+        if (iov == NULL) {
+                free(buf);
+                return (void *) -ENOMEM;
+        }
+
+        while (!stop) {
+                for (i = 0; i < client.batch; ++i) {
+                        iov[i].iov_base = buf + i * client.size;
+                        iov[i].iov_len  = client.size;
+                }
+
+                n = flow_readv(fd, iov, client.batch);
+                if (n == -ETIMEDOUT) {
+                        printf("Server timed out.\n");
+                        stop = true;
+                        break;
+                }
+
+                for (i = 0; i < n; ++i) {
+                        if (iov[i].iov_len != (size_t) client.size) {
+                                printf("Invalid message on fd %d.\n", fd);
+                                continue;
+                        }
+
+                        ++client.rcvd;
+                }
+        }
+
+        free(iov);
+        free(buf);
+
+        return (void *) 0;
+}
+
 void * reader(void * o)
 {
         struct timespec timeout = {2, 0};
@@ -74,6 +120,9 @@ void * reader(void * o)
 
         fccntl(fd, FLOWSRCVTIMEO, &timeout);
 
+        if (client.batch > 1)
+                return batch_reader(fd);
+
         while (!stop) {
                 msg_len = flow_read(fd, buf, OPERF_BUF_SIZE);
                 if (msg_len == -ETIMEDOUT) {
@@ -96,26 +145,42 @@ void * reader(void * o)
 void * writer(void * o)
 {
         int * fdp = (int *) o;
-        long gap = client.size * 8.0 * (BILLION / (double) client.rate);
+        long gap = client.size * client.batch * 8.0 *
+                (BILLION / (double) client.rate);
 
         struct timespec now;
         struct timespec start;
         struct timespec intv = {(gap / BILLION), gap % BILLION};
         struct timespec end = {0, 0};
 
-        char *       buf;
-        struct msg * msg;
+        char *         buf;
+        struct msg *   msg;
+        struct iovec * iov;
+        ssize_t        n;
+        int            i;
 
-        buf = malloc(client.size);
+        buf = malloc(client.size * client.batch);
         if (buf == NULL)
                 return (void *) -ENOMEM;
 
+        iov = malloc(client.batch * sizeof(*iov));
+        if (iov == NULL) {
+                free(buf);
+                return (void *) -ENOMEM;
+        }
+
         if (fdp == NULL) {
+                free(iov);
                 free(buf);
                 return (void *) -EINVAL;
         }
 
-        memset(buf, 0, client.size);
+        memset(buf, 0, client.size * client.batch);
+
+        for (i = 0; i < client.batch; ++i) {
+                iov[i].iov_base = buf + i * client.size;
+                iov[i].iov_len  = client.size;
+        }
 
         msg = (struct msg *) buf;
 
@@ -139,17 +204,36 @@ void * writer(void * o)
                         ts_add(&now, &intv, &end);
                 }
 
-                msg->id = client.sent;
+                if (client.batch > 1) {
+                        for (i = 0; i < client.batch; ++i) {
+                                msg = (struct msg *) iov[i].iov_base;
+                                msg->id = client.sent + i;
+                        }
+
+                        n = flow_writev(*fdp, iov, client.batch);
+                        if (n < 0) {
+                                printf("Failed to send packets.\n");
+                                flow_dealloc(*fdp);
+                                free(iov);
+                                free(buf);
+                                return (void *) -1;
+                        }
+
+                        client.sent += n;
+                } else {
+                        msg->id = client.sent;
+
+                        if (flow_write(*fdp, buf, client.size) == -1) {
+                                printf("Failed to send packet.\n");
+                                flow_dealloc(*fdp);
+                                free(iov);
+                                free(buf);
+                                return (void *) -1;
+                        }
 
-                if (flow_write(*fdp, buf, client.size) == -1) {
-                        printf("Failed to send packet.\n");
-                        flow_dealloc(*fdp);
-                        free(buf);
-                        return (void *) -1;
+                        ++client.sent;
                 }
 
-                ++client.sent;
-
                 if (!client.flood) {
                         if (client.sleep)
                                 nanosleep(&intv, NULL);
@@ -160,6 +244,7 @@ void * writer(void * o)
                 }
         }
 
+        free(iov);
         free(buf);
 
         printf("Test finished.\n");